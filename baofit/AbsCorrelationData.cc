@@ -2,6 +2,7 @@
 
 #include "baofit/AbsCorrelationData.h"
 #include "baofit/RuntimeError.h"
+#include "baofit/TextTableReader.h"
 
 #include "likely/CovarianceMatrix.h"
 #include "likely/AbsBinning.h"
@@ -9,14 +10,16 @@
 
 #include "boost/lexical_cast.hpp"
 #include "boost/algorithm/string.hpp"
-#include "boost/spirit/include/qi.hpp"
-#include "boost/spirit/include/phoenix_core.hpp"
-#include "boost/spirit/include/phoenix_operator.hpp"
-#include "boost/spirit/include/phoenix_stl.hpp"
 #include "boost/smart_ptr.hpp"
+#include "boost/cstdint.hpp"
+#include "boost/interprocess/file_mapping.hpp"
+#include "boost/interprocess/mapped_region.hpp"
 
 #include <fstream>
 #include <iostream>
+#include <cstring>
+
+#include <sys/stat.h>
 
 namespace local = baofit;
 
@@ -149,123 +152,200 @@ likely::BinnedGrid local::createCorrelationGrid(std::string const &axis1Bins, st
     return likely::BinnedGrid(axis1ptr,axis2ptr,axis3ptr);    
 }
 
-namespace qi = boost::spirit::qi;
-namespace ascii = boost::spirit::ascii;
-namespace phoenix = boost::phoenix;
+namespace baofit {
+    // Header of the binary correlation data container described in saveCorrelationDataBinary.
+    struct CorrelationDataHeader {
+        char magic[8];
+        boost::int32_t version, flags;
+        boost::int64_t nbins, ndata, reserved;
+    };
+    const char correlationDataMagic[8] = { 'B','A','O','F','I','T','C','D' };
+    const boost::int32_t correlationDataVersion = 1;
+    // Bits of the header flags word.
+    enum CorrelationDataFlags { HasCovariance = 1, IsInverse = 2, HasCustomGrid = 4 };
+    // Returns true if the specified file exists and stores its modification time.
+    bool getModificationTime(std::string const &filename, time_t &mtime) {
+        struct stat info;
+        if(0 != ::stat(filename.c_str(),&info)) return false;
+        mtime = info.st_mtime;
+        return true;
+    }
+    // Loads the data, (inverse) covariance and optional custom bin centers from the specified
+    // binary container into binnedData, and sets haveGrid if custom bin centers were loaded.
+    // Returns false, without changing binnedData, if the container does not have the requested
+    // kind of data and covariance.
+    bool loadCorrelationDataBinary(std::string const &binName, AbsCorrelationDataPtr binnedData,
+    bool verbose, bool icov, bool weighted, bool customGrid, bool &haveGrid) {
+        namespace bip = boost::interprocess;
+        bip::mapped_region region;
+        try {
+            bip::file_mapping mapping(binName.c_str(),bip::read_only);
+            bip::mapped_region(mapping,bip::read_only).swap(region);
+        }
+        catch(bip::interprocess_exception const &e) {
+            throw RuntimeError("loadCorrelationData: Unable to map " + binName + ": " + e.what());
+        }
+        std::size_t size = region.get_size();
+        char const *base = static_cast<char const*>(region.get_address());
+        // Validate the header.
+        CorrelationDataHeader header;
+        if(size < sizeof(header)) throw RuntimeError("loadCorrelationData: missing header in " + binName);
+        std::memcpy(&header,base,sizeof(header));
+        if(0 != std::memcmp(header.magic,correlationDataMagic,sizeof(header.magic))) {
+            throw RuntimeError("loadCorrelationData: invalid header in " + binName);
+        }
+        if(header.version != correlationDataVersion) {
+            throw RuntimeError("loadCorrelationData: unsupported version " +
+                boost::lexical_cast<std::string>(header.version) + " in " + binName);
+        }
+        int nbins = binnedData->getGrid().getNBinsTotal();
+        if(header.nbins != nbins) {
+            throw RuntimeError("loadCorrelationData: number of bins in " + binName +
+                " does not match the data grid.");
+        }
+        if(header.ndata < 0 || header.ndata > nbins) {
+            throw RuntimeError("loadCorrelationData: invalid number of data values in " + binName);
+        }
+        // Containers only store unweighted data, with their covariance or its inverse.
+        if(weighted || !(header.flags & HasCovariance) || icov != bool(header.flags & IsInverse)) {
+            if(verbose) {
+                std::cout << "Ignoring " << binName << " since it does not have the requested "
+                    << (weighted ? "weighted data." : (icov ? "inverse covariance." : "covariance.")) << std::endl;
+            }
+            return false;
+        }
+        std::size_t ndata(header.ndata), ncov(0), ngrid(0);
+        if(header.flags & HasCovariance) ncov = (ndata*(ndata+1))/2;
+        if(header.flags & HasCustomGrid) ngrid = 3*(std::size_t)nbins;
+        if(size != sizeof(header) + ndata*sizeof(boost::int64_t) + (ndata + ncov + ngrid)*sizeof(double)) {
+            throw RuntimeError("loadCorrelationData: unexpected size of " + binName);
+        }
+        boost::int64_t const *index = reinterpret_cast<boost::int64_t const*>(base + sizeof(header));
+        double const *data = reinterpret_cast<double const*>(index + ndata);
+        double const *cov = data + ndata;
+        double const *grid = cov + ncov;
+        // Fill the data values.
+        for(std::size_t k = 0; k < ndata; ++k) {
+            if(index[k] < 0 || index[k] >= nbins) {
+                throw RuntimeError("loadCorrelationData: invalid bin index in " + binName);
+            }
+            binnedData->setData(index[k],data[k]);
+        }
+        if(verbose) {
+            std::cout << "Read " << binnedData->getNBinsWithData() << " of " << nbins
+                << " data values from " << binName << std::endl;
+        }
+        // Fill the (inverse) covariance from its packed upper triangle. Zero off-diagonal
+        // elements are skipped, as if they were missing from a text file.
+        int nset(0);
+        for(std::size_t k1 = 0; k1 < ndata; ++k1) {
+            for(std::size_t k2 = k1; k2 < ndata; ++k2) {
+                double value = *cov++;
+                if(0 == value && k1 != k2) continue;
+                if(icov) {
+                    binnedData->setInverseCovariance(index[k1],index[k2],value);
+                }
+                else {
+                    binnedData->setCovariance(index[k1],index[k2],value);
+                }
+                nset++;
+            }
+        }
+        if(verbose) {
+            std::cout << "Read " << nset << " of " << ncov << (icov ? " inverse" : "")
+                << " covariance values from " << binName << std::endl;
+        }
+        // Fill the custom bin centers, if requested and available.
+        haveGrid = false;
+        if(!customGrid || 0 == ngrid) return true;
+        for(int k = 0; k < nbins; ++k) {
+            binnedData->setCustomBinCenters(k,grid[3*k],grid[3*k+1],grid[3*k+2],customGrid);
+        }
+        if(verbose) {
+            std::cout << "Read " << binnedData->getNCustomBins() << " custom bins from "
+                << binName << std::endl;
+        }
+        haveGrid = true;
+        return true;
+    }
+}
 
 baofit::AbsCorrelationDataPtr local::loadCorrelationData(std::string const &dataName,
-baofit::AbsCorrelationDataCPtr prototype, bool verbose, bool icov, bool weighted, bool customGrid) {
+baofit::AbsCorrelationDataCPtr prototype, bool verbose, bool icov, bool weighted, bool customGrid,
+int parseThreads) {
 
     // Create the new AbsCorrelationData that we will fill.
     baofit::AbsCorrelationDataPtr binnedData(dynamic_cast<AbsCorrelationData*>(prototype->clone(true)));
 
-    // General stuff we will need for reading both files.
-    std::string line;
-    int lines;
-    
-    // import boost spirit parser symbols
-    using qi::double_;
-    using qi::int_;
-    using qi::_1;
-    using phoenix::ref;
-    using phoenix::push_back;
-
-    // Loop over lines in the parameter file.
-    std::string paramsName = dataName + (weighted ? ".wdata" : ".data");
-    std::ifstream paramsIn(paramsName.c_str());
-    if(!paramsIn.good()) throw RuntimeError("loadCorrelationData: Unable to open " + paramsName);
-    lines = 0;
-    int index;
-    double data;
-    std::vector<double> bin(3);
-    while(std::getline(paramsIn,line)) {
-        lines++;
-        bin.resize(0);
-        bool ok = qi::phrase_parse(line.begin(),line.end(),
-            (
-                int_[ref(index) = _1] >> double_[ref(data) = _1]
-            ),
-            ascii::space);
-        if(!ok) {
-            throw RuntimeError("loadCorrelationData: error reading line " +
-                boost::lexical_cast<std::string>(lines) + " of " + paramsName);
-        }
-        binnedData->setData(index,data,weighted);
-    }
-    paramsIn.close();
-    int ndata = binnedData->getNBinsWithData();
+    // Use the binary container when it is available, unless the text files we would otherwise
+    // read have been modified since it was written, or it has a different kind of data or covariance.
+    bool haveGrid(false);
     int nbins = binnedData->getGrid().getNBinsTotal();
-    if(verbose) {
-        std::cout << "Read " << ndata << " of " << nbins << " data values from "
-            << paramsName << std::endl;
+    std::string binName = dataName + ".corr.bin";
+    std::string textNames[] = { dataName + (weighted ? ".wdata" : ".data"), dataName + (icov ? ".icov" : ".cov") };
+    time_t binTime, textTime;
+    bool useBinary = getModificationTime(binName,binTime);
+    for(int k = 0; useBinary && k < 2; ++k) {
+        if(getModificationTime(textNames[k],textTime) && textTime > binTime) {
+            std::cout << "WARNING: ignoring " << binName << " since it is older than " << textNames[k] << std::endl;
+            useBinary = false;
+        }
     }
-
-    // Loop over lines in the (inverse) covariance file.
-    std::string covName = dataName + (icov ? ".icov" : ".cov");
-    std::ifstream covIn(covName.c_str());
-    if(!covIn.good()) throw RuntimeError("loadCorrelationData: Unable to open " + covName);
-    lines = 0;
-    double value;
-    int index1,index2;
-    while(std::getline(covIn,line)) {
-        lines++;
-        bin.resize(0);
-        bool ok = qi::phrase_parse(line.begin(),line.end(),
-            (
-                int_[ref(index1) = _1] >> int_[ref(index2) = _1] >> double_[ref(value) = _1]
-            ),
-            ascii::space);
-        if(!ok) {
-            throw RuntimeError("loadCorrelationData: error reading line " +
-                boost::lexical_cast<std::string>(lines) + " of " + covName);
+    if(!useBinary || !loadCorrelationDataBinary(binName,binnedData,verbose,icov,weighted,customGrid,haveGrid)) {
+        // Read the data values.
+        std::string paramsName = dataName + (weighted ? ".wdata" : ".data");
+        TextTableReader paramsIn(paramsName,1,1,"loadCorrelationData",parseThreads);
+        for(int line = 0; line < paramsIn.getNLines(); ++line) {
+            binnedData->setData(paramsIn.getInt(line,0),paramsIn.getFloat(line,0),weighted);
         }
-        // Check for invalid offsets.
-        if(index1 < 0 || index2 < 0 || index1 >= nbins || index2 >= nbins ||
-        !binnedData->hasData(index1) || !binnedData->hasData(index2)) {
-            throw RuntimeError("loadCorrelationData: invalid covariance indices on line " +
-                boost::lexical_cast<std::string>(lines) + " of " + covName);
+        int ndata = binnedData->getNBinsWithData();
+        if(verbose) {
+            std::cout << "Read " << ndata << " of " << nbins << " data values from "
+                << paramsName << std::endl;
         }
-        // Add this covariance to our dataset.
-        if(icov) {
-            binnedData->setInverseCovariance(index1,index2,value);
+
+        // Read the (inverse) covariance values.
+        std::string covName = dataName + (icov ? ".icov" : ".cov");
+        TextTableReader covIn(covName,2,1,"loadCorrelationData",parseThreads);
+        int lines = covIn.getNLines();
+        for(int line = 0; line < lines; ++line) {
+            int index1 = covIn.getInt(line,0), index2 = covIn.getInt(line,1);
+            double value = covIn.getFloat(line,0);
+            // Check for invalid offsets.
+            if(index1 < 0 || index2 < 0 || index1 >= nbins || index2 >= nbins ||
+            !binnedData->hasData(index1) || !binnedData->hasData(index2)) {
+                throw RuntimeError("loadCorrelationData: invalid covariance indices on line " +
+                    boost::lexical_cast<std::string>(line+1) + " of " + covName);
+            }
+            // Add this covariance to our dataset.
+            if(icov) {
+                binnedData->setInverseCovariance(index1,index2,value);
+            }
+            else {
+                binnedData->setCovariance(index1,index2,value);            
+            }
         }
-        else {
-            binnedData->setCovariance(index1,index2,value);            
+        if(verbose) {
+            int ncov = (ndata*(ndata+1))/2;
+            std::cout << "Read " << lines << " of " << ncov
+                << " covariance values from " << covName << std::endl;
         }
     }
-    covIn.close();
-    if(verbose) {
-        int ncov = (ndata*(ndata+1))/2;
-        std::cout << "Read " << lines << " of " << ncov
-            << " covariance values from " << covName << std::endl;
-    }
 
-    if(customGrid) {
-        // Loop over lines in the custom grid file.
+    if(customGrid && !haveGrid) {
+        // Read the custom bin centers.
         std::string gridName = dataName + ".grid";
-        std::ifstream gridIn(gridName.c_str());
-        if(!gridIn.good()) throw RuntimeError("loadCorrelationData: Unable to open " + gridName);
-        lines = 0;
-        double bincenter1, bincenter2, bincenter3;
-        while(std::getline(gridIn,line)) {
-            lines++;
-            bool ok = qi::phrase_parse(line.begin(),line.end(),
-                (
-                    int_[ref(index) = _1] >> double_[ref(bincenter1) = _1] >> double_[ref(bincenter2) = _1] >> double_[ref(bincenter3) = _1]
-                ),
-                ascii::space);
-            if(!ok) {
-                throw RuntimeError("loadCorrelationData: error reading line " +
-                    boost::lexical_cast<std::string>(lines) + " of " + gridName);
-            }
+        TextTableReader gridIn(gridName,1,3,"loadCorrelationData",parseThreads);
+        for(int line = 0; line < gridIn.getNLines(); ++line) {
+            int index = gridIn.getInt(line,0);
             // Check for invalid index.
             if(index < 0 || index >= nbins) {
                 throw RuntimeError("loadCorrelationData: invalid bin index on line " +
-                    boost::lexical_cast<std::string>(lines) + " of " + gridName);
+                    boost::lexical_cast<std::string>(line+1) + " of " + gridName);
             }
-            binnedData->setCustomBinCenters(index,bincenter1,bincenter2,bincenter3,customGrid);
+            binnedData->setCustomBinCenters(index,gridIn.getFloat(line,0),gridIn.getFloat(line,1),
+                gridIn.getFloat(line,2),customGrid);
         }
-        gridIn.close();
         int ncustombins = binnedData->getNCustomBins();
         if(ncustombins != nbins) throw RuntimeError("loadCorrelationData: number of custom bins must match the number of default bins.");
         if(verbose) {
@@ -275,3 +355,52 @@ baofit::AbsCorrelationDataCPtr prototype, bool verbose, bool icov, bool weighted
     
     return binnedData;
 }
+
+void local::saveCorrelationDataBinary(std::string const &filename, AbsCorrelationDataCPtr data) {
+    CorrelationDataHeader header;
+    std::memset(&header,0,sizeof(header));
+    std::memcpy(header.magic,correlationDataMagic,sizeof(header.magic));
+    header.version = correlationDataVersion;
+    header.flags |= HasCovariance | IsInverse;
+    if(data->useCustomGrid()) header.flags |= HasCustomGrid;
+    int nbins = data->getGrid().getNBinsTotal();
+    header.nbins = nbins;
+    header.ndata = data->getNBinsWithData();
+    // Gather the indices and values of bins with data.
+    std::vector<boost::int64_t> index(data->begin(),data->end());
+    std::vector<double> values;
+    values.reserve(index.size());
+    for(likely::BinnedData::IndexIterator iter = data->begin(); iter != data->end(); ++iter) {
+        values.push_back(data->getData(*iter));
+    }
+    std::ofstream out(filename.c_str(),std::ios::binary);
+    if(!out.good()) throw RuntimeError("saveCorrelationDataBinary: Unable to open " + filename);
+    out.write(reinterpret_cast<char const*>(&header),sizeof(header));
+    if(!index.empty()) {
+        out.write(reinterpret_cast<char const*>(&index[0]),index.size()*sizeof(boost::int64_t));
+        out.write(reinterpret_cast<char const*>(&values[0]),values.size()*sizeof(double));
+    }
+    // Write the packed upper triangle of the inverse covariance one row at a time.
+    std::vector<double> row;
+    for(std::size_t k1 = 0; k1 < index.size(); ++k1) {
+        row.resize(0);
+        for(std::size_t k2 = k1; k2 < index.size(); ++k2) {
+            row.push_back(data->getInverseCovariance(index[k1],index[k2]));
+        }
+        out.write(reinterpret_cast<char const*>(&row[0]),row.size()*sizeof(double));
+    }
+    if(data->useCustomGrid()) {
+        std::vector<double> centers, grid;
+        grid.reserve(3*nbins);
+        for(int k = 0; k < nbins; ++k) {
+            data->getCustomBinCenters(k,centers);
+            grid.insert(grid.end(),centers.begin(),centers.end());
+        }
+        if(grid.size() != 3*(std::size_t)nbins) {
+            throw RuntimeError("saveCorrelationDataBinary: expected 3 custom bin centers per bin.");
+        }
+        out.write(reinterpret_cast<char const*>(&grid[0]),grid.size()*sizeof(double));
+    }
+    out.close();
+    if(!out) throw RuntimeError("saveCorrelationDataBinary: error writing " + filename);
+}
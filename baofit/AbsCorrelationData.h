@@ -72,10 +72,26 @@ namespace baofit {
 
     // Loads a binned correlation function using the specified prototype
     // and returns a BinnedData object. Set icov true to read .icov files instead of .cov.
-    // Set weighted true to read .wdata files instead of .data.
+    // Set weighted true to read .wdata files instead of .data. If a binary container
+    // <dataName>.corr.bin exists (see saveCorrelationDataBinary), it is memory mapped and
+    // used instead of the text files, unless it is older than the text files that would be
+    // read or does not match icov and weighted. With customGrid, bin centers are read from
+    // the container if it has them, or else from <dataName>.grid. Text files are parsed by
+    // up to parseThreads threads, or one per available core if parseThreads <= 0.
     AbsCorrelationDataPtr loadCorrelationData(std::string const &dataName,
         AbsCorrelationDataCPtr prototype, bool verbose, bool icov, bool weighted,
-        bool customGrid);
+        bool customGrid, int parseThreads = 0);
+
+    // Saves the unweighted data of the specified dataset to a binary container with the
+    // specified filename, together with its inverse covariance, saved as the packed upper
+    // triangle of the matrix whose rows and columns are the bins with data.
+    // Any custom bin centers are also saved. The container starts with a 40-byte header (the
+    // magic string "BAOFITCD", an int32 version, an int32 flags word, and int64 values for
+    // the total number of bins, the number of bins with data and a reserved word), followed
+    // by the int64 global indices of the bins with data, their float64 data values, and the
+    // optional float64 inverse covariance and (x1,x2,x3) custom bin centers for all bins.
+    // All values use native byte order.
+    void saveCorrelationDataBinary(std::string const &filename, AbsCorrelationDataCPtr data);
 
 } // baofit
 
@@ -6,11 +6,36 @@
 #include "cosmo/TransferFunctionPowerSpectrum.h" // for getMultipole(...)
 
 #include "boost/bind.hpp"
+#include "boost/ref.hpp"
+#include "boost/thread.hpp"
 
+#include <algorithm>
 #include <cmath>
 
 namespace local = baofit;
 
+namespace baofit {
+    // Fills the columns of jacobian for parameters indices[columns[begin:end]] using central
+    // differences of predictions from the specified model.
+    void finiteDifferences(AbsCorrelationModel &model, AbsCorrelationModel::Coordinates const &coords,
+    likely::Parameters const &params, std::vector<int> const &indices, std::vector<double> const &steps,
+    std::vector<int> const &columns, int begin, int end, std::vector<double> &jacobian) {
+        likely::Parameters shifted(params);
+        std::vector<double> plus, minus;
+        int n = coords.r.size();
+        for(int c = begin; c < end; ++c) {
+            int k = columns[c], index = indices[k];
+            double step = steps[k];
+            shifted[index] = params[index] + step;
+            model.evaluateAll(coords,shifted,plus);
+            shifted[index] = params[index] - step;
+            model.evaluateAll(coords,shifted,minus);
+            shifted[index] = params[index];
+            for(int i = 0; i < n; ++i) jacobian[k*n+i] = (plus[i] - minus[i])/(2*step);
+        }
+    }
+}
+
 local::AbsCorrelationModel::AbsCorrelationModel(std::string const &name)
 : FitModel(name), _indexBase(-1), _crossCorrelation(false), _combinedBias(false), _dvIndex(-1), _betabiasIndex(-1),
 _nbins(0), _OmegaMatter(0.27)
@@ -23,23 +48,87 @@ likely::Parameters const &params, int index) {
     bool anyChanged = updateParameterValues(params);
     _updateInternalParameters();
     if(_dvIndex >= 0) _applyVelocityShift(r,mu,z);
-    if(_dvIndex >= 0 && _nbins > 0 && anyChanged) {
-        double rbin, mubin, zbin;
-        for(int i = 0; i < _nbins; ++i) {
-            rbin = _rbin[i];
-            mubin = _mubin[i];
-            zbin = _zbin[i];
-            _applyVelocityShift(rbin,mubin,zbin);
-            _rbinShift[i] = rbin;
-            _mubinShift[i] = mubin;
-            _zbinShift[i] = zbin;
-        }
-    }
+    if(_dvIndex >= 0 && _nbins > 0 && anyChanged) _shiftGridCoordinates();
     double result = _evaluate(r,mu,z,anyChanged,index);
     resetParameterValuesChanged();
     return result;
 }
 
+void local::AbsCorrelationModel::evaluateAll(Coordinates const &coords,
+likely::Parameters const &params, std::vector<double> &out) {
+    int n = coords.r.size();
+    if(n != coords.mu.size() || n != coords.z.size() || n != coords.index.size()) {
+        throw RuntimeError("AbsCorrelationModel::evaluateAll: coordinate vectors not the same size.");
+    }
+    out.resize(n);
+    bool anyChanged = updateParameterValues(params);
+    _updateInternalParameters();
+    if(_dvIndex >= 0) {
+        if(_nbins > 0 && anyChanged) _shiftGridCoordinates();
+        // Apply the velocity shift to a copy of the input coordinates.
+        _coordsShift = coords;
+        for(int i = 0; i < n; ++i) {
+            _applyVelocityShift(_coordsShift.r[i],_coordsShift.mu[i],_coordsShift.z[i]);
+        }
+        _evaluateAll(_coordsShift,anyChanged,out);
+    }
+    else {
+        _evaluateAll(coords,anyChanged,out);
+    }
+    resetParameterValuesChanged();
+}
+
+void local::AbsCorrelationModel::evaluateAllJacobian(Coordinates const &coords,
+likely::Parameters const &params, std::vector<int> const &indices, std::vector<double> const &steps,
+std::vector<double> &out, std::vector<double> &jacobian, std::vector<AbsCorrelationModelPtr> const &workers) {
+    if(indices.size() != steps.size()) {
+        throw RuntimeError("AbsCorrelationModel::evaluateAllJacobian: indices and steps not the same size.");
+    }
+    evaluateAll(coords,params,out);
+    int n = out.size(), nindices = indices.size();
+    jacobian.resize(n*nindices);
+    // Calculate analytic derivatives using the (possibly velocity-shifted) coordinates that
+    // were just evaluated.
+    std::vector<bool> analytic(nindices,false);
+    _evaluateAllJacobian(_dvIndex >= 0 ? _coordsShift : coords,indices,jacobian,analytic);
+    std::vector<int> columns;
+    for(int k = 0; k < nindices; ++k) {
+        if(!analytic[k]) columns.push_back(k);
+    }
+    int ncolumns = columns.size();
+    if(0 == ncolumns) return;
+    if(workers.empty()) {
+        finiteDifferences(*this,coords,params,indices,steps,columns,0,ncolumns,jacobian);
+        // Restore any cached calculations for the input parameter values.
+        std::vector<double> restored;
+        evaluateAll(coords,params,restored);
+        return;
+    }
+    int nthreads = std::min((int)workers.size(),ncolumns);
+    boost::thread_group threads;
+    for(int t = 0; t < nthreads; ++t) {
+        threads.create_thread(boost::bind(&finiteDifferences,boost::ref(*workers[t]),boost::cref(coords),
+            boost::cref(params),boost::cref(indices),boost::cref(steps),boost::cref(columns),
+            (t*ncolumns)/nthreads,((t+1)*ncolumns)/nthreads,boost::ref(jacobian)));
+    }
+    threads.join_all();
+}
+
+double local::AbsCorrelationModel::evaluatePriorsAt(likely::Parameters const &params) {
+    int npar = getNParameters();
+    likely::Parameters current(npar);
+    for(int index = 0; index < npar; ++index) current[index] = getParameterValue(index);
+    updateParameterValues(params);
+    double priors = evaluatePriors();
+    // Restore our current values, which do not need to be flagged as changed since any
+    // cached calculations already correspond to them.
+    updateParameterValues(current);
+    resetParameterValuesChanged();
+    return priors;
+}
+
+void local::AbsCorrelationModel::checkFitParameters(likely::FitParameters const &params) const { }
+
 double local::AbsCorrelationModel::evaluate(double r, cosmo::Multipole multipole, double z,
 likely::Parameters const &params, int index) {
     bool anyChanged = updateParameterValues(params);
@@ -57,9 +146,11 @@ std::vector<double> zbin) {
     if(_nbins != _mubin.size() || _nbins != _zbin.size()) {
         throw RuntimeError("AbsCorrelationModel::setCoordinates: coordinate vectors not the same size.");
     }
-    _rbinShift = rbin;
-    _mubinShift = mubin;
-    _zbinShift = zbin;
+    _gridShift.r = rbin;
+    _gridShift.mu = mubin;
+    _gridShift.z = zbin;
+    _gridShift.index.resize(_nbins);
+    for(int i = 0; i < _nbins; ++i) _gridShift.index[i] = i;
 }
 
 double local::AbsCorrelationModel::_evaluate(double r, cosmo::Multipole multipole, double z,
@@ -78,6 +169,18 @@ bool anyChanged, int index) const {
     return cosmo::getMultipole(fOfMuPtr,(int)multipole);
 }
 
+void local::AbsCorrelationModel::_evaluateAll(Coordinates const &coords, bool anyChanged,
+std::vector<double> &out) const {
+    for(int i = 0; i < out.size(); ++i) {
+        out[i] = _evaluate(coords.r[i],coords.mu[i],coords.z[i],anyChanged,coords.index[i]);
+        // Only the first coordinate sees any parameter changes.
+        anyChanged = false;
+    }
+}
+
+void local::AbsCorrelationModel::_evaluateAllJacobian(Coordinates const &coords,
+std::vector<int> const &indices, std::vector<double> &jacobian, std::vector<bool> &analytic) const { }
+
 void local::AbsCorrelationModel::_setZRef(double zref) {
     if(zref < 0) throw RuntimeError("AbsCorrelationModel: expected zref >= 0.");
     _zref = zref;
@@ -156,11 +259,32 @@ void local::AbsCorrelationModel::_applyVelocityShift(double &r, double &mu, doub
     mu = munew;
 }
 
+void local::AbsCorrelationModel::_shiftGridCoordinates() {
+    double rbin, mubin, zbin;
+    for(int i = 0; i < _nbins; ++i) {
+        rbin = _rbin[i];
+        mubin = _mubin[i];
+        zbin = _zbin[i];
+        _applyVelocityShift(rbin,mubin,zbin);
+        _gridShift.r[i] = rbin;
+        _gridShift.mu[i] = mubin;
+        _gridShift.z[i] = zbin;
+    }
+}
+
 double local::redshiftEvolution(double p0, double gamma, double z, double zref) {
     return p0*std::pow((1+z)/(1+zref),gamma);
 }
 
 double local::AbsCorrelationModel::_getNormFactor(cosmo::Multipole multipole, double z) const {
+    if(_indexBase < 0) throw RuntimeError("AbsCorrelationModel: no linear bias parameters defined.");
+    double gammaBias = getParameterValue(_indexBase + GAMMA_BIAS);
+    double gammaBeta = getParameterValue(_indexBase + GAMMA_BETA);
+    return _getNormFactor(multipole,redshiftEvolution(1,gammaBias,z,_zref),redshiftEvolution(1,gammaBeta,z,_zref));
+}
+
+double local::AbsCorrelationModel::_getNormFactor(cosmo::Multipole multipole, double biasEvolution,
+double betaEvolution) const {
     if(_indexBase < 0) throw RuntimeError("AbsCorrelationModel: no linear bias parameters defined.");
     // Lookup the linear bias parameters at the reference redshift.
     double beta = getParameterValue(_indexBase + BETA);
@@ -188,11 +312,9 @@ double local::AbsCorrelationModel::_getNormFactor(cosmo::Multipole multipole, do
         biasSq = bias*bias;
     }
     // Calculate redshift evolution of biasSq, betaAvg and betaProd.
-    double gammaBias = getParameterValue(_indexBase + GAMMA_BIAS);
-    double gammaBeta = getParameterValue(_indexBase + GAMMA_BETA);
-    biasSq = redshiftEvolution(biasSq,gammaBias,z,_zref);
-    betaAvg = redshiftEvolution(betaAvg,gammaBeta,z,_zref);
-    betaProd = redshiftEvolution(betaProd,2*gammaBeta,z,_zref);
+    biasSq *= biasEvolution;
+    betaAvg *= betaEvolution;
+    betaProd *= betaEvolution*betaEvolution;
     // Return the requested normalization factor.
     switch(multipole) {
     case cosmo::Hexadecapole:
@@ -204,25 +326,94 @@ double local::AbsCorrelationModel::_getNormFactor(cosmo::Multipole multipole, do
     }
 }
 
+void local::AbsCorrelationModel::_updateScaledCoordinates(Coordinates const &coords, double gammaBias,
+double gammaBeta, bool anisotropic, double scale, double scaleParallel, double scalePerp, double gammaScale,
+ScaledCoordinates &scaled) const {
+    int n = coords.r.size();
+    bool zChanged, coordsChanged;
+    if(1 == n && 1 == scaled.coords.r.size()) {
+        // Compare a single coordinate directly, as for each call to _evaluate(...).
+        zChanged = (scaled.coords.z[0] != coords.z[0]);
+        if(zChanged) {
+            scaled.coords.z[0] = coords.z[0];
+            scaled.logz[0] = std::log((1+coords.z[0])/(1+_zref));
+        }
+        coordsChanged = zChanged || scaled.coords.r[0] != coords.r[0] || scaled.coords.mu[0] != coords.mu[0];
+        if(coordsChanged) {
+            scaled.coords.r[0] = coords.r[0];
+            scaled.coords.mu[0] = coords.mu[0];
+        }
+    }
+    else {
+        // Only recalculate log((1+z)/(1+zref)) when the redshifts change, e.g. not after a velocity shift.
+        zChanged = (scaled.coords.z != coords.z);
+        if(zChanged) {
+            scaled.coords.z = coords.z;
+            scaled.logz.resize(n);
+            for(int i = 0; i < n; ++i) scaled.logz[i] = std::log((1+coords.z[i])/(1+_zref));
+        }
+        coordsChanged = zChanged || scaled.coords.r != coords.r || scaled.coords.mu != coords.mu;
+        if(coordsChanged) {
+            scaled.coords.r = coords.r;
+            scaled.coords.mu = coords.mu;
+        }
+    }
+    scaled.index = &coords.index;
+    double params[] = { gammaBias, gammaBeta, anisotropic ? 1. : 0., scale, scaleParallel, scalePerp, gammaScale };
+    bool first = !scaled.valid;
+    double const *logz = n > 0 ? &scaled.logz[0] : 0;
+    if(zChanged || first || params[0] != scaled.params[0]) {
+        scaled.biasEvolution.resize(n);
+        for(int i = 0; i < n; ++i) scaled.biasEvolution[i] = std::exp(gammaBias*logz[i]);
+    }
+    if(zChanged || first || params[1] != scaled.params[1]) {
+        scaled.betaEvolution.resize(n);
+        for(int i = 0; i < n; ++i) scaled.betaEvolution[i] = std::exp(gammaBeta*logz[i]);
+    }
+    if(coordsChanged || first || !std::equal(params+2,params+7,scaled.params+2)) {
+        // Transform (r,mu) to (rBAO,muBAO) using the scale parameters.
+        scaled.rBAO.resize(n);
+        scaled.muBAO.resize(n);
+        scaled.dilation.resize(n);
+        for(int i = 0; i < n; ++i) {
+            double r(coords.r[i]), mu(coords.mu[i]), evolution = std::exp(gammaScale*logz[i]), dilation;
+            if(anisotropic) {
+                double apar = scaleParallel*evolution, aperp = scalePerp*evolution;
+                double musq(mu*mu);
+                dilation = std::sqrt(apar*apar*musq + aperp*aperp*(1-musq));
+                scaled.muBAO[i] = apar*mu/dilation;
+            }
+            else {
+                dilation = scale*evolution;
+                scaled.muBAO[i] = mu;
+            }
+            scaled.rBAO[i] = r*dilation;
+            scaled.dilation[i] = dilation;
+        }
+    }
+    std::copy(params,params+7,scaled.params);
+    scaled.valid = true;
+}
+
 double local::AbsCorrelationModel::_getRBin(int index) const {
     if(index < 0 || index >= _nbins) {
         throw RuntimeError("AbsCorrelationModel::getRBin: invalid index.");
     }
-    return _rbinShift[index];
+    return _gridShift.r[index];
 }
 
 double local::AbsCorrelationModel::_getMuBin(int index) const {
     if(index < 0 || index >= _nbins) {
         throw RuntimeError("AbsCorrelationModel::getMuBin: invalid index.");
     }
-    return _mubinShift[index];
+    return _gridShift.mu[index];
 }
 
 double local::AbsCorrelationModel::_getZBin(int index) const {
     if(index < 0 || index >= _nbins) {
         throw RuntimeError("AbsCorrelationModel::getZBin: invalid index.");
     }
-    return _zbinShift[index];
+    return _gridShift.z[index];
 }
 
 void  local::AbsCorrelationModel::printToStream(std::ostream &out, std::string const &formatSpec) const {
@@ -3,6 +3,8 @@
 #ifndef BAOFIT_ABS_CORRELATION_MODEL
 #define BAOFIT_ABS_CORRELATION_MODEL
 
+#include "baofit/types.h"
+
 #include "likely/FitModel.h"
 
 #include "cosmo/types.h"
@@ -14,6 +16,12 @@ namespace baofit {
 	class AbsCorrelationModel : public likely::FitModel {
 	// Represents an abstract parameterized model of a two-point correlation function.
 	public:
+	    // Structure-of-arrays buffers of the (r,mu,z) coordinates and data bin index of each
+	    // prediction to be calculated by evaluateAll(...).
+	    struct Coordinates {
+	        std::vector<double> r, mu, z;
+	        std::vector<int> index;
+	    };
 	    // Creates a new model with the specified name.
 		AbsCorrelationModel(std::string const &name);
 		virtual ~AbsCorrelationModel();
@@ -29,6 +37,29 @@ namespace baofit {
         // delta-v has no effect.
         double evaluate(double r, cosmo::Multipole multipole, double z, likely::Parameters const &params,
             int index);
+        // Fills the vector provided with the correlation function evaluated at each of the
+        // specified coordinates. The results are identical to calling evaluate(r,mu,z,params,index)
+        // for each element in turn, but our parameter values are only updated once.
+        void evaluateAll(Coordinates const &coords, likely::Parameters const &params,
+            std::vector<double> &out);
+        // Fills out as for evaluateAll(...) and fills jacobian with the derivatives of each
+        // prediction with respect to the parameters with the specified indices, stored as
+        // jacobian[k*n+i] for parameter indices[k] and coordinate i. Derivatives are calculated
+        // analytically where _evaluateAllJacobian(...) provides them, and otherwise using central
+        // differences with the specified steps. Any finite differences are split between the
+        // workers provided, which should be configured identically to this model and are each
+        // evaluated in their own thread. With no workers, finite differences are evaluated by
+        // this model, which is then restored to the input parameter values.
+        void evaluateAllJacobian(Coordinates const &coords, likely::Parameters const &params,
+            std::vector<int> const &indices, std::vector<double> const &steps,
+            std::vector<double> &out, std::vector<double> &jacobian,
+            std::vector<AbsCorrelationModelPtr> const &workers = std::vector<AbsCorrelationModelPtr>());
+        // Returns the value of our priors for the specified parameter values, without changing
+        // the current parameter values used by our evaluate methods.
+        double evaluatePriorsAt(likely::Parameters const &params);
+        // Throws a RuntimeError if the specified parameters cannot be used to start a fit of this
+        // model. The default implementation accepts any parameters.
+        virtual void checkFitParameters(likely::FitParameters const &params) const;
         // Sets the grid coordinates to use for the distortion matrix.
         void setCoordinates(std::vector<double> rbin, std::vector<double> mubin,
             std::vector<double> zbin);
@@ -49,6 +80,18 @@ namespace baofit {
         // We provide a default implementation of the (r,ell,z) evaluator that performs the
         // projection integral over mu weighted with LegendreP(ell) numerically.
         virtual double _evaluate(double r, cosmo::Multipole multipole, double z, bool changed, int index) const;
+        // Fills the vector provided, which has already been resized to match the input coordinates,
+        // with the correlation function evaluated at each of the input coordinates. Only the first
+        // coordinate should be considered changed, as if _evaluate were called once per coordinate.
+        // We provide a default implementation that loops over _evaluate(r,mu,z,...).
+        virtual void _evaluateAll(Coordinates const &coords, bool changed, std::vector<double> &out) const;
+        // Fills jacobian[k*n+i] with the derivative of the correlation function at coordinate i
+        // with respect to the parameter with index indices[k], for any parameters whose derivatives
+        // we can calculate analytically, and sets analytic[k] for each of these. Derivatives are
+        // calculated for the parameter values and coordinates of the preceding call to _evaluateAll.
+        // The default implementation does not provide any analytic derivatives.
+        virtual void _evaluateAllJacobian(Coordinates const &coords, std::vector<int> const &indices,
+            std::vector<double> &jacobian, std::vector<bool> &analytic) const;
         // k-space
         virtual double _evaluateKSpace(double k, double mu_k, double pk, double z) const = 0;
         virtual int _getIndexBase() const = 0;
@@ -99,6 +142,35 @@ namespace baofit {
         void _applyVelocityShift(double &r, double &mu, double z);
         // Updates the multipole normalization factors b^2(z)*C_ell(beta(z)) returned by getNormFactor(ell).
         double _getNormFactor(cosmo::Multipole multipole, double z) const;
+        // Returns the same multipole normalization factor using precalculated redshift evolution
+        // factors ((1+z)/(1+zref))^gamma of the bias and beta.
+        double _getNormFactor(cosmo::Multipole multipole, double biasEvolution, double betaEvolution) const;
+        // Per-coordinate values that only depend on the coordinates and a few parameters: the redshift
+        // evolution factors ((1+z)/(1+zref))^gamma of the bias and beta, and the BAO peak coordinates
+        // (rBAO,muBAO) with the corresponding radial dilation. These are cached between evaluations
+        // and only recalculated when the coordinates or the parameters they depend on change.
+        struct ScaledCoordinates {
+            ScaledCoordinates() : valid(false), index(0) { }
+            std::vector<double> biasEvolution, betaEvolution, rBAO, muBAO, dilation;
+            // The (r,mu,z) coordinates, log((1+z)/(1+zref)) and parameter values used for the cached
+            // values, which are only valid after the first update.
+            Coordinates coords;
+            std::vector<double> logz;
+            double params[7];
+            bool valid;
+            // The data bin index of each coordinate, which points into the coordinates provided to
+            // the most recent update rather than being copied.
+            std::vector<int> const *index;
+        };
+        // Updates the cached values in scaled for the specified coordinates and parameter values.
+        // The BAO peak coordinates use the scale parameters (scaleParallel,scalePerp) if anisotropic
+        // is set, or else scale, with the redshift evolution gammaScale.
+        void _updateScaledCoordinates(Coordinates const &coords, double gammaBias, double gammaBeta,
+            bool anisotropic, double scale, double scaleParallel, double scalePerp, double gammaScale,
+            ScaledCoordinates &scaled) const;
+        // Returns the coordinates of the distortion matrix grid, including any velocity shift, with
+        // the bin index of each coordinate.
+        Coordinates const &_getGridCoordinates() const;
         // Returns the radius in Mpc/h for the specified bin.
         double _getRBin(int index) const;
         // Returns the cosine of the theta angle for the specified bin.
@@ -106,6 +178,8 @@ namespace baofit {
         // Returns the redshift for the specified bin.
         double _getZBin(int index) const;
     private:
+        // Updates the velocity-shifted copies of our grid coordinates.
+        void _shiftGridCoordinates();
         int _indexBase, _dvIndex, _betaIndex, _bbIndex, _gammabiasIndex, _gammabetaIndex, _betabiasIndex,
             _bias2Index, _beta2bias2Index, _nbins, _combBiasBase;
         bool _crossCorrelation, _combinedBias;
@@ -114,7 +188,7 @@ namespace baofit {
         };
         double _zref, _OmegaMatter, _beta, _bias, _gammaBias, _gammaBeta, _bias2, _beta2;
         std::vector<double> _rbin, _mubin, _zbin;
-        mutable std::vector<double> _rbinShift, _mubinShift, _zbinShift;
+        Coordinates _gridShift, _coordsShift;
 	}; // AbsCorrelationModel
 
     inline double AbsCorrelationModel::_getZRef() const { return _zref; }
@@ -132,6 +206,7 @@ namespace baofit {
     inline double AbsCorrelationModel::_getGammaBeta() const { return _gammaBeta; }
     inline double AbsCorrelationModel::_getBeta2() const { return _beta2; }
     inline double AbsCorrelationModel::_getBias2() const { return _bias2; }
+    inline AbsCorrelationModel::Coordinates const &AbsCorrelationModel::_getGridCoordinates() const { return _gridShift; }
     // Evaluates the redshift evolution p(z) of a parameter for which p(zref)=p0 according to
     // p(z) = p0*((1+z)/(1+zref))^gamma.
     double redshiftEvolution(double p0, double gamma, double z, double zref);
@@ -87,53 +87,80 @@ _combinedScale(combinedScale)
 
 local::BaoCorrelationModel::~BaoCorrelationModel() { }
 
-double local::BaoCorrelationModel::_evaluate(double r, double mu, double z, bool anyChanged, int index) const {
-
+void local::BaoCorrelationModel::_lookupParameters() const {
+    // Lookup linear bias redshift evolution parameters.
+    _gammaBias = getParameterValue(2);
+    _gammaBeta = getParameterValue(3);
     // Lookup parameter values by name.
-    double ampl = getParameterValue(_indexBase + 1); //("BAO amplitude");
-    double scale = getParameterValue(_indexBase + 2); //"BAO alpha-iso");
-    double scale_parallel = getParameterValue(_indexBase + 3); //("BAO alpha-parallel");
-    double scale_perp = getParameterValue(_indexBase + 4); //("BAO alpha-perp");
-    double gamma_scale = getParameterValue(_indexBase + 5); //("gamma-scale");
+    _ampl = getParameterValue(_indexBase + 1); //("BAO amplitude");
+    _scale = getParameterValue(_indexBase + 2); //"BAO alpha-iso");
+    _scaleParallel = getParameterValue(_indexBase + 3); //("BAO alpha-parallel");
+    _scalePerp = getParameterValue(_indexBase + 4); //("BAO alpha-perp");
+    _gammaScale = getParameterValue(_indexBase + 5); //("gamma-scale");
     if(_combinedScale) {
         double scale_ratio = getParameterValue(_combScaleBase);
-        scale_perp = scale_ratio*scale_parallel;
+        _scalePerp = scale_ratio*_scaleParallel;
     }
+    // Lookup radiation parameters, also value by name.
+    _radStrength = getParameterValue(_indexBase + 6);
+    _radAniso = getParameterValue(_indexBase + 7);
+    _meanFreePath = getParameterValue(_indexBase + 8);
+    _quasarLifetime = getParameterValue(_indexBase + 9);
+    // Force the redshift-dependent values to be recalculated.
+    _zLast = -1;
+}
 
-    // Calculate redshift evolution of the scale parameters.
-    scale = redshiftEvolution(scale,gamma_scale,z,_getZRef());
-    scale_parallel = redshiftEvolution(scale_parallel,gamma_scale,z,_getZRef());
-    scale_perp = redshiftEvolution(scale_perp,gamma_scale,z,_getZRef());
+double local::BaoCorrelationModel::_evaluate(double r, double mu, double z, bool anyChanged, int index) const {
+    _lookupParameters();
+    _point.r.assign(1,r);
+    _point.mu.assign(1,mu);
+    _point.z.assign(1,z);
+    _point.index.assign(1,index);
+    _scaleCoordinates(_point,_pointScaled);
+    return _evaluateBin(_pointScaled,0,anyChanged);
+}
 
-    // Transform (r,mu) to (rBAO,muBAO) using the scale parameters.
-    double rBAO, muBAO;
-    if(_anisotropic) {
-        double ap1(scale_parallel);
-        double bp1(scale_perp);
-        double musq(mu*mu);
-        // Exact (r,mu) transformation
-        double rscale = std::sqrt(ap1*ap1*musq + (1-musq)*bp1*bp1);
-        rBAO = r*rscale;
-        muBAO = mu*ap1/rscale;
-        // Linear approximation, equivalent to multipole model below
-        /*
-        rBAO = r*(1 + (ap1-1)*musq + (bp1-1)*(1-musq));
-        muBAO = mu*(1 + (ap1-bp1)*(1-musq));
-        */
+void local::BaoCorrelationModel::_scaleCoordinates(Coordinates const &coords, ScaledCoordinates &scaled) const {
+    _updateScaledCoordinates(coords,_gammaBias,_gammaBeta,_anisotropic,_scale,_scaleParallel,
+        _scalePerp,_gammaScale,scaled);
+}
+
+void local::BaoCorrelationModel::_evaluateAll(Coordinates const &coords, bool anyChanged,
+std::vector<double> &out) const {
+    _lookupParameters();
+    _scaleCoordinates(coords,_scaled);
+    for(int i = 0; i < out.size(); ++i) {
+        out[i] = _evaluateBin(_scaled,i,anyChanged);
+        // Only the first coordinate sees any parameter changes.
+        anyChanged = false;
     }
-    else {
-        rBAO = r*scale;
-        muBAO = mu;
+}
+
+double local::BaoCorrelationModel::_evaluateBin(ScaledCoordinates const &scaled, int i, bool anyChanged) const {
+
+    double r(scaled.coords.r[i]), mu(scaled.coords.mu[i]), z(scaled.coords.z[i]);
+    int index((*scaled.index)[i]);
+
+    if(z != _zLast) {
+        // Calculate the multipole normalization factors.
+        double biasEvolution(scaled.biasEvolution[i]), betaEvolution(scaled.betaEvolution[i]);
+        _norm0 = _getNormFactor(cosmo::Monopole,biasEvolution,betaEvolution);
+        _norm2 = _getNormFactor(cosmo::Quadrupole,biasEvolution,betaEvolution);
+        _norm4 = _getNormFactor(cosmo::Hexadecapole,biasEvolution,betaEvolution);
+        _zLast = z;
     }
 
+    // Use the (rBAO,muBAO) coordinates calculated from the scale parameters, using the exact
+    // (r,mu) transformation for anisotropic scales.
+    double rBAO(scaled.rBAO[i]), muBAO(scaled.muBAO[i]);
+
     // Calculate the cosmological prediction.
-    double norm0 = _getNormFactor(cosmo::Monopole,z), norm2 = _getNormFactor(cosmo::Quadrupole,z),
-        norm4 = _getNormFactor(cosmo::Hexadecapole,z);
+    double norm0 = _norm0, norm2 = _norm2, norm4 = _norm4;
     double musq(muBAO*muBAO);
     double L2 = (-1+3*musq)/2., L4 = (3+musq*(-30+35*musq))/8.;
     double fid = norm0*(*_fid0)(rBAO) + norm2*L2*(*_fid2)(rBAO) + norm4*L4*(*_fid4)(rBAO);
     double nw = norm0*(*_nw0)(rBAO) + norm2*L2*(*_nw2)(rBAO) + norm4*L4*(*_nw4)(rBAO);
-    double peak = ampl*(fid-nw);
+    double peak = _ampl*(fid-nw);
     double smooth = nw;
     if(_decoupled) {
         // Recalculate the smooth cosmological prediction using (r,mu) instead of (rBAO,muBAO)
@@ -151,27 +178,21 @@ double local::BaoCorrelationModel::_evaluate(double r, double mu, double z, bool
     if(_distortAdd) {
         double distortion = _distortAdd->_evaluate(r,mu,z,anyChanged,index);
         // The additive distortion is multiplied by ((1+z)/(1+z0))^gamma_bias
-        xi += redshiftEvolution(distortion,_getGammaBias(),z,_getZRef());
+        xi += distortion*scaled.biasEvolution[i];
     }
 
-    // Lookup radiation parameters, also value by name.
-    double rad_strength = getParameterValue(_indexBase + 6);
-    double rad_aniso = getParameterValue(_indexBase + 7);
-    double mean_free_path = getParameterValue(_indexBase + 8);
-    double quasar_lifetime = getParameterValue(_indexBase + 9);
-
     // add quasar radiation effects (for cross-correlations only)
     // always works with decoupled
-    if(rad_strength>0 && r>0.){ 
+    if(_radStrength>0 && r>0.){ 
         // isotropical radiation
-        double rad = rad_strength/(r*r);
+        double rad = _radStrength/(r*r);
         // attenuation
-        rad *= std::exp(-r/mean_free_path);
+        rad *= std::exp(-r/_meanFreePath);
         // anisotropy
-        rad *= (1 - rad_aniso*(1-mu*mu));
+        rad *= (1 - _radAniso*(1-mu*mu));
         // time effects 
         double ctd = r*(1-mu)/(1+z);
-        rad *= std::exp(-ctd/quasar_lifetime);
+        rad *= std::exp(-ctd/_quasarLifetime);
         xi += rad;
     }
 
@@ -9,6 +9,7 @@
 #include "cosmo/types.h"
 
 #include <string>
+#include <vector>
 
 namespace baofit {
 	// Represents a two-point correlation model parameterized in terms of the relative scale and amplitude
@@ -33,6 +34,9 @@ namespace baofit {
 		// the pair separation and z is their average redshift. The separation r should
 		// be provided in Mpc/h.
         virtual double _evaluate(double r, double mu, double z, bool anyChanged, int index) const;
+        // Fills the vector provided with the correlation function evaluated at each of the
+        // specified coordinates.
+        virtual void _evaluateAll(Coordinates const &coords, bool anyChanged, std::vector<double> &out) const;
         virtual double _evaluateKSpace(double k, double mu_k, double pk, double z) const;
         virtual int _getIndexBase() const;
 	private:
@@ -40,6 +44,22 @@ namespace baofit {
         bool _anisotropic, _decoupled, _combinedScale;
         int _indexBase, _combScaleBase;
         cosmo::CorrelationFunctionPtr _fid0, _fid2, _fid4, _nw0, _nw2, _nw4;
+        // Looks up the parameter values that do not depend on the coordinates being evaluated.
+        void _lookupParameters() const;
+        // Evaluates the correlation function at coordinate i of scaled using the parameter values
+        // saved by the most recent call to _lookupParameters().
+        double _evaluateBin(ScaledCoordinates const &scaled, int i, bool anyChanged) const;
+        // Updates the cached values in scaled for the specified coordinates, using the parameter
+        // values saved by the most recent call to _lookupParameters().
+        void _scaleCoordinates(Coordinates const &coords, ScaledCoordinates &scaled) const;
+        // Parameter values saved by _lookupParameters and redshift-dependent values saved by
+        // _evaluateBin, which are only recalculated when z changes.
+        mutable double _gammaBias, _gammaBeta, _ampl, _scale, _scaleParallel, _scalePerp, _gammaScale, _radStrength, _radAniso,
+            _meanFreePath, _quasarLifetime, _zLast, _norm0, _norm2, _norm4;
+        // A single coordinate evaluated by _evaluate, and cached values for it and the coordinates
+        // of _evaluateAll.
+        mutable Coordinates _point;
+        mutable ScaledCoordinates _pointScaled, _scaled;
 	}; // BaoCorrelationModel
 } // baofit
 
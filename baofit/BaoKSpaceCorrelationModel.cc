@@ -6,8 +6,10 @@
 #include "baofit/DistortionMatrix.h"
 #include "baofit/MetalCorrelationModel.h"
 #include "baofit/NonLinearCorrectionModel.h"
+#include "baofit/TransformTable.h"
 
 #include "likely/Interpolator.h"
+#include "likely/AbsBinning.h"
 #include "likely/function_impl.h"
 
 #include "cosmo/RuntimeError.h"
@@ -17,9 +19,19 @@
 #include "boost/format.hpp"
 #include "boost/smart_ptr.hpp"
 #include "boost/bind.hpp"
+#include "boost/foreach.hpp"
+#include "boost/algorithm/string.hpp"
+#include "boost/thread.hpp"
 
+#include <algorithm>
 #include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <sstream>
+
+#include <unistd.h>
 
 namespace local = baofit;
 
@@ -31,7 +43,8 @@ local::BaoKSpaceCorrelationModel::BaoKSpaceCorrelationModel(std::string const &m
     std::string const &distAdd, std::string const &distMul, double distR0,
     double zeff, double sigma8, double dzmin, int distMatrixOrder,
     std::string const &distMatrixDistAdd, std::string const &distMatrixDistMul,
-    bool anisotropic, bool decoupled, bool nlBroadband, bool nlCorrection,
+    int transformCacheSize, bool zNodeTransforms, bool zNodeInterpolate, bool rsdDecomposition,
+    std::string const &emulatorGrid, std::string const &emulatorFile, bool anisotropic, bool decoupled, bool nlBroadband, bool nlCorrection,
     bool fitNLCorrection, bool nlCorrectionAlt, bool binSmooth, bool binSmoothAlt,
     bool hcdModel, bool hcdModelAlt, bool uvfluctuation, bool radiationModel,
     bool smoothGauss, bool smoothLorentz, bool distMatrix, bool metalModel,
@@ -44,7 +57,11 @@ _fitNLCorrection(fitNLCorrection), _nlCorrectionAlt(nlCorrectionAlt), _binSmooth
 _binSmoothAlt(binSmoothAlt), _hcdModel(hcdModel), _hcdModelAlt(hcdModelAlt),
 _uvfluctuation(uvfluctuation), _radiationModel(radiationModel), _smoothGauss(smoothGauss),
 _smoothLorentz(smoothLorentz), _combinedBias(combinedBias), _combinedScale(combinedScale),
-_crossCorrelation(crossCorrelation), _verbose(verbose), _nWarnings(0), _maxWarnings(10)
+_crossCorrelation(crossCorrelation), _verbose(verbose), _nWarnings(0), _maxWarnings(10),
+_ellMax(ellMax), _transformCacheSize(transformCacheSize), _transformCacheHits(0), _transformCacheMisses(0),
+_zNodeTransforms(zNodeTransforms || zNodeInterpolate), _zNodeInterpolate(zNodeInterpolate), _zWeight(0),
+_rsdDecomposition(rsdDecomposition || emulatorGrid.length() > 0), _rsdComponent(-1),
+_emulatorFile(emulatorFile)
 {
     _setZRef(zref);
     _setOmegaMatter(OmegaMatter);
@@ -157,6 +174,16 @@ _crossCorrelation(crossCorrelation), _verbose(verbose), _nWarnings(0), _maxWarni
     if(rmin <= 0) throw RuntimeError("BaoKSpaceCorrelationModel: expected rmin > 0.");
     if(dilmin > dilmax) throw RuntimeError("BaoKSpaceCorrelationModel: expected dilmin <= dilmax.");
     if(dilmin <= 0) throw RuntimeError("BaoKSpaceCorrelationModel: expected dilmin > 0.");
+    if(transformCacheSize < 0) throw RuntimeError("BaoKSpaceCorrelationModel: expected transformCacheSize >= 0.");
+    if(zNodeInterpolate && dzmin <= 0) {
+        throw RuntimeError("BaoKSpaceCorrelationModel: expected dzmin > 0 to interpolate between redshift nodes.");
+    }
+    if(_rsdDecomposition && (transformCacheSize > 0 || zNodeTransforms || zNodeInterpolate)) {
+        throw RuntimeError("BaoKSpaceCorrelationModel: RSD decomposition or emulator cannot be combined with a transform cache or redshift nodes.");
+    }
+    if(emulatorGrid.length() > 0 && (nlCorrection || fitNLCorrection || nlCorrectionAlt) && zeff <= 0) {
+        throw RuntimeError("BaoKSpaceCorrelationModel: expected zeff > 0 to emulate a non-linear correction.");
+    }
     // Expand the radial ranges needed for transforms to allow for the min/max dilation.
     rmin *= dilmin;
     rmax *= dilmax;
@@ -164,6 +191,7 @@ _crossCorrelation(crossCorrelation), _verbose(verbose), _nWarnings(0), _maxWarni
     _rmax = rmax;
     // Space interpolation points at ~1 Mpc/h.
     int nr = (int)std::ceil(rmax-rmin);
+    _nr = nr;
     double abspow(0);
     bool symmetric(true);
     // Xipk(r,mu) ~ D(k,mu_k)*Ppk(k)
@@ -174,10 +202,56 @@ _crossCorrelation(crossCorrelation), _verbose(verbose), _nWarnings(0), _maxWarni
         klo,khi,nk,rmin,rmax,nr,ellMax,symmetric,relerr,abserr,abspow));
     
     // Define our non-linear correction model.
-    _nlCorr.reset(new baofit::NonLinearCorrectionModel(zref,sigma8,nlCorrection,fitNLCorrection,nlCorrectionAlt,this));
+    baofit::NonLinearCorrectionModel *nlCorr =
+        new baofit::NonLinearCorrectionModel(zref,sigma8,nlCorrection,fitNLCorrection,nlCorrectionAlt,this);
+    _nlCorr.reset(nlCorr);
     if(fitNLCorrection) _nlcorrBase = _nlCorr->_getIndexBase();
     _useZeff = false;
     if(zeff > 0) _useZeff = true;
+
+    // Define our emulator grid, if any.
+    if(emulatorGrid.length() > 0) {
+        std::vector<int> allowed;
+        _getDistortionParameterIndices(allowed);
+        std::vector<std::string> axes;
+        boost::split(axes,emulatorGrid,boost::is_any_of(";"));
+        BOOST_FOREACH(std::string const &axis, axes) {
+            std::string::size_type pos = axis.find('=');
+            if(pos == std::string::npos) {
+                throw RuntimeError("BaoKSpaceCorrelationModel: badly formatted emulator grid axis '" + axis + "'.");
+            }
+            std::string name = axis.substr(0,pos);
+            int index = getParameterIndex(name);
+            if(std::find(allowed.begin(),allowed.end(),index) == allowed.end()) {
+                throw RuntimeError("BaoKSpaceCorrelationModel: cannot emulate parameter '" + name + "'.");
+            }
+            if(std::find(_emulatorIndex.begin(),_emulatorIndex.end(),index) != _emulatorIndex.end()) {
+                throw RuntimeError("BaoKSpaceCorrelationModel: duplicate emulator grid parameter '" + name + "'.");
+            }
+            likely::AbsBinningCPtr binning = likely::createBinning(axis.substr(pos+1));
+            std::vector<double> nodes;
+            for(int bin = 0; bin < binning->getNBins(); ++bin) {
+                nodes.push_back(binning->getBinCenter(bin));
+                if(bin > 0 && nodes[bin] <= nodes[bin-1]) {
+                    throw RuntimeError("BaoKSpaceCorrelationModel: emulator grid values must be increasing for '" + name + "'.");
+                }
+            }
+            _emulatorIndex.push_back(index);
+            _emulatorNodes.push_back(nodes);
+        }
+        // Describe everything else that our transforms depend on, so that a saved emulator
+        // is only re-used with the same models and precision settings.
+        std::ostringstream key;
+        key << std::setprecision(12) << root << ' ' << fiducialName << ' ' << nowigglesName << ' ' << zref
+            << ' ' << OmegaMatter << ' ' << klo << ' ' << khi << ' ' << nk << ' ' << rmin << ' ' << rmax
+            << ' ' << nr << ' ' << ellMax << ' ' << relerr << ' ' << abserr << ' ' << sigma8 << ' ' << zeff << ' '
+            << nlBroadband << nlCorrection << fitNLCorrection << nlCorrectionAlt << binSmooth << binSmoothAlt
+            << hcdModel << hcdModelAlt << uvfluctuation << smoothGauss << smoothLorentz << crossCorrelation
+            << ' ' << emulatorGrid;
+        _emulatorKey = key.str();
+        // The non-linear correction must see the grid values while we are building the emulator.
+        nlCorr->setParameterLookup(boost::bind(&BaoKSpaceCorrelationModel::_getDistortionParameter,this,_1));
+    }
     
     // Define our r-space metal correlation model, if any.
     if(metalModel || metalModelInterpolate || toyMetal) {
@@ -210,7 +284,506 @@ _crossCorrelation(crossCorrelation), _verbose(verbose), _nWarnings(0), _maxWarni
     }
 }
 
-local::BaoKSpaceCorrelationModel::~BaoKSpaceCorrelationModel() { }
+local::BaoKSpaceCorrelationModel::~BaoKSpaceCorrelationModel() {
+    if(_verbose && _transformCacheSize > 0) {
+        std::cout << "Transform cache: " << _transformCacheHits << " hits, " << _transformCacheMisses
+            << " misses." << std::endl;
+    }
+    if(_verbose && _zNodeTransforms) {
+        std::cout << "Transformed tables were used at " << _zNodes.size() << " redshift nodes." << std::endl;
+    }
+}
+
+void local::BaoKSpaceCorrelationModel::_getTransformKey(std::vector<double> &key) const {
+    key.resize(0);
+    key.push_back(_betaz);
+    if(_crossCorrelation) key.push_back(_beta2z);
+    key.push_back(_snlPar2);
+    key.push_back(_snlPerp2);
+    key.push_back(_zeff);
+    if(_binSmooth || _binSmoothAlt) {
+        for(int k = 0; k < 2; ++k) key.push_back(getParameterValue(_bsBase+k));
+    }
+    if(_fitNLCorrection) {
+        for(int k = 0; k < 2; ++k) key.push_back(getParameterValue(_nlcorrBase+k));
+    }
+    if(_hcdModel || _hcdModelAlt) {
+        for(int k = 0; k < 3; ++k) key.push_back(getParameterValue(_hcdBase+k));
+    }
+    if(_uvfluctuation) {
+        for(int k = 0; k < 3; ++k) key.push_back(getParameterValue(_uvBase+k));
+    }
+    if(_smoothGauss) key.push_back(getParameterValue(_smgausBase));
+    if(_smoothLorentz) key.push_back(getParameterValue(_smlorBase));
+}
+
+bool local::BaoKSpaceCorrelationModel::_findCachedTransforms(std::vector<double> const &key) const {
+    for(std::list<CachedTransform>::iterator iter = _transformCache.begin(); iter != _transformCache.end(); ++iter) {
+        if(iter->key != key) continue;
+        // Move this entry to the front of the cache.
+        _transformCache.splice(_transformCache.begin(),_transformCache,iter);
+        _peakTable = iter->peak;
+        _smoothTable = iter->smooth;
+        _transformCacheHits++;
+        return true;
+    }
+    _transformCacheMisses++;
+    return false;
+}
+
+void local::BaoKSpaceCorrelationModel::_cacheTransforms(std::vector<double> const &key) const {
+    if(_transformCache.size() == _transformCacheSize) _transformCache.pop_back();
+    CachedTransform entry;
+    entry.key = key;
+    entry.peak = _peakTable;
+    entry.smooth = _smoothTable;
+    _transformCache.push_front(entry);
+}
+
+baofit::TransformTablePtr local::BaoKSpaceCorrelationModel::_createTable(
+cosmo::DistortedPowerCorrelation const &transform) const {
+    TransformTablePtr table(new TransformTable(_rmin,_rmax,_nr,_ellMax));
+    table->fill(transform);
+    return table;
+}
+
+void local::BaoKSpaceCorrelationModel::_getTransformChanges(bool &peakChanged, bool &smoothChanged,
+bool includeRsd) const {
+    bool nlChanged = isParameterValueChanged(_nlBase) || isParameterValueChanged(_nlBase+1);
+    bool bsChanged = _binSmooth || _binSmoothAlt ? isParameterValueChanged(_bsBase) || isParameterValueChanged(_bsBase+1)
+        : false;
+    bool nlcorrChanged = _fitNLCorrection ? isParameterValueChanged(_nlcorrBase) || isParameterValueChanged(_nlcorrBase+1)
+        : false;
+    bool hcdChanged = _hcdModel || _hcdModelAlt ? isParameterValueChanged(_hcdBase) || isParameterValueChanged(_hcdBase+1)
+        || isParameterValueChanged(_hcdBase+2) : false;
+    bool uvChanged = _uvfluctuation ? isParameterValueChanged(_uvBase) || isParameterValueChanged(_uvBase+1)
+        || isParameterValueChanged(_uvBase+2) : false;
+    bool smgausChanged = _smoothGauss ? isParameterValueChanged(_smgausBase) : false;
+    bool smlorChanged = _smoothLorentz ? isParameterValueChanged(_smlorBase) : false;
+    bool rsdChanged = includeRsd && (isParameterValueChanged(0) || isParameterValueChanged(3) ||
+        (_crossCorrelation ? isParameterValueChanged(5) : false) || (_crossCorrelation ? isParameterValueChanged(6) : false));
+    smoothChanged = bsChanged || nlcorrChanged || hcdChanged || uvChanged || smgausChanged || smlorChanged || rsdChanged;
+    // Non-linear broadening only applies to the no-wiggles model with nlBroadband.
+    peakChanged = smoothChanged || nlChanged;
+    if(_nlBroadband) smoothChanged |= nlChanged;
+}
+
+bool local::BaoKSpaceCorrelationModel::_runTransform(cosmo::DistortedPowerCorrelation &transform,
+std::string const &name) const {
+    int nmu(20);
+    double margin(4), vepsMax(1e-1), vepsMin(1e-6);
+    bool optimize(false),interpolateK(true),bypassConvergenceTest(false);
+    if(transform.isInitialized()) {
+        // We are already initialized, so just redo the transforms.
+        return transform.transform(interpolateK,bypassConvergenceTest);
+    }
+    // Initialize the first time. This is when the automatic calculation of numerical
+    // precision parameters takes place.
+    transform.initialize(nmu,margin,vepsMax,vepsMin,optimize);
+    if(_verbose) {
+        std::cout << "-- Initialized " << name << " k-space model:" << std::endl;
+        transform.printToStream(std::cout);
+    }
+    return true;
+}
+
+void local::BaoKSpaceCorrelationModel::_warnNotConverged() const {
+    if(++_nWarnings <= _maxWarnings) {
+        std::cout << "WARNING: transforms not converged with:" << std::endl;
+        printCurrentValues(std::cout);
+        if(_nWarnings == _maxWarnings) {
+            std::cout << "(will not print any more warnings like this)" << std::endl;
+        }
+    }
+}
+
+void local::BaoKSpaceCorrelationModel::_transformRsdComponents(cosmo::DistortedPowerCorrelation &transform,
+std::string const &name, std::vector<TransformTablePtr> &tables) const {
+    bool converged(true);
+    // Initialize using the full distortion model the first time, so that the automatic
+    // calculation of numerical precision parameters is the same as without components.
+    if(!transform.isInitialized()) _runTransform(transform,name);
+    tables.resize(_crossCorrelation ? 4 : 3);
+    for(_rsdComponent = 0; _rsdComponent < tables.size(); ++_rsdComponent) {
+        converged &= _runTransform(transform,name);
+        tables[_rsdComponent] = _createTable(transform);
+    }
+    _rsdComponent = -1;
+    if(!converged) _warnNotConverged();
+}
+
+void local::BaoKSpaceCorrelationModel::_setRsdCoefficients(double betaEvolution) const {
+    double beta = _beta0*betaEvolution;
+    _rsdCoefs.resize(0);
+    _rsdCoefs.push_back(1);
+    _rsdCoefs.push_back(beta);
+    if(_crossCorrelation) {
+        double beta2 = _beta20*betaEvolution;
+        _rsdCoefs.push_back(beta2);
+        _rsdCoefs.push_back(beta*beta2);
+    }
+    else {
+        _rsdCoefs.push_back(beta*beta);
+    }
+}
+
+double local::BaoKSpaceCorrelationModel::_sumRsdComponents(std::vector<TransformTablePtr> const &tables,
+double r, double mu) const {
+    double xi(0);
+    for(int m = 0; m < tables.size(); ++m) xi += _rsdCoefs[m]*tables[m]->getCorrelation(r,mu);
+    return xi;
+}
+
+void local::BaoKSpaceCorrelationModel::_getDistortionParameterIndices(std::vector<int> &indices) const {
+    indices.resize(0);
+    indices.push_back(_nlBase);
+    indices.push_back(_nlBase+1);
+    if(_binSmooth || _binSmoothAlt) {
+        for(int k = 0; k < 2; ++k) indices.push_back(_bsBase+k);
+    }
+    if(_fitNLCorrection) {
+        for(int k = 0; k < 2; ++k) indices.push_back(_nlcorrBase+k);
+    }
+    if(_hcdModel || _hcdModelAlt) {
+        for(int k = 0; k < 3; ++k) indices.push_back(_hcdBase+k);
+    }
+    if(_uvfluctuation) {
+        for(int k = 0; k < 3; ++k) indices.push_back(_uvBase+k);
+    }
+    if(_smoothGauss) indices.push_back(_smgausBase);
+    if(_smoothLorentz) indices.push_back(_smlorBase);
+}
+
+double local::BaoKSpaceCorrelationModel::_getDistortionParameter(int index) const {
+    if(!_parameterOverrides.empty()) {
+        std::map<int,double>::const_iterator found = _parameterOverrides.find(index);
+        if(found != _parameterOverrides.end()) return found->second;
+    }
+    return getParameterValue(index);
+}
+
+namespace baofit {
+namespace emulator {
+    // Identifies the format of a saved emulator file.
+    char const *magic = "baofit emulator v1";
+    // Returns the number of points on the grid with the specified values along each axis.
+    int getNPoints(std::vector<std::vector<double> > const &nodes) {
+        int npoints(1);
+        for(int axis = 0; axis < nodes.size(); ++axis) npoints *= nodes[axis].size();
+        return npoints;
+    }
+}
+}
+
+std::string local::BaoKSpaceCorrelationModel::_getEmulatorTablesKey() const {
+    // Our tables assume the configured values of the other parameters of D(k,mu_k), which
+    // are added to our key.
+    std::vector<int> indices;
+    _getDistortionParameterIndices(indices);
+    likely::FitParameters params(getFitParameters());
+    _emulatorFixedIndex.resize(0);
+    _emulatorFixedValue.resize(0);
+    std::ostringstream key;
+    key << std::setprecision(12) << _emulatorKey;
+    BOOST_FOREACH(int index, indices) {
+        if(std::find(_emulatorIndex.begin(),_emulatorIndex.end(),index) != _emulatorIndex.end()) continue;
+        double value = params[index].getValue();
+        _emulatorFixedIndex.push_back(index);
+        _emulatorFixedValue.push_back(value);
+        key << ' ' << value;
+    }
+    return key.str();
+}
+
+void local::BaoKSpaceCorrelationModel::buildEmulator() {
+    if(!_emulatorIndex.empty() && _emulatorTables.empty()) _buildEmulator();
+}
+
+void local::BaoKSpaceCorrelationModel::shareEmulator(BaoKSpaceCorrelationModel const &other) {
+    if(_emulatorIndex.empty()) return;
+    if(other._emulatorTables.empty()) other._buildEmulator();
+    if(_getEmulatorTablesKey() != other._emulatorTablesKey) {
+        throw RuntimeError("BaoKSpaceCorrelationModel::shareEmulator: emulators are not compatible.");
+    }
+    _emulatorTables = other._emulatorTables;
+    _emulatorTablesKey = other._emulatorTablesKey;
+    _peakComponents.resize(0);
+    _smoothComponents.resize(0);
+}
+
+void local::BaoKSpaceCorrelationModel::checkFitParameters(likely::FitParameters const &params) const {
+    if(_emulatorIndex.empty()) return;
+    if(_emulatorTables.empty()) _buildEmulator();
+    for(int k = 0; k < _emulatorFixedIndex.size(); ++k) {
+        likely::FitParameter const &param = params[_emulatorFixedIndex[k]];
+        if(param.isFloating() || param.getValue() != _emulatorFixedValue[k]) {
+            throw RuntimeError("BaoKSpaceCorrelationModel: parameter '" + param.getName() +
+                "' must be on the emulator grid to change.");
+        }
+    }
+    for(int axis = 0; axis < _emulatorIndex.size(); ++axis) {
+        likely::FitParameter const &param = params[_emulatorIndex[axis]];
+        std::vector<double> const &nodes = _emulatorNodes[axis];
+        if(param.getValue() < nodes.front() || param.getValue() > nodes.back()) {
+            throw RuntimeError("BaoKSpaceCorrelationModel: parameter '" + param.getName() +
+                "' is outside the emulator grid.");
+        }
+    }
+}
+
+void local::BaoKSpaceCorrelationModel::_buildEmulator() const {
+    std::string key = _getEmulatorTablesKey();
+    if(_emulatorFile.length() > 0 && _readEmulator(key)) {
+        _emulatorTablesKey = key;
+        return;
+    }
+    // Transform the RSD components at each grid point, with the last axis varying fastest,
+    // using the configured values of the other parameters.
+    int naxes = _emulatorIndex.size(), npoints = emulator::getNPoints(_emulatorNodes);
+    if(_verbose) {
+        std::cout << "Transforming k-space emulator at " << npoints << " grid points..." << std::endl;
+    }
+    for(int k = 0; k < _emulatorFixedIndex.size(); ++k) {
+        _parameterOverrides[_emulatorFixedIndex[k]] = _emulatorFixedValue[k];
+    }
+    // The first transform calibrates its precision using the full distortion model, which
+    // needs beta (and beta2) at zref, so use their configured values.
+    likely::FitParameters params(getFitParameters());
+    _parameterOverrides[0] = params[0].getValue();
+    _betaz = _getDistortionParameter(0);
+    if(_crossCorrelation) {
+        _parameterOverrides[5] = params[5].getValue();
+        _parameterOverrides[6] = params[6].getValue();
+        _beta2z = _getDistortionParameter(6)/_getDistortionParameter(5);
+    }
+    _emulatorTables.resize(0);
+    std::vector<TransformTablePtr> tables;
+    for(int point = 0; point < npoints; ++point) {
+        int remainder(point);
+        for(int axis = naxes-1; axis >= 0; --axis) {
+            int nnodes = _emulatorNodes[axis].size();
+            _parameterOverrides[_emulatorIndex[axis]] = _emulatorNodes[axis][remainder % nnodes];
+            remainder /= nnodes;
+        }
+        double snlPerp = _getDistortionParameter(_nlBase);
+        double snlPar = snlPerp*_getDistortionParameter(_nlBase+1);
+        _snlPerp2 = snlPerp*snlPerp;
+        _snlPar2 = snlPar*snlPar;
+        _transformRsdComponents(*_Xipk,"peak",tables);
+        _emulatorTables.insert(_emulatorTables.end(),tables.begin(),tables.end());
+        // Are we only applying non-linear broadening to the peak?
+        if(!_nlBroadband) _snlPerp2 = _snlPar2 = 0;
+        _transformRsdComponents(*_Xinw,"no-wiggles",tables);
+        _emulatorTables.insert(_emulatorTables.end(),tables.begin(),tables.end());
+    }
+    _parameterOverrides.clear();
+    _emulatorTablesKey = key;
+    if(_emulatorFile.length() > 0) _writeEmulator(key);
+}
+
+bool local::BaoKSpaceCorrelationModel::_readEmulator(std::string const &key) const {
+    std::ifstream in(_emulatorFile.c_str(),std::ios::binary);
+    if(!in.good()) return false;
+    std::string line;
+    if(!std::getline(in,line) || line != emulator::magic) {
+        throw RuntimeError("BaoKSpaceCorrelationModel: " + _emulatorFile + " is not an emulator file.");
+    }
+    if(!std::getline(in,line) || line != key) {
+        if(_verbose) {
+            std::cout << "Emulator file " << _emulatorFile << " was created with different settings." << std::endl;
+        }
+        return false;
+    }
+    int ntables = emulator::getNPoints(_emulatorNodes)*2*(_crossCorrelation ? 4 : 3);
+    _emulatorTables.resize(ntables);
+    for(int k = 0; k < ntables; ++k) {
+        _emulatorTables[k].reset(new TransformTable(_rmin,_rmax,_nr,_ellMax));
+        _emulatorTables[k]->read(in);
+    }
+    if(_verbose) std::cout << "Read k-space emulator from " << _emulatorFile << std::endl;
+    return true;
+}
+
+void local::BaoKSpaceCorrelationModel::_writeEmulator(std::string const &key) const {
+    // Write to a temporary file that is renamed when complete, so that other jobs sharing
+    // our emulator file never read a partially written file.
+    // The temporary name is unique to this process and thread, since separate jobs, or models
+    // in separate threads, might be saving the same emulator at the same time.
+    char hostname[256];
+    if(0 != ::gethostname(hostname,sizeof(hostname))) hostname[0] = 0;
+    hostname[sizeof(hostname)-1] = 0;
+    std::ostringstream tmpStream;
+    tmpStream << _emulatorFile << ".tmp." << hostname << '.' << ::getpid() << '.' << boost::this_thread::get_id();
+    std::string tmpName(tmpStream.str());
+    std::ofstream out(tmpName.c_str(),std::ios::binary);
+    if(!out.good()) throw RuntimeError("BaoKSpaceCorrelationModel: unable to open " + tmpName);
+    out << emulator::magic << '\n' << key << '\n';
+    BOOST_FOREACH(TransformTablePtr const &table, _emulatorTables) table->write(out);
+    out.close();
+    if(!out) throw RuntimeError("BaoKSpaceCorrelationModel: error writing " + tmpName);
+    if(0 != std::rename(tmpName.c_str(),_emulatorFile.c_str())) {
+        throw RuntimeError("BaoKSpaceCorrelationModel: unable to rename " + tmpName);
+    }
+    if(_verbose) std::cout << "Saved k-space emulator to " << _emulatorFile << std::endl;
+}
+
+void local::BaoKSpaceCorrelationModel::_interpolateEmulator() const {
+    // Our tables assume the values of the parameters that are not on the grid. Fits check this
+    // before they start, but models can also be evaluated outside of a fit.
+    for(int k = 0; k < _emulatorFixedIndex.size(); ++k) {
+        int index = _emulatorFixedIndex[k];
+        if(getParameterValue(index) != _emulatorFixedValue[k]) {
+            throw RuntimeError("BaoKSpaceCorrelationModel: parameter '" + getFitParameters()[index].getName() +
+                "' must be on the emulator grid to change.");
+        }
+    }
+    // Locate the grid cell containing our current parameter values.
+    int naxes = _emulatorIndex.size(), stride(1);
+    std::vector<int> lo(naxes), strides(naxes);
+    std::vector<double> frac(naxes);
+    for(int axis = naxes-1; axis >= 0; --axis) {
+        std::vector<double> const &nodes = _emulatorNodes[axis];
+        int index = _emulatorIndex[axis], nnodes = nodes.size();
+        double value = getParameterValue(index);
+        if(value < nodes.front() || value > nodes.back()) {
+            throw RuntimeError("BaoKSpaceCorrelationModel: parameter '" + getFitParameters()[index].getName() +
+                "' is outside the emulator grid.");
+        }
+        lo[axis] = 0;
+        frac[axis] = 0;
+        if(nnodes > 1) {
+            int i = std::upper_bound(nodes.begin(),nodes.end(),value) - nodes.begin() - 1;
+            if(i > nnodes-2) i = nnodes-2;
+            lo[axis] = i;
+            frac[axis] = (value - nodes[i])/(nodes[i+1] - nodes[i]);
+        }
+        strides[axis] = stride;
+        stride *= nnodes;
+    }
+    // Find the multilinear weight of each corner of this cell.
+    std::vector<int> points;
+    std::vector<double> weights;
+    for(int corner = 0; corner < (1 << naxes); ++corner) {
+        int point(0);
+        double weight(1);
+        for(int axis = 0; axis < naxes; ++axis) {
+            bool hi = corner & (1 << axis);
+            weight *= hi ? frac[axis] : 1 - frac[axis];
+            point += (lo[axis] + (hi ? 1 : 0))*strides[axis];
+        }
+        if(0 == weight) continue;
+        points.push_back(point);
+        weights.push_back(weight);
+    }
+    // Combine the corner tables of each RSD component.
+    int ncomp = _crossCorrelation ? 4 : 3;
+    _peakComponents.resize(ncomp);
+    _smoothComponents.resize(ncomp);
+    std::vector<TransformTablePtr> tables(points.size());
+    for(int which = 0; which < 2; ++which) {
+        std::vector<TransformTablePtr> &components = which ? _smoothComponents : _peakComponents;
+        for(int m = 0; m < ncomp; ++m) {
+            for(int k = 0; k < points.size(); ++k) tables[k] = _emulatorTables[(points[k]*2 + which)*ncomp + m];
+            if(!components[m]) components[m].reset(new TransformTable(_rmin,_rmax,_nr,_ellMax));
+            components[m]->combine(tables,weights);
+        }
+    }
+}
+
+int local::BaoKSpaceCorrelationModel::_getTransformNode(double z) const {
+    for(int k = 0; k < _zNodes.size(); ++k) {
+        if(_zNodes[k].z == z) return k;
+    }
+    TransformNode node;
+    node.z = z;
+    node.peakValid = node.smoothValid = false;
+    _zNodes.push_back(node);
+    return _zNodes.size()-1;
+}
+
+void local::BaoKSpaceCorrelationModel::_selectTransformNodes(double z) const {
+    int lo, hi(-1);
+    _zWeight = 0;
+    if(_zNodeInterpolate) {
+        // Interpolate linearly between nodes spaced by dzmin starting from zref.
+        double x = (z - _getZRef())/_dzmin;
+        int k = (int)std::floor(x);
+        lo = _getTransformNode(_getZRef() + k*_dzmin);
+        _zWeight = x - k;
+        if(_zWeight > 0) hi = _getTransformNode(_getZRef() + (k+1)*_dzmin);
+    }
+    else {
+        // Use the nearest node within dzmin, or else create a new node at z.
+        lo = -1;
+        for(int k = 0; k < _zNodes.size(); ++k) {
+            double dz = std::fabs(z - _zNodes[k].z);
+            if(dz <= _dzmin && (lo < 0 || dz < std::fabs(z - _zNodes[lo].z))) lo = k;
+        }
+        if(lo < 0) lo = _getTransformNode(z);
+    }
+    _updateTransformNode(_zNodes[lo]);
+    _peakTable = _zNodes[lo].peak;
+    _smoothTable = _zNodes[lo].smooth;
+    if(hi >= 0) {
+        _updateTransformNode(_zNodes[hi]);
+        _peakTableHi = _zNodes[hi].peak;
+        _smoothTableHi = _zNodes[hi].smooth;
+    }
+}
+
+void local::BaoKSpaceCorrelationModel::_updateTransformNode(TransformNode &node) const {
+    if(node.peakValid && node.smoothValid) return;
+    // Evaluate our k-space distortion model at the node redshift.
+    _betaz = redshiftEvolution(_beta0,_gammaBeta0,node.z,_getZRef());
+    if(_crossCorrelation) _beta2z = redshiftEvolution(_beta20,_gammaBeta0,node.z,_getZRef());
+    if(!_useZeff) _zeff = node.z;
+    _snlPerp2 = _snlPerp0*_snlPerp0;
+    _snlPar2 = _snlPar0*_snlPar0;
+    // Look for tables of these transforms in our cache, if enabled.
+    std::vector<double> key;
+    if(_transformCacheSize > 0) {
+        _getTransformKey(key);
+        if(_findCachedTransforms(key)) {
+            node.peak = _peakTable;
+            node.smooth = _smoothTable;
+            node.peakValid = node.smoothValid = true;
+            return;
+        }
+    }
+    bool converged(true);
+    if(!node.peakValid) {
+        converged &= _runTransform(*_Xipk,"peak");
+        node.peak = _createTable(*_Xipk);
+    }
+    if(!_nlBroadband) _snlPerp2 = _snlPar2 = 0;
+    if(!node.smoothValid) {
+        converged &= _runTransform(*_Xinw,"no-wiggles");
+        node.smooth = _createTable(*_Xinw);
+    }
+    if(!converged) _warnNotConverged();
+    node.peakValid = node.smoothValid = true;
+    if(_transformCacheSize > 0) {
+        _peakTable = node.peak;
+        _smoothTable = node.smooth;
+        _cacheTransforms(key);
+    }
+}
+
+double local::BaoKSpaceCorrelationModel::_getPeakCorrelation(double r, double mu) const {
+    if(_rsdDecomposition) return _sumRsdComponents(_peakComponents,r,mu);
+    if(!_peakTable) return _Xipk->getCorrelation(r,mu);
+    double xi = _peakTable->getCorrelation(r,mu);
+    if(_zWeight > 0) xi += _zWeight*(_peakTableHi->getCorrelation(r,mu) - xi);
+    return xi;
+}
+
+double local::BaoKSpaceCorrelationModel::_getSmoothCorrelation(double r, double mu) const {
+    if(_rsdDecomposition) return _sumRsdComponents(_smoothComponents,r,mu);
+    if(!_smoothTable) return _Xinw->getCorrelation(r,mu);
+    double xi = _smoothTable->getCorrelation(r,mu);
+    if(_zWeight > 0) xi += _zWeight*(_smoothTableHi->getCorrelation(r,mu) - xi);
+    return xi;
+}
 
 double local::BaoKSpaceCorrelationModel::_evaluateKSpaceDistortion(double k, double mu_k, double pk) const {
     double mu2(mu_k*mu_k);
@@ -219,35 +792,51 @@ double local::BaoKSpaceCorrelationModel::_evaluateKSpaceDistortion(double k, dou
     double tracer1 = 1 + _betaz*mu2;
     double tracer2 = _crossCorrelation ? 1 + _beta2z*mu2 : tracer1;
     double linear = tracer1*tracer2;
+    double uvFunc(1), tracerHcd(0);
     // Calculate UV fluctuation correction, if any.
     if(_uvfluctuation) {
-        double uvRelBias = getParameterValue(_uvBase);
-        double uvBiasAbsorberResponse = getParameterValue(_uvBase+1);
-        double uvMeanFreePath = getParameterValue(_uvBase+2);
+        double uvRelBias = _getDistortionParameter(_uvBase);
+        double uvBiasAbsorberResponse = _getDistortionParameter(_uvBase+1);
+        double uvMeanFreePath = _getDistortionParameter(_uvBase+2);
         double s(uvMeanFreePath*k);
         double Ws = std::atan(s)/s;
-        double uvFunc = 1 + uvRelBias*Ws/(1+uvBiasAbsorberResponse*Ws);
+        uvFunc = 1 + uvRelBias*Ws/(1+uvBiasAbsorberResponse*Ws);
         tracer1 = uvFunc + _betaz*mu2;
         tracer2 = _crossCorrelation ? 1 + _beta2z*mu2 : tracer1;
         linear = tracer1*tracer2;
     }
     // Calculate HCD correction, if any.
     if(_hcdModel || _hcdModelAlt) {
-        double hcdBeta = getParameterValue(_hcdBase);
-        double hcdRelBias = getParameterValue(_hcdBase+1);
-        double hcdScale = getParameterValue(_hcdBase+2);
+        double hcdBeta = _getDistortionParameter(_hcdBase);
+        double hcdRelBias = _getDistortionParameter(_hcdBase+1);
+        double hcdScale = _getDistortionParameter(_hcdBase+2);
         double hcdFunc = 1;
         if(_hcdModel) hcdFunc = std::sin(hcdScale*kpar)/(hcdScale*kpar);
         else if(_hcdModelAlt) hcdFunc = std::exp(-(hcdScale*kpar)*(hcdScale*kpar)/2);
-        double tracerHcd = hcdRelBias*(1 + hcdBeta*mu2)*hcdFunc;
+        tracerHcd = hcdRelBias*(1 + hcdBeta*mu2)*hcdFunc;
         linear = _crossCorrelation ? tracer1*tracer2 + tracer2*tracerHcd
             : tracer1*tracer1 + 2*tracer1*tracerHcd + tracerHcd*tracerHcd;
     }
+    // Replace the linear bias model with one term of its expansion in powers of beta (and beta2)
+    // when transforming RSD components separately. See _setRsdCoefficients for their coefficients.
+    if(_rsdComponent >= 0) {
+        double u = uvFunc + tracerHcd;
+        if(_crossCorrelation) {
+            // (u + beta mu^2)(1 + beta2 mu^2) = u + beta mu^2 + beta2 u mu^2 + beta beta2 mu^4
+            double terms[] = { u, mu2, u*mu2, mu2*mu2 };
+            linear = terms[_rsdComponent];
+        }
+        else {
+            // (u + beta mu^2)^2 = u^2 + 2 beta u mu^2 + beta^2 mu^4
+            double terms[] = { u*u, 2*u*mu2, mu2*mu2 };
+            linear = terms[_rsdComponent];
+        }
+    }
     // Calculate binning smoothing, if any.
     double smoothbin(1);
     if(_binSmooth || _binSmoothAlt) {
-        double binScalePar = getParameterValue(_bsBase);
-        double binScalePerp = getParameterValue(_bsBase+1);
+        double binScalePar = _getDistortionParameter(_bsBase);
+        double binScalePerp = _getDistortionParameter(_bsBase+1);
         if(_binSmooth) {
             double kperp = k*std::sqrt(1-mu2);
             double smoothbinPar = std::sin(0.5*binScalePar*kpar)/(0.5*binScalePar*kpar);
@@ -263,13 +852,13 @@ double local::BaoKSpaceCorrelationModel::_evaluateKSpaceDistortion(double k, dou
     // Calculate Gaussian smoothing, if any.
     double gaussmooth(1);
     if(_smoothGauss) {
-        double scaleGaus = getParameterValue(_smgausBase);
+        double scaleGaus = _getDistortionParameter(_smgausBase);
         gaussmooth = std::exp(-0.5*scaleGaus*scaleGaus*kpar*kpar);
     }
     // Calculate Lorentzian smoothing, if any.
     double lorsmooth(1);
     if(_smoothLorentz) {
-        double scaleLor = getParameterValue(_smlorBase);
+        double scaleLor = _getDistortionParameter(_smlorBase);
         lorsmooth = std::sqrt(1/(1+scaleLor*scaleLor*kpar*kpar));
     }
     // Calculate non-linear broadening.
@@ -282,34 +871,129 @@ double local::BaoKSpaceCorrelationModel::_evaluateKSpaceDistortion(double k, dou
     return nonlinear*nonlinearcorr*linear*smoothbin*gaussmooth*lorsmooth;
 }
 
-double local::BaoKSpaceCorrelationModel::_evaluate(double r, double mu, double z,
-bool anyChanged, int index) const {
-
+void local::BaoKSpaceCorrelationModel::_lookupParameters() const {
     // Lookup linear bias parameters.
-    double beta = getParameterValue(0);
+    _beta0 = getParameterValue(0);
     double bb = getParameterValue(1);
     // Calculate bias^2 from beta and bb.
-    double bias = bb/(1+beta);
+    double bias = bb/(1+_beta0);
     if(_combinedBias) {
         double betabias = getParameterValue(_combBiasBase);
-        bias = betabias/beta;
+        bias = betabias/_beta0;
     }
     // Get linear bias parameters of other tracer (if we are modeling a cross correlation)
     // and calculate the combined bias^2 at zref.
-    double beta2,bias2,biasSq;
     if(_crossCorrelation) {
-        bias2 = getParameterValue(5);
+        double bias2 = getParameterValue(5);
         double beta2bias2 = getParameterValue(6);
-        beta2 = beta2bias2/bias2;
-        biasSq = bias*bias2;
+        _beta20 = beta2bias2/bias2;
+        _biasSq0 = bias*bias2;
     }
     else {
-        biasSq = bias*bias;
+        _biasSq0 = bias*bias;
     }
     
     // Lookup linear bias redshift evolution parameters.
-    double gammaBias = getParameterValue(2);
-    double gammaBeta = getParameterValue(3);
+    _gammaBias0 = getParameterValue(2);
+    _gammaBeta0 = getParameterValue(3);
+
+    // Lookup non-linear broadening parameters.
+    _snlPerp0 = getParameterValue(_nlBase);
+    _snlPar0 = _snlPerp0*getParameterValue(_nlBase+1);
+
+    // Lookup BAO peak parameter values.
+    _ampl0 = getParameterValue(_baoBase);
+    _scale0 = getParameterValue(_baoBase + 1);
+    _scaleParallel0 = getParameterValue(_baoBase + 2);
+    _scalePerp0 = getParameterValue(_baoBase + 3);
+    _gammaScale0 = getParameterValue(_baoBase + 4);
+    if(_combinedScale) {
+        double scale_ratio = getParameterValue(_combScaleBase);
+        _scalePerp0 = scale_ratio*_scaleParallel0;
+    }
+}
+
+double local::BaoKSpaceCorrelationModel::_evaluate(double r, double mu, double z,
+bool anyChanged, int index) const {
+    _lookupParameters();
+    _point.r.assign(1,r);
+    _point.mu.assign(1,mu);
+    _point.z.assign(1,z);
+    _point.index.assign(1,index);
+    _scaleCoordinates(_point,_pointScaled);
+    return _evaluateBin(_pointScaled,0,anyChanged);
+}
+
+void local::BaoKSpaceCorrelationModel::_scaleCoordinates(Coordinates const &coords,
+ScaledCoordinates &scaled) const {
+    _updateScaledCoordinates(coords,_gammaBias0,_gammaBeta0,_anisotropic,_scale0,_scaleParallel0,
+        _scalePerp0,_gammaScale0,scaled);
+}
+
+void local::BaoKSpaceCorrelationModel::_evaluateAll(Coordinates const &coords, bool anyChanged,
+std::vector<double> &out) const {
+    _lookupParameters();
+    _scaleCoordinates(coords,_scaled);
+    _binTerms.resize(out.size());
+    for(int i = 0; i < out.size(); ++i) {
+        out[i] = _evaluateBin(_scaled,i,anyChanged);
+        _binTerms[i] = _lastTerms;
+        // Only the first coordinate sees any parameter changes.
+        anyChanged = false;
+    }
+}
+
+void local::BaoKSpaceCorrelationModel::_evaluateAllJacobian(Coordinates const &coords,
+std::vector<int> const &indices, std::vector<double> &jacobian, std::vector<bool> &analytic) const {
+    int n = coords.r.size(), nindices = indices.size();
+    if(_binTerms.size() != n) return;
+    std::vector<bool> found(nindices);
+    // A distortion matrix mixes bins, so the BAO amplitude and metal derivatives are only
+    // calculated analytically without one.
+    if(!_distMat) {
+        for(int k = 0; k < nindices; ++k) {
+            if(indices[k] != _baoBase) continue;
+            for(int i = 0; i < n; ++i) jacobian[k*n+i] = _binTerms[i].peak*_binTerms[i].mul;
+            analytic[k] = true;
+        }
+        if(_metalCorr) {
+            found.assign(nindices,false);
+            _metalCorr->_evaluateAllJacobian(coords,indices,jacobian,found);
+            for(int k = 0; k < nindices; ++k) {
+                if(!found[k]) continue;
+                for(int i = 0; i < n; ++i) jacobian[k*n+i] *= _binTerms[i].mul;
+                analytic[k] = true;
+            }
+        }
+    }
+    if(_distortMul) {
+        found.assign(nindices,false);
+        _distortMul->_evaluateAllJacobian(coords,indices,jacobian,found);
+        for(int k = 0; k < nindices; ++k) {
+            if(!found[k]) continue;
+            for(int i = 0; i < n; ++i) jacobian[k*n+i] *= _binTerms[i].preMul;
+            analytic[k] = true;
+        }
+    }
+    if(_distortAdd) {
+        found.assign(nindices,false);
+        _distortAdd->_evaluateAllJacobian(coords,indices,jacobian,found);
+        for(int k = 0; k < nindices; ++k) {
+            if(!found[k]) continue;
+            for(int i = 0; i < n; ++i) jacobian[k*n+i] *= _binTerms[i].addEvol;
+            analytic[k] = true;
+        }
+    }
+}
+
+double local::BaoKSpaceCorrelationModel::_evaluateBin(ScaledCoordinates const &scaled, int i,
+bool anyChanged) const {
+
+    double r(scaled.coords.r[i]), mu(scaled.coords.mu[i]), z(scaled.coords.z[i]);
+    int index((*scaled.index)[i]);
+
+    // Use the linear bias parameter values saved by _lookupParameters.
+    double beta(_beta0), beta2(_beta20), biasSq(_biasSq0);
 
     // Get the effective redshift from the data, if not set separately.
     if(!_useZeff) _zeff = z;
@@ -319,102 +1003,84 @@ bool anyChanged, int index) const {
     _zLast = z;
     
     // Apply redshift evolution.
-    double biasSqz = redshiftEvolution(biasSq,gammaBias,z,_getZRef());
-    _betaz = redshiftEvolution(beta,gammaBeta,z,_getZRef());
-    if(_crossCorrelation) _beta2z = redshiftEvolution(beta2,gammaBeta,z,_getZRef());
+    double biasSqz = biasSq*scaled.biasEvolution[i];
+    _betaz = beta*scaled.betaEvolution[i];
+    if(_crossCorrelation) _beta2z = beta2*scaled.betaEvolution[i];
 
-    // Lookup non-linear broadening parameters.
-    double snlPerp = getParameterValue(_nlBase);
-    double snlPar = snlPerp*getParameterValue(_nlBase+1);
-    _snlPerp2 = snlPerp*snlPerp;
-    _snlPar2 = snlPar*snlPar;
-
-    // Redo the transforms from (k,mu_k) to (r,mu), if necessary.
-    if(anyChanged || zChanged) {
-        bool nlChanged = isParameterValueChanged(_nlBase) || isParameterValueChanged(_nlBase+1);
-        bool bsChanged = _binSmooth || _binSmoothAlt ? isParameterValueChanged(_bsBase) || isParameterValueChanged(_bsBase+1)
-            : false;
-        bool nlcorrChanged = _fitNLCorrection ? isParameterValueChanged(_nlcorrBase) || isParameterValueChanged(_nlcorrBase+1)
-            : false;
-        bool hcdChanged = _hcdModel || _hcdModelAlt ? isParameterValueChanged(_hcdBase) || isParameterValueChanged(_hcdBase+1)
-            || isParameterValueChanged(_hcdBase+2) : false;
-        bool uvChanged = _uvfluctuation ? isParameterValueChanged(_uvBase) || isParameterValueChanged(_uvBase+1)
-            || isParameterValueChanged(_uvBase+2) : false;
-        bool smgausChanged = _smoothGauss ? isParameterValueChanged(_smgausBase) : false;
-        bool smlorChanged = _smoothLorentz ? isParameterValueChanged(_smlorBase) : false;
-        bool rsdChanged = isParameterValueChanged(0) || isParameterValueChanged(3) ||
-            (_crossCorrelation ? isParameterValueChanged(5) : false) || (_crossCorrelation ? isParameterValueChanged(6) : false);
-        int nmu(20);
-        double margin(4), vepsMax(1e-1), vepsMin(1e-6);
-        bool optimize(false),interpolateK(true),bypassConvergenceTest(false),converged(true);
-        if(!_Xipk->isInitialized()) {
-            // Initialize the first time. This is when the automatic calculation of numerical
-            // precision parameters takes place.
-            _Xipk->initialize(nmu,margin,vepsMax,vepsMin,optimize);
-            if(_verbose) {
-                std::cout << "-- Initialized peak k-space model:" << std::endl;
-                _Xipk->printToStream(std::cout);
+    // Set non-linear broadening parameters.
+    _snlPerp2 = _snlPerp0*_snlPerp0;
+    _snlPar2 = _snlPar0*_snlPar0;
+
+    if(_zNodeTransforms) {
+        // Invalidate the tables at each redshift node that depend on any changed parameters.
+        if(anyChanged) {
+            bool peakChanged, smoothChanged;
+            _getTransformChanges(peakChanged,smoothChanged);
+            for(int k = 0; k < _zNodes.size(); ++k) {
+                if(peakChanged) _zNodes[k].peakValid = false;
+                if(smoothChanged) _zNodes[k].smoothValid = false;
             }
         }
-        else if(nlChanged || bsChanged || nlcorrChanged || hcdChanged || uvChanged || smgausChanged || smlorChanged || rsdChanged || zChanged) {
-            // We are already initialized, so just redo the transforms.
-            converged &= _Xipk->transform(interpolateK,bypassConvergenceTest);
-        }
-        // Are we only applying non-linear broadening to the peak?
-        if(!_nlBroadband) {
-            _snlPerp2 = _snlPar2 = 0;
-            nlChanged = false;
-        }
-        if(!_Xinw->isInitialized()) {
-            // Initialize the first time. This is when the automatic calculation of numerical
-            // precision parameters takes place.
-            _Xinw->initialize(nmu,margin,vepsMax,vepsMin,optimize);
-            if(_verbose) {
-                std::cout << "-- Initialized no-wiggles k-space model:" << std::endl;
-                _Xinw->printToStream(std::cout);
-            }
+        _selectTransformNodes(z);
+    }
+    else if(!_emulatorIndex.empty()) {
+        // Interpolate our emulator tables after any parameter changes, building them first if necessary.
+        if(_emulatorTables.empty()) _buildEmulator();
+        if(anyChanged || _peakComponents.empty()) _interpolateEmulator();
+        _setRsdCoefficients(scaled.betaEvolution[i]);
+    }
+    else if(_rsdDecomposition) {
+        // Repeat the transforms of each RSD component after changes to any other parameters
+        // that D(k,mu_k) depends on, or to the redshift used by a non-linear correction.
+        if(anyChanged || zChanged) {
+            bool peakChanged, smoothChanged, includeRsd(false);
+            _getTransformChanges(peakChanged,smoothChanged,includeRsd);
+            bool zDependent = (_nlCorrection || _fitNLCorrection || _nlCorrectionAlt) && !_useZeff;
+            peakChanged |= (zDependent && zChanged) || _peakComponents.empty();
+            smoothChanged |= (zDependent && zChanged) || _smoothComponents.empty();
+            if(peakChanged) _transformRsdComponents(*_Xipk,"peak",_peakComponents);
+            // Are we only applying non-linear broadening to the peak?
+            if(!_nlBroadband) _snlPerp2 = _snlPar2 = 0;
+            if(smoothChanged) _transformRsdComponents(*_Xinw,"no-wiggles",_smoothComponents);
         }
-        else if(nlChanged || bsChanged || nlcorrChanged || hcdChanged || uvChanged || smgausChanged || smlorChanged || rsdChanged || zChanged) {
-            // We are already initialized, so just redo the transforms.
-            converged &= _Xinw->transform(interpolateK,bypassConvergenceTest);
+        _setRsdCoefficients(scaled.betaEvolution[i]);
+    }
+    else if(anyChanged || zChanged) {
+        // Redo the transforms from (k,mu_k) to (r,mu), if necessary.
+        bool peakChanged, smoothChanged;
+        _getTransformChanges(peakChanged,smoothChanged);
+        peakChanged |= zChanged || !_Xipk->isInitialized();
+        smoothChanged |= zChanged || !_Xinw->isInitialized();
+        // Look for tables of these transforms in our cache, if enabled.
+        bool cached(false);
+        std::vector<double> key;
+        if(_transformCacheSize > 0 && peakChanged) {
+            _getTransformKey(key);
+            cached = _findCachedTransforms(key);
         }
-        if(!converged) {
-            if(++_nWarnings <= _maxWarnings) {
-                std::cout << "WARNING: transforms not converged with:" << std::endl;
-                printCurrentValues(std::cout);
-                if(_nWarnings == _maxWarnings) {
-                    std::cout << "(will not print any more warnings like this)" << std::endl;
-                }
+        if(!cached) {
+            bool converged(true);
+            if(peakChanged) converged &= _runTransform(*_Xipk,"peak");
+            // Are we only applying non-linear broadening to the peak?
+            if(!_nlBroadband) _snlPerp2 = _snlPar2 = 0;
+            if(smoothChanged) converged &= _runTransform(*_Xinw,"no-wiggles");
+            if(!converged) _warnNotConverged();
+            // Save tables of any new transforms in our cache. Tables are never modified after
+            // they are filled, so an entry can share the no-wiggles tables of the previous entry
+            // when only the non-linear broadening of the peak changed.
+            if(_transformCacheSize > 0 && peakChanged) {
+                _peakTable = _createTable(*_Xipk);
+                if(smoothChanged || !_smoothTable) _smoothTable = _createTable(*_Xinw);
+                _cacheTransforms(key);
             }
         }
     }
 
-    // Lookup BAO peak parameter values.
-    double ampl = getParameterValue(_baoBase);
-    double scale = getParameterValue(_baoBase + 1);
-    double scale_parallel = getParameterValue(_baoBase + 2);
-    double scale_perp = getParameterValue(_baoBase + 3);
-    double gamma_scale = getParameterValue(_baoBase + 4);
-    if(_combinedScale) {
-        double scale_ratio = getParameterValue(_combScaleBase);
-        scale_perp = scale_ratio*scale_parallel;
-    }
+    // Use the BAO peak amplitude saved by _lookupParameters.
+    double ampl(_ampl0);
 
-    // Transform (r,mu) to (rBAO,muBAO) using the scale parameters.
-    double rBAO, muBAO, scalez;
-    if(_anisotropic) {
-        double apar = redshiftEvolution(scale_parallel,gamma_scale,z,_getZRef());
-        double aperp = redshiftEvolution(scale_perp,gamma_scale,z,_getZRef());
-        double musq(mu*mu);
-        scalez = std::sqrt(apar*apar*musq + aperp*aperp*(1-musq));
-        rBAO = r*scalez;
-        muBAO = apar*mu/scalez;
-    }
-    else {
-        scalez = redshiftEvolution(scale,gamma_scale,z,_getZRef());
-        rBAO = r*scalez;
-        muBAO = mu;
-    }
+    // Use the (rBAO,muBAO) coordinates calculated from the scale parameters.
+    double rBAO(scaled.rBAO[i]), muBAO(scaled.muBAO[i]), scalez(scaled.dilation[i]);
 
     // Check dilation limits.
     if(scalez < _dilmin) {
@@ -428,11 +1094,12 @@ bool anyChanged, int index) const {
 
     // Calculate the cosmological predictions.
     // the peak model is always evaluated at (rBAO,muBAO)
-    double peak = _Xipk->getCorrelation(rBAO,muBAO);
+    double peak = _getPeakCorrelation(rBAO,muBAO);
     // the decoupled option determines where we evaluate the smooth model
-    double smooth = (_decoupled) ? _Xinw->getCorrelation(r,mu) : _Xinw->getCorrelation(rBAO,muBAO);
+    double smooth = (_decoupled) ? _getSmoothCorrelation(r,mu) : _getSmoothCorrelation(rBAO,muBAO);
     // Combine the pieces with the appropriate normalization factors
     double xi = biasSqz*(ampl*peak + smooth);
+    _lastTerms.peak = biasSqz*peak;
     
     // Add r-space metal correlations, if any.
     if(_metalCorr) xi += _metalCorr->_evaluate(r,mu,z,anyChanged,index);
@@ -458,37 +1125,30 @@ bool anyChanged, int index) const {
     if(_distMat && index>=0) {
         int nbins = _distMatrixOrder;
         if(anyChanged || zChanged) {
+            _scaleCoordinates(_getGridCoordinates(),_gridScaled);
             // Calculate the undistorted correlation function for every bin.
             for(int bin = 0; bin < nbins; ++bin) {
-                double rbin = _getRBin(bin);
-                double mubin = _getMuBin(bin);
-                double zbin = _getZBin(bin);
+                double rbin = _gridScaled.coords.r[bin];
+                double mubin = _gridScaled.coords.mu[bin];
+                double zbin = _gridScaled.coords.z[bin];
                 if(rbin < _rmin || rbin > _rmax) {
                     _distMat->setCorrelation(bin,0);
                     continue;
                 }
-                biasSqz = redshiftEvolution(biasSq,gammaBias,zbin,_getZRef());
-                // Transform (rbin,mubin) to (rBAO,muBAO) using the scale parameters.
-                if(_anisotropic) {
-                    double apar = redshiftEvolution(scale_parallel,gamma_scale,zbin,_getZRef());
-                    double aperp = redshiftEvolution(scale_perp,gamma_scale,zbin,_getZRef());
-                    double musq(mubin*mubin);
-                    scalez = std::sqrt(apar*apar*musq + aperp*aperp*(1-musq));
-                    rBAO = rbin*scalez;
-                    muBAO = apar*mubin/scalez;
-                }
-                else {
-                    scalez = redshiftEvolution(scale,gamma_scale,zbin,_getZRef());
-                    rBAO = rbin*scalez;
-                    muBAO = mubin;
-                }
+                double biasEvolution = _gridScaled.biasEvolution[bin];
+                biasSqz = biasSq*biasEvolution;
+                // Use the (rBAO,muBAO) coordinates of this bin.
+                rBAO = _gridScaled.rBAO[bin];
+                muBAO = _gridScaled.muBAO[bin];
                 if(rBAO < _rmin || rBAO > _rmax) {
                     _distMat->setCorrelation(bin,0);
                     continue;
                 }
                 // Calculate the cosmological predictions.
-                peak = _Xipk->getCorrelation(rBAO,muBAO);
-                smooth = (_decoupled) ? _Xinw->getCorrelation(rbin,mubin) : _Xinw->getCorrelation(rBAO,muBAO);
+                if(_zNodeTransforms) _selectTransformNodes(zbin);
+                if(_rsdDecomposition) _setRsdCoefficients(_gridScaled.betaEvolution[bin]);
+                peak = _getPeakCorrelation(rBAO,muBAO);
+                smooth = (_decoupled) ? _getSmoothCorrelation(rbin,mubin) : _getSmoothCorrelation(rBAO,muBAO);
                 double xiu = biasSqz*(ampl*peak + smooth);
                 // Add r-space metal correlations, if any.
                 if(_metalCorr) xiu += _metalCorr->_evaluate(rbin,mubin,zbin,anyChanged,bin);
@@ -513,25 +1173,30 @@ bool anyChanged, int index) const {
                 if(_distMatDistortAdd) {
                     double distortion = _distMatDistortAdd->_evaluate(rbin,mubin,zbin,anyChanged,bin);
                     // The additive distortion is multiplied by ((1+z)/(1+z0))^gammaBias.
-                    xiu += redshiftEvolution(distortion,gammaBias,zbin,_getZRef());
+                    xiu += distortion*biasEvolution;
                 }
                 // Save the (undistorted) correlation function.
                 _distMat->setCorrelation(bin,xiu);
             }
+            // Multiply the (undistorted) correlation function by the distortion matrix.
+            _distMat->applyDistortion();
         }
-        // Multiply the (undistorted) correlation function by the distortion matrix.
-        xi = 0;
-        for(int bin = 0; bin < nbins; ++bin) {
-            xi += _distMat->getDistortion(index,bin)*_distMat->getCorrelation(bin);
-        }
+        // Lookup the distorted correlation function for this bin.
+        xi = _distMat->getDistortedCorrelation(index);
     }
     
     // Add r-space broadband distortions, if any.
-    if(_distortMul) xi *= 1 + _distortMul->_evaluate(r,mu,z,anyChanged,index);
+    _lastTerms.preMul = xi;
+    _lastTerms.mul = 1;
+    if(_distortMul) {
+        _lastTerms.mul = 1 + _distortMul->_evaluate(r,mu,z,anyChanged,index);
+        xi *= _lastTerms.mul;
+    }
     if(_distortAdd) {
         double distortion = _distortAdd->_evaluate(r,mu,z,anyChanged,index);
         // The additive distortion is multiplied by ((1+z)/(1+z0))^gammaBias
-        xi += redshiftEvolution(distortion,gammaBias,z,_getZRef());
+        _lastTerms.addEvol = scaled.biasEvolution[i];
+        xi += distortion*_lastTerms.addEvol;
     }
 
     return xi;
@@ -555,4 +1220,5 @@ void  local::BaoKSpaceCorrelationModel::printToStream(std::ostream &out, std::st
     out << "Lorentzian smoothing is switched " << (_smoothLorentz ? "on." : "off.") << std::endl;
     out << "Distortion matrix is switched " << (_distMat ? "on." : "off.") << std::endl;
     out << "Metal correlations are switched " << (_metalCorr ? "on." : "off.") << std::endl;
+    out << "k-space transform emulator is switched " << (_emulatorIndex.empty() ? "off." : "on.") << std::endl;
 }
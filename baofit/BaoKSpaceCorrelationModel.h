@@ -8,7 +8,10 @@
 
 #include "cosmo/types.h"
 
+#include <list>
+#include <map>
 #include <string>
+#include <vector>
 
 namespace baofit {
 	// Represents a two-point correlation model derived from tabulated power spectra (with and
@@ -25,6 +28,28 @@ namespace baofit {
         // multipole expansion up to ellMax. The input tabulated power spectra specified by
         // the model names provided are assumed to be normalized for redshift zref and will
         // be re-normalized appropriately when the model is evaluated at any different z.
+        // If transformCacheSize > 0, the transformed tables for up to this many distinct
+        // combinations of the parameters that determine D(k,mu_k) are kept, and re-used
+        // without repeating the transforms whenever one of these combinations is revisited.
+        // The least recently used combination is discarded when the cache is full. If
+        // zNodeTransforms is set, transformed tables are kept for each redshift node, where
+        // nodes are created as needed so that every evaluated redshift is within dzmin of a
+        // node, and the transforms at a node are only repeated after a change to the parameters
+        // they depend on. If zNodeInterpolate is set, nodes are spaced by dzmin starting from
+        // zref instead, and the tables are interpolated linearly in z between nodes. If
+        // rsdDecomposition is set, the linear bias factor of D(k,mu_k) is expanded in powers
+        // of beta (and beta2), which are independent of z, and the term multiplying each power is
+        // transformed separately. The transforms are then combined for any values of beta, beta2
+        // and gamma-beta, so only changes to the other parameters of D(k,mu_k) require new
+        // transforms. This option cannot be combined with the transform cache or redshift nodes.
+        // If emulatorGrid is not empty, it specifies a grid of values for some of the other
+        // parameters of D(k,mu_k) as a semicolon-separated list of name=binning, e.g.
+        // "SigmaNL-perp={2:5}*7;1+f={1.5:2.5}*5". The RSD components are then transformed once
+        // at each grid point and interpolated multilinearly between grid points, instead of being
+        // transformed again when these parameters change, and any other parameters of D(k,mu_k)
+        // must remain fixed. If emulatorFile is not empty, the transformed grid is read from this
+        // file when it was created with the same models, precision settings and grid, and is
+        // otherwise saved to this file after it has been transformed.
 		BaoKSpaceCorrelationModel(std::string const &modelrootName,
 		    std::string const &fiducialName, std::string const &nowigglesName,
 		    std::string const &distMatrixName, std::string const &metalModelName,
@@ -33,6 +58,8 @@ namespace baofit {
             std::string const &distAdd, std::string const &distMul, double distR0,
             double zeff, double sigma8, double dzmin, int distMatrixOrder,
             std::string const &distMatrixDistAdd, std::string const &distMatrixDistMul,
+            int transformCacheSize, bool zNodeTransforms, bool zNodeInterpolate, bool rsdDecomposition,
+            std::string const &emulatorGrid, std::string const &emulatorFile,
             bool anisotropic = false, bool decoupled = false, bool nlBroadband = false,
             bool nlCorrection = false, bool fitNLCorrection = false, bool nlCorrectionAlt = false,
             bool binSmooth = false, bool binSmoothAlt = false, bool hcdModel = false,
@@ -44,11 +71,29 @@ namespace baofit {
 		virtual ~BaoKSpaceCorrelationModel();
         // Prints a multi-line description of this object to the specified output stream.
         virtual void printToStream(std::ostream &out, std::string const &formatSpec = "%12.6f") const;
+        // Reads or transforms the tables of our emulator grid now, if we have an emulator grid and
+        // have not already done this, using the configured values of the other parameters of D(k,mu_k).
+        void buildEmulator();
+        // Uses the emulator tables of another model, building them first if necessary, instead of
+        // building our own. The other model must have the same settings, emulator grid and configured
+        // values of the other parameters of D(k,mu_k). Since the tables are never modified once built,
+        // models evaluated in different threads can share them.
+        void shareEmulator(BaoKSpaceCorrelationModel const &other);
+        // Checks that the parameters of D(k,mu_k) that are not on our emulator grid are fixed at
+        // the values our emulator tables assume, and that the grid parameters start on the grid.
+        virtual void checkFitParameters(likely::FitParameters const &params) const;
 	protected:
 		// Returns the correlation function evaluated in redshift space where (r,mu) is
 		// the pair separation and z is their average redshift. The separation r should
 		// be provided in Mpc/h.
         virtual double _evaluate(double r, double mu, double z, bool anyChanged, int index) const;
+        // Fills the vector provided with the correlation function evaluated at each of the
+        // specified coordinates.
+        virtual void _evaluateAll(Coordinates const &coords, bool anyChanged, std::vector<double> &out) const;
+        // Provides analytic derivatives with respect to the broadband distortion coefficients and,
+        // without a distortion matrix, the BAO amplitude and metal biases.
+        virtual void _evaluateAllJacobian(Coordinates const &coords, std::vector<int> const &indices,
+            std::vector<double> &jacobian, std::vector<bool> &analytic) const;
         virtual double _evaluateKSpace(double k, double mu_k, double pk, double z) const;
         virtual int _getIndexBase() const;
 	private:
@@ -61,13 +106,137 @@ namespace baofit {
             _smoothGauss, _smoothLorentz, _combinedBias, _combinedScale, _crossCorrelation, _verbose,
             _useZeff;
         int _indexBase, _nlBase, _nlcorrBase, _baoBase, _bsBase, _hcdBase, _uvBase, _radBase,
-            _smgausBase, _smlorBase, _combBiasBase, _combScaleBase, _maxWarnings, _distMatrixOrder;
+            _smgausBase, _smlorBase, _combBiasBase, _combScaleBase, _maxWarnings, _distMatrixOrder,
+            _nr, _ellMax, _transformCacheSize;
         mutable int _nWarnings;
         cosmo::DistortedPowerCorrelationPtr _Xipk, _Xinw;
-        // Evaluates our k-space distortion model D(k,mu_k) using our current parameter values.
+        // Tables of the peak and no-wiggles transforms for our current parameter values, when
+        // the transform cache or redshift nodes are enabled.
+        mutable TransformTablePtr _peakTable, _smoothTable;
+        // Transform cache entries in order of most to least recently used.
+        struct CachedTransform {
+            std::vector<double> key;
+            TransformTablePtr peak, smooth;
+        };
+        mutable std::list<CachedTransform> _transformCache;
+        mutable long _transformCacheHits, _transformCacheMisses;
+        // Fills the vector provided with the current values that determine D(k,mu_k).
+        void _getTransformKey(std::vector<double> &key) const;
+        // Looks up the specified key in our transform cache and selects its tables if found.
+        // Returns true if the key was found.
+        bool _findCachedTransforms(std::vector<double> const &key) const;
+        // Adds our current tables to the front of our transform cache using the specified key,
+        // discarding the least recently used entry if necessary.
+        void _cacheTransforms(std::vector<double> const &key) const;
+        // Returns a new table filled from the specified transform.
+        TransformTablePtr _createTable(cosmo::DistortedPowerCorrelation const &transform) const;
+        // Determines whether any parameter changes require the peak and no-wiggles transforms
+        // to be repeated, optionally ignoring changes to the parameters that determine beta and beta2.
+        void _getTransformChanges(bool &peakChanged, bool &smoothChanged, bool includeRsd = true) const;
+        // Repeats the specified transform, or initializes it the first time, and returns false
+        // if it did not converge.
+        bool _runTransform(cosmo::DistortedPowerCorrelation &transform, std::string const &name) const;
+        // Prints a warning about transforms that did not converge, up to a maximum number of times.
+        void _warnNotConverged() const;
+        // Transformed tables at one redshift node, when zNodeTransforms is set.
+        struct TransformNode {
+            double z;
+            TransformTablePtr peak, smooth;
+            bool peakValid, smoothValid;
+        };
+        mutable std::vector<TransformNode> _zNodes;
+        bool _zNodeTransforms, _zNodeInterpolate;
+        // Tables at the node above and the weight given to them, when interpolating in z.
+        mutable TransformTablePtr _peakTableHi, _smoothTableHi;
+        mutable double _zWeight;
+        // Returns the index of the node at exactly z, creating it if necessary.
+        int _getTransformNode(double z) const;
+        // Selects the tables to use at redshift z, updating the nodes they come from if necessary.
+        void _selectTransformNodes(double z) const;
+        // Repeats any transforms of the specified node that are not valid for our current parameter values.
+        void _updateTransformNode(TransformNode &node) const;
+        // Tables of each RSD component of the peak and no-wiggles transforms, and the coefficients
+        // used to combine them, when rsdDecomposition is set.
+        bool _rsdDecomposition;
+        mutable int _rsdComponent;
+        mutable std::vector<TransformTablePtr> _peakComponents, _smoothComponents;
+        mutable std::vector<double> _rsdCoefs;
+        // Transforms each RSD component using the specified transform and fills the tables provided.
+        void _transformRsdComponents(cosmo::DistortedPowerCorrelation &transform, std::string const &name,
+            std::vector<TransformTablePtr> &tables) const;
+        // Sets the coefficients of each RSD component using the redshift evolution factor
+        // ((1+z)/(1+zref))^gamma-beta at the redshift being evaluated.
+        void _setRsdCoefficients(double betaEvolution) const;
+        // Returns the combination of the specified RSD component tables at (r,mu).
+        double _sumRsdComponents(std::vector<TransformTablePtr> const &tables, double r, double mu) const;
+        // Emulator of the RSD component tables on a grid of parameter values, when an emulator
+        // grid is specified. Tables are stored as [grid point][peak,no-wiggles][RSD component]
+        // with the last grid axis varying fastest.
+        std::string _emulatorFile, _emulatorKey;
+        std::vector<int> _emulatorIndex;
+        std::vector<std::vector<double> > _emulatorNodes;
+        mutable std::vector<TransformTablePtr> _emulatorTables;
+        // Indices and configured values of the other parameters of D(k,mu_k), which our tables
+        // assume, and the key identifying our tables, when they have been built.
+        mutable std::vector<int> _emulatorFixedIndex;
+        mutable std::vector<double> _emulatorFixedValue;
+        mutable std::string _emulatorTablesKey;
+        // Records the configured values of the other parameters of D(k,mu_k) and returns the
+        // key that identifies the emulator tables for these values.
+        std::string _getEmulatorTablesKey() const;
+        // Parameter values used instead of our current values while building the emulator.
+        mutable std::map<int,double> _parameterOverrides;
+        // Fills the vector provided with the indices of the parameters that D(k,mu_k) depends on,
+        // apart from those that determine beta and beta2.
+        void _getDistortionParameterIndices(std::vector<int> &indices) const;
+        // Returns the value of the specified parameter of D(k,mu_k), including any override.
+        double _getDistortionParameter(int index) const;
+        // Reads or transforms the tables of our emulator grid, and saves them if necessary.
+        void _buildEmulator() const;
+        // Reads the tables of our emulator grid from our emulator file and returns true, or
+        // returns false if the file does not exist or was created with a different key.
+        bool _readEmulator(std::string const &key) const;
+        // Saves the tables of our emulator grid to our emulator file using the specified key.
+        void _writeEmulator(std::string const &key) const;
+        // Interpolates the RSD component tables for our current parameter values.
+        void _interpolateEmulator() const;
+        // Returns the peak and no-wiggles correlation functions for our current parameter values.
+        double _getPeakCorrelation(double r, double mu) const;
+        double _getSmoothCorrelation(double r, double mu) const;
+        // Looks up the parameter values that do not depend on the coordinates being evaluated.
+        void _lookupParameters() const;
+        // Evaluates the correlation function at coordinate i of scaled using the parameter values
+        // saved by the most recent call to _lookupParameters().
+        double _evaluateBin(ScaledCoordinates const &scaled, int i, bool anyChanged) const;
+        // Updates the cached values in scaled for the specified coordinates, using the parameter
+        // values saved by the most recent call to _lookupParameters().
+        void _scaleCoordinates(Coordinates const &coords, ScaledCoordinates &scaled) const;
+        // A single coordinate evaluated by _evaluate, and cached values for it, the coordinates of
+        // _evaluateAll and the distortion matrix grid.
+        mutable Coordinates _point;
+        mutable ScaledCoordinates _pointScaled, _scaled, _gridScaled;
+        // Parameter values saved by _lookupParameters. A trailing 0 indicates that values have
+        // not been evolved to the redshift being evaluated.
+        mutable double _beta0, _beta20, _biasSq0, _gammaBias0, _gammaBeta0, _snlPerp0, _snlPar0,
+            _ampl0, _scale0, _scaleParallel0, _scalePerp0, _gammaScale0;
+        // Evaluates our k-space distortion model D(k,mu_k) using our current parameter values, or
+        // only the term of its RSD expansion selected by _rsdComponent if this is >= 0.
         double _evaluateKSpaceDistortion(double k, double mu_k, double pk) const;
         // Parameters initialized in _evaluate that are needed by _evaluateKSpaceDistortion
         mutable double _betaz, _beta2z, _snlPar2, _snlPerp2, _zeff, _zLast;
+        // Intermediate results of _evaluateBin that are used to calculate analytic derivatives.
+        struct BinTerms {
+            // The BAO peak term that multiplies the amplitude, including its bias normalization.
+            double peak;
+            // The prediction before any r-space broadband distortions.
+            double preMul;
+            // The multiplicative broadband factor and the redshift evolution of the additive broadband.
+            double mul, addEvol;
+        };
+        // Terms for the most recent call to _evaluateBin and for each coordinate of the most
+        // recent call to _evaluateAll.
+        mutable BinTerms _lastTerms;
+        mutable std::vector<BinTerms> _binTerms;
 	}; // BaoKSpaceCorrelationModel
 } // baofit
 
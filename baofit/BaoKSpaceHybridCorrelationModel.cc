@@ -156,46 +156,97 @@ double local::BaoKSpaceHybridCorrelationModel::_evaluateKSpaceDistortion(double
     return contdistortion*nonlinear*nonlinearcorr*linear;
 }
 
-double local::BaoKSpaceHybridCorrelationModel::_evaluate(double r, double mu, double z,
-bool anyChanged, int index) const {
-
+void local::BaoKSpaceHybridCorrelationModel::_lookupParameters() const {
     // Lookup linear bias parameters.
-    double beta = getParameterValue(0);
+    _beta0 = getParameterValue(0);
     double bb = getParameterValue(1);
     // Calculate bias^2 from beta and bb.
-    double bias = bb/(1+beta);
+    double bias = bb/(1+_beta0);
     // Get linear bias parameters of other tracer (if we are modeling a cross correlation)
     // and calculate the combined bias^2 at zref.
-    double beta2,biasSq;
     if(_crossCorrelation) {
         double bias2 = getParameterValue(5);
         double beta2bias2 = getParameterValue(6);
-        beta2 = beta2bias2/bias2;
-        biasSq = bias*bias2;
+        _beta20 = beta2bias2/bias2;
+        _biasSq0 = bias*bias2;
     }
     else {
-        biasSq = bias*bias;
+        _biasSq0 = bias*bias;
     }
 
     // Lookup linear bias redshift evolution parameters.
-    double gammaBias = getParameterValue(2);
-    double gammaBeta = getParameterValue(3);
+    _gammaBias0 = getParameterValue(2);
+    _gammaBeta0 = getParameterValue(3);
+
+    // Lookup non-linear broadening parameters.
+    _snlPerp0 = getParameterValue(_nlBase);
+    _snlPar0 = _snlPerp0*getParameterValue(_nlBase+1);
+
+    // Lookup BAO peak parameter values.
+    _ampl0 = getParameterValue(_baoBase);
+    _scale0 = getParameterValue(_baoBase+1);
+    _scaleParallel0 = getParameterValue(_baoBase+2);
+    _scalePerp0 = getParameterValue(_baoBase+3);
+    _gammaScale0 = getParameterValue(_baoBase+4);
+}
+
+double local::BaoKSpaceHybridCorrelationModel::_evaluate(double r, double mu, double z,
+bool anyChanged, int index) const {
+    _lookupParameters();
+    _point.r.assign(1,r);
+    _point.mu.assign(1,mu);
+    _point.z.assign(1,z);
+    _point.index.assign(1,index);
+    _scaleCoordinates(_point,_pointScaled);
+    return _evaluateBin(_pointScaled,0,anyChanged);
+}
+
+void local::BaoKSpaceHybridCorrelationModel::_scaleCoordinates(Coordinates const &coords,
+ScaledCoordinates &scaled) const {
+    Coordinates const *effective = &coords;
     // Calculate effective redshift for each (r,mu) bin if requested
     if(_zcorr0>0) {
-        double rpar = std::fabs(r*mu)/100.;
-        z = _zcorr0 + _zcorr1*rpar + _zcorr2*rpar*rpar;
+        _zcorrCoords = coords;
+        for(int i = 0; i < coords.r.size(); ++i) {
+            double rpar = std::fabs(coords.r[i]*coords.mu[i])/100.;
+            _zcorrCoords.z[i] = _zcorr0 + _zcorr1*rpar + _zcorr2*rpar*rpar;
+        }
+        effective = &_zcorrCoords;
     }
+    _updateScaledCoordinates(*effective,_gammaBias0,_gammaBeta0,_anisotropic,_scale0,_scaleParallel0,
+        _scalePerp0,_gammaScale0,scaled);
+}
+
+void local::BaoKSpaceHybridCorrelationModel::_evaluateAll(Coordinates const &coords, bool anyChanged,
+std::vector<double> &out) const {
+    _lookupParameters();
+    _scaleCoordinates(coords,_scaled);
+    for(int i = 0; i < out.size(); ++i) {
+        out[i] = _evaluateBin(_scaled,i,anyChanged);
+        // Only the first coordinate sees any parameter changes.
+        anyChanged = false;
+    }
+}
+
+double local::BaoKSpaceHybridCorrelationModel::_evaluateBin(ScaledCoordinates const &scaled, int i,
+bool anyChanged) const {
+
+    // The redshift includes any effective redshift correction applied by _scaleCoordinates.
+    double r(scaled.coords.r[i]), mu(scaled.coords.mu[i]), z(scaled.coords.z[i]);
+    int index((*scaled.index)[i]);
+
+    // Use the linear bias parameter values saved by _lookupParameters.
+    double beta(_beta0), beta2(_beta20), biasSq(_biasSq0);
+
     _zeff = z;
     // Apply redshift evolution
-    biasSq = redshiftEvolution(biasSq,gammaBias,z,_getZRef());
-    _betaz = redshiftEvolution(beta,gammaBeta,z,_getZRef());
-    if(_crossCorrelation) _beta2z = redshiftEvolution(beta2,gammaBeta,z,_getZRef());
+    biasSq *= scaled.biasEvolution[i];
+    _betaz = beta*scaled.betaEvolution[i];
+    if(_crossCorrelation) _beta2z = beta2*scaled.betaEvolution[i];
 
-    // Lookup non-linear broadening parameters.
-    double snlPerp = getParameterValue(_nlBase);
-    double snlPar = snlPerp*getParameterValue(_nlBase+1);
-    _snlPerp2 = snlPerp*snlPerp;
-    _snlPar2 = snlPar*snlPar;
+    // Set non-linear broadening parameters.
+    _snlPerp2 = _snlPerp0*_snlPerp0;
+    _snlPar2 = _snlPar0*_snlPar0;
 
     // Redo the hybrid transformation from k-space to r-space if necessary
     if(anyChanged) {
@@ -217,28 +268,11 @@ bool anyChanged, int index) const {
         }
     }
 
-    // Lookup BAO peak parameter values.
-    double ampl = getParameterValue(_baoBase);
-    double scale = getParameterValue(_baoBase+1);
-    double scale_parallel = getParameterValue(_baoBase+2);
-    double scale_perp = getParameterValue(_baoBase+3);
-    double gamma_scale = getParameterValue(_baoBase+4);
-
-    // Transform (r,mu) to (rBAO,muBAO) using the scale parameters.
-    double rBAO, muBAO;
-    if(_anisotropic) {
-        double apar = redshiftEvolution(scale_parallel,gamma_scale,z,_getZRef());
-        double aperp = redshiftEvolution(scale_perp,gamma_scale,z,_getZRef());
-        double musq(mu*mu);
-        scale = std::sqrt(apar*apar*musq + aperp*aperp*(1-musq));
-        rBAO = r*scale;
-        muBAO = apar*mu/scale;
-    }
-    else {
-        scale = redshiftEvolution(scale,gamma_scale,z,_getZRef());
-        rBAO = r*scale;
-        muBAO = mu;
-    }
+    // Use the BAO peak amplitude saved by _lookupParameters.
+    double ampl(_ampl0);
+
+    // Use the (rBAO,muBAO) coordinates calculated from the scale parameters.
+    double rBAO(scaled.rBAO[i]), muBAO(scaled.muBAO[i]), scale(scaled.dilation[i]);
 
     // Check dilation limit
     if(scale > _dilmax) {
@@ -259,7 +293,7 @@ bool anyChanged, int index) const {
     if(_distortAdd) {
         double distortion = _distortAdd->_evaluate(r,mu,z,anyChanged,index);
         // The additive distortion is multiplied by ((1+z)/(1+z0))^gammaBias
-        xi += redshiftEvolution(distortion,gammaBias,z,_getZRef());
+        xi += distortion*scaled.biasEvolution[i];
     }
 
     return xi;
@@ -9,6 +9,7 @@
 #include "cosmo/types.h"
 
 #include <string>
+#include <vector>
 
 namespace baofit {
 	// Represents a two-point correlation model derived from tabulated power spectra (with and
@@ -41,6 +42,9 @@ namespace baofit {
 		// the pair separation and z is their average redshift. The separation r should
 		// be provided in Mpc/h.
         virtual double _evaluate(double r, double mu, double z, bool anyChanged, int index) const;
+        // Fills the vector provided with the correlation function evaluated at each of the
+        // specified coordinates.
+        virtual void _evaluateAll(Coordinates const &coords, bool anyChanged, std::vector<double> &out) const;
         virtual double _evaluateKSpace(double k, double mu_k, double pk, double z) const;
         virtual int _getIndexBase() const;
 	private:
@@ -50,6 +54,23 @@ namespace baofit {
             _distortionAlt, _noDistortion, _crossCorrelation, _verbose;
         int _indexBase, _nlBase, _contBase, _nlcorrBase, _baoBase;
         cosmo::DistortedPowerCorrelationHybridPtr _Xipk, _Xinw;
+        // Looks up the parameter values that do not depend on the coordinates being evaluated.
+        void _lookupParameters() const;
+        // Evaluates the correlation function at coordinate i of scaled using the parameter values
+        // saved by the most recent call to _lookupParameters().
+        double _evaluateBin(ScaledCoordinates const &scaled, int i, bool anyChanged) const;
+        // Updates the cached values in scaled for the specified coordinates, after applying any
+        // effective redshift correction, using the parameter values saved by the most recent call
+        // to _lookupParameters().
+        void _scaleCoordinates(Coordinates const &coords, ScaledCoordinates &scaled) const;
+        // A single coordinate evaluated by _evaluate, a copy of the coordinates being evaluated with
+        // effective redshifts, and cached values for a single coordinate and those of _evaluateAll.
+        mutable Coordinates _point, _zcorrCoords;
+        mutable ScaledCoordinates _pointScaled, _scaled;
+        // Parameter values saved by _lookupParameters. A trailing 0 indicates that values have
+        // not been evolved to the redshift being evaluated.
+        mutable double _beta0, _beta20, _biasSq0, _gammaBias0, _gammaBeta0, _snlPerp0, _snlPar0,
+            _ampl0, _scale0, _scaleParallel0, _scalePerp0, _gammaScale0;
         // Evaluates our k-space distortion model D(k,mu_k) using our current parameter values.
         double _evaluateKSpaceDistortion(double k, double mu_k, double pk) const;
         // Parameters initialized in _evaluate that are needed by _evaluateKSpaceDistortion
@@ -11,6 +11,9 @@
 #include "boost/spirit/include/phoenix_stl.hpp"
 #include "boost/format.hpp"
 
+#include <algorithm>
+#include <cmath>
+
 namespace local = baofit;
 namespace qi = boost::spirit::qi;
 namespace phoenix = boost::phoenix;
@@ -147,6 +150,7 @@ std::string const &paramSpec, double r0, double z0, AbsCorrelationModel *base)
     // Define our parameters.
     bool first(true);
     double perr(1e-3);
+    _nterms = 0;
     boost::format pname("%s z%d mu%d r%+d rP%d rT%d");
     for(int zIndex = _zIndexMin; zIndex <= _zIndexMax; zIndex += _zIndexStep) {
         for(int muIndex = _muIndexMin; muIndex <= _muIndexMax; muIndex += _muIndexStep) {
@@ -159,6 +163,7 @@ std::string const &paramSpec, double r0, double z0, AbsCorrelationModel *base)
                             _indexBase = index;
                             first = false;
                         }
+                        _nterms++;
                     }
                 }
             }
@@ -195,7 +200,19 @@ double local::legendreP(int ell, double mu) {
 }
 
 double local::BroadbandModel::_evaluate(double r, double mu, double z, bool anyChanged, int index) const {
+    // Look up our coefficients after any parameter changes.
+    if(anyChanged || _coefs.empty()) {
+        _coefs.resize(_nterms);
+        for(int t = 0; t < _nterms; ++t) _coefs[t] = _base.getParameterValue(_indexBase + t);
+    }
+    // Combine our coefficients with the terms they multiply for this bin.
+    double const *terms = _getTerms(r,mu,z,index);
     double xi(0);
+    for(int t = 0; t < _nterms; ++t) xi += _coefs[t]*terms[t];
+    return xi;
+}
+
+void local::BroadbandModel::_evaluateTerms(double r, double mu, double z, double *terms) const {
     double rr = r/_r0;
     double rrP = r*mu/_r0;
     double rrT = r*std::sqrt(1-mu*mu)/_r0;
@@ -211,18 +228,68 @@ double local::BroadbandModel::_evaluate(double r, double mu, double z, bool anyC
                     double rPFactor = std::pow(rPIndex > 0 ? rrP-1 : rrP, rPIndex);
                     for(int rTIndex = _rTIndexMin; rTIndex <= _rTIndexMax; rTIndex += _rTIndexStep) {
                         double rTFactor = std::pow(rTIndex > 0 ? rrT-1 : rrT, rTIndex);
-                        // Look up the coefficient for this combination of
-                        // zIndex,muIndex,rIndex,rPIndex,rTIndex.
-                        double coef = _base.getParameterValue(_indexBase + indexOffset);
-                        indexOffset++;
-                        // Add this term to the result.
-                        xi += coef*rFactor*muFactor*rPFactor*rTFactor*zFactor;
+                        terms[indexOffset++] = rFactor*muFactor*rPFactor*rTFactor*zFactor;
                     }
                 }
             }
         }
     }
-    return xi;
+}
+
+double const *local::BroadbandModel::_getTerms(double r, double mu, double z, int index) const {
+    if(index < 0) {
+        _scratch.resize(_nterms);
+        _evaluateTerms(r,mu,z,&_scratch[0]);
+        return &_scratch[0];
+    }
+    if(index >= _basisRows.size()) {
+        BasisRow empty = { 0, 0, 0, false };
+        _basisRows.resize(index+1,empty);
+        _basis.resize((index+1)*_nterms);
+    }
+    BasisRow &row = _basisRows[index];
+    double *terms = &_basis[index*_nterms];
+    if(!row.valid || row.r != r || row.mu != mu || row.z != z) {
+        _evaluateTerms(r,mu,z,terms);
+        row.r = r;
+        row.mu = mu;
+        row.z = z;
+        row.valid = true;
+    }
+    return terms;
+}
+
+int local::BroadbandModel::getNTerms() const { return _nterms; }
+
+void local::BroadbandModel::getBasisMatrix(Coordinates const &coords, std::vector<double> &basis) const {
+    int n = coords.r.size();
+    basis.resize(n*_nterms);
+    for(int i = 0; i < n; ++i) {
+        double const *terms = _getTerms(coords.r[i],coords.mu[i],coords.z[i],coords.index[i]);
+        std::copy(terms,terms+_nterms,basis.begin()+i*_nterms);
+    }
+}
+
+void local::BroadbandModel::_evaluateAllJacobian(Coordinates const &coords, std::vector<int> const &indices,
+std::vector<double> &jacobian, std::vector<bool> &analytic) const {
+    // Find the requested parameters that are our coefficients.
+    std::vector<int> column(_nterms,-1);
+    bool any(false);
+    for(int k = 0; k < indices.size(); ++k) {
+        int offset = indices[k] - _indexBase;
+        if(offset < 0 || offset >= _nterms) continue;
+        column[offset] = k;
+        analytic[k] = any = true;
+    }
+    if(!any) return;
+    // We are linear in each coefficient, so each derivative is the term it multiplies.
+    int n = coords.r.size();
+    for(int i = 0; i < n; ++i) {
+        double const *terms = _getTerms(coords.r[i],coords.mu[i],coords.z[i],coords.index[i]);
+        for(int t = 0; t < _nterms; ++t) {
+            if(column[t] >= 0) jacobian[column[t]*n+i] = terms[t];
+        }
+    }
 }
 
 double local::BroadbandModel::_evaluate(double r, cosmo::Multipole multipole, double z,
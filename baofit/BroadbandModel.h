@@ -33,6 +33,13 @@ namespace baofit {
 		BroadbandModel(std::string const &name, std::string const &tag, std::string const &paramSpec,
 		    double r0, double z0, AbsCorrelationModel *base = 0);
 		virtual ~BroadbandModel();
+	    // Returns the number of coefficients of this model.
+	    int getNTerms() const;
+	    // Fills the vector provided with the matrix of terms that multiply each coefficient at the
+	    // specified coordinates, stored as basis[i*nterms+t] for coordinate i and coefficient t.
+	    // Since we are linear in our coefficients, this matrix can be used for analytic derivatives
+	    // or to marginalize over our coefficients.
+	    void getBasisMatrix(Coordinates const &coords, std::vector<double> &basis) const;
         // Prints a multi-line description of this object to the specified output stream.
         virtual void printToStream(std::ostream &out, std::string const &formatSpec = "%12.6f") const;
 	protected:
@@ -45,8 +52,19 @@ namespace baofit {
         virtual double _evaluate(double r, cosmo::Multipole multipole, double z, bool anyChanged, int index) const;
         virtual double _evaluateKSpace(double k, double mu_k, double pk, double z) const;
         virtual int _getIndexBase() const;
+        // Provides the analytic derivatives with respect to each of our coefficients.
+        virtual void _evaluateAllJacobian(Coordinates const &coords, std::vector<int> const &indices,
+            std::vector<double> &jacobian, std::vector<bool> &analytic) const;
 	private:
-        int _indexBase;
+        // Fills the array provided, which must have one element per coefficient, with the term
+        // that multiplies each coefficient at (r,mu,z).
+        void _evaluateTerms(double r, double mu, double z, double *terms) const;
+        // Returns the terms that multiply each coefficient at (r,mu,z) for the data bin with the
+        // specified index. Terms are cached in a row of our basis matrix for each data bin, which
+        // is only recalculated when the coordinates of the bin change, e.g. after a velocity shift.
+        // Terms for a negative index are calculated without caching.
+        double const *_getTerms(double r, double mu, double z, int index) const;
+        int _indexBase, _nterms;
         int _rIndexMin,_rIndexMax,_rIndexStep,_rIndexDenom;
         int _muIndexMin,_muIndexMax,_muIndexStep;
         int _rPIndexMin,_rPIndexMax,_rPIndexStep;
@@ -54,6 +72,14 @@ namespace baofit {
         int _zIndexMin,_zIndexMax,_zIndexStep;
         double _r0, _z0;
         AbsCorrelationModel &_base;
+        // Our basis matrix, stored as [data bin index][coefficient], the coordinates used to
+        // calculate each row, our current coefficient values, and terms for a negative index.
+        struct BasisRow {
+            double r, mu, z;
+            bool valid;
+        };
+        mutable std::vector<BasisRow> _basisRows;
+        mutable std::vector<double> _basis, _coefs, _scratch;
 	}; // BroadbandModel
     double legendreP(int ell, double mu);
 } // baofit
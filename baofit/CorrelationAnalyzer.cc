@@ -11,6 +11,7 @@
 #include "likely/CovarianceMatrix.h"
 #include "likely/CovarianceAccumulator.h"
 #include "likely/FitParameterStatistics.h"
+#include "likely/Random.h"
 
 #include "boost/smart_ptr.hpp"
 #include "boost/format.hpp"
@@ -18,19 +19,30 @@
 #include "boost/utility.hpp"
 #include "boost/lexical_cast.hpp"
 #include "boost/math/special_functions/gamma.hpp"
+#include "boost/thread.hpp"
+#include "boost/bind.hpp"
+#include "boost/cstdint.hpp"
 
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <cmath>
+#include <cstdio>
 #include <algorithm>
 #include <iterator>
+#include <deque>
+#include <map>
 
 namespace local = baofit;
 
 local::CorrelationAnalyzer::CorrelationAnalyzer(std::string const &method, double rmin, double rmax,
 int covSampleSize, bool verbose, bool scalarWeights)
 : _method(method), _rmin(rmin), _rmax(rmax), _covSampleSize(covSampleSize),
-_verbose(verbose), _resampler(scalarWeights)
+_verbose(verbose), _streaming(false), _nstreamed(0), _samplingThreads(1), _shardIndex(0),
+_shardCount(1), _randomSeed(0), _resume(false), _profileLinear(false),
+_gradient(false), _gradientThreads(1),
+_coordinatesSet(false),
+_resampler(scalarWeights)
 {
     if(rmin >= rmax) {
         throw RuntimeError("CorrelationAnalyzer: expected rmin < rmax.");
@@ -39,14 +51,94 @@ _verbose(verbose), _resampler(scalarWeights)
 
 local::CorrelationAnalyzer::~CorrelationAnalyzer() { }
 
+void local::CorrelationAnalyzer::setStreaming(bool value) {
+    if(getNData() > 0) {
+        throw RuntimeError("CorrelationAnalyzer::setStreaming: data has already been added.");
+    }
+    if(value && _resampler.usesScalarWeights()) {
+        throw RuntimeError("CorrelationAnalyzer::setStreaming: not supported with scalar weights.");
+    }
+    _streaming = value;
+}
+
+void local::CorrelationAnalyzer::setSamplingThreads(int nthreads, ModelFactory factory) {
+    if(nthreads > 1 && !factory) {
+        throw RuntimeError("CorrelationAnalyzer::setSamplingThreads: need a model factory for nthreads > 1.");
+    }
+    _samplingThreads = std::max(1,nthreads);
+    _modelFactory = factory;
+}
+
+void local::CorrelationAnalyzer::setResume(bool value) { _resume = value; }
+
+void local::CorrelationAnalyzer::setRandomSeed(int seed) { _randomSeed = seed; }
+
+void local::CorrelationAnalyzer::setProfileLinear(bool value) { _profileLinear = value; }
+
+void local::CorrelationAnalyzer::setGradient(bool value, int nthreads, ModelFactory factory) {
+    if(nthreads > 1 && !factory) {
+        throw RuntimeError("CorrelationAnalyzer::setGradient: need a model factory for nthreads > 1.");
+    }
+    _gradient = value;
+    _gradientThreads = std::max(1,nthreads);
+    _gradientFactory = factory;
+    _gradientWorkers.clear();
+}
+
+std::vector<baofit::AbsCorrelationModelPtr> const &local::CorrelationAnalyzer::_getGradientWorkers() const {
+    if(_gradientThreads > 1 && _gradientWorkers.empty()) {
+        for(int t = 0; t < _gradientThreads; ++t) {
+            AbsCorrelationModelPtr model = _gradientFactory();
+            if(_coordinatesSet) _setCoordinates(model);
+            _gradientWorkers.push_back(model);
+        }
+    }
+    return _gradientWorkers;
+}
+
+void local::CorrelationAnalyzer::setShard(int index, int count) {
+    if(count < 1 || index < 0 || index >= count) {
+        throw RuntimeError("CorrelationAnalyzer::setShard: expected 0 <= index < count.");
+    }
+    _shardIndex = index;
+    _shardCount = count;
+}
+
+void local::CorrelationAnalyzer::_requireObservations(std::string const &method) const {
+    if(_streaming) {
+        throw RuntimeError("CorrelationAnalyzer::" + method +
+            ": individual observations are not available in streaming mode.");
+    }
+}
+
 int local::CorrelationAnalyzer::addData(AbsCorrelationDataCPtr data, int reuseCovIndex) {
+    if(_streaming) {
+        if(reuseCovIndex >= 0) {
+            throw RuntimeError("CorrelationAnalyzer::addData: cannot reuse covariance in streaming mode.");
+        }
+        if(0 == _nstreamed) {
+            // Start from a private copy of the first observation.
+            _streamed.reset(dynamic_cast<AbsCorrelationData*>(data->clone()));
+        }
+        else {
+            // Accumulate Cinv.d and Cinv, after which this observation is no longer needed.
+            _streamed->add(*data);
+        }
+        return _nstreamed++;
+    }
     return _resampler.addObservation(
         boost::dynamic_pointer_cast<const likely::BinnedData>(data),reuseCovIndex);
 }
 
 int local::CorrelationAnalyzer::setCoordinates() const {
-    AbsCorrelationDataPtr combined =
-        boost::dynamic_pointer_cast<baofit::AbsCorrelationData>(_resampler.combined());
+    int nbins = _setCoordinates(_model);
+    BOOST_FOREACH(AbsCorrelationModelPtr worker, _gradientWorkers) _setCoordinates(worker);
+    _coordinatesSet = true;
+    return nbins;
+}
+
+int local::CorrelationAnalyzer::_setCoordinates(AbsCorrelationModelPtr model) const {
+    AbsCorrelationDataPtr combined = getCombined(false,false);
     int nbins = combined->getGrid().getNBinsTotal();
     std::vector<double> rbin, mubin, zbin;
     rbin.reserve(nbins);
@@ -57,13 +149,22 @@ int local::CorrelationAnalyzer::setCoordinates() const {
         mubin.push_back(combined->getCosAngle(i));
         zbin.push_back(combined->getRedshift(i));
     }
-    _model->setCoordinates(rbin,mubin,zbin);
+    model->setCoordinates(rbin,mubin,zbin);
     return nbins;
 }
 
 local::AbsCorrelationDataPtr local::CorrelationAnalyzer::getCombined(bool verbose, bool finalized) const {
-    AbsCorrelationDataPtr combined =
-        boost::dynamic_pointer_cast<baofit::AbsCorrelationData>(_resampler.combined());
+    AbsCorrelationDataPtr combined;
+    if(_streaming) {
+        if(0 == _nstreamed) {
+            throw RuntimeError("CorrelationAnalyzer::getCombined: no observations have been added.");
+        }
+        // Return a copy, since the caller might finalize or otherwise modify it.
+        combined.reset(dynamic_cast<AbsCorrelationData*>(_streamed->clone()));
+    }
+    else {
+        combined = boost::dynamic_pointer_cast<baofit::AbsCorrelationData>(_resampler.combined());
+    }
     int nbefore = combined->getNBinsWithData();
     if(finalized) combined->finalize();
     if(verbose && finalized) {
@@ -75,6 +176,7 @@ local::AbsCorrelationDataPtr local::CorrelationAnalyzer::getCombined(bool verbos
 }
 
 void local::CorrelationAnalyzer::compareEach(std::string const &saveName, bool finalized) const {
+    _requireObservations("compareEach");
     if(_resampler.usesScalarWeights()) {
         throw RuntimeError("CorrelationAnalyzer::compareEach: not supported with scalar weights.");
     }
@@ -169,6 +271,8 @@ std::string const &scaleName) const {
 likely::FunctionMinimumPtr local::CorrelationAnalyzer::fitSample(
 AbsCorrelationDataCPtr sample, std::string const &config) const {
     CorrelationFitter fitter(sample,_model,_covSampleSize);
+    fitter.setProfileLinear(_profileLinear);
+    if(_gradient) fitter.setGradient(true,_getGradientWorkers());
     likely::FunctionMinimumPtr fmin = fitter.fit(_method,config);
     if(_verbose) {
         double chisq = 2*fmin->getMinValue();
@@ -206,9 +310,23 @@ AbsCorrelationDataCPtr combined) const {
 }
 
 namespace baofit {
+    // Reseeds the global random generator for the specified sample, so that the random numbers
+    // used for each sample depend only on (seed,index) and not on any previous samples. The
+    // sample seed is derived using the counter-based SplitMix64 generator.
+    void seedSample(int seed, int index) {
+        boost::uint64_t z = ((boost::uint64_t)(boost::uint32_t)seed << 32) | (boost::uint32_t)index;
+        z += 0x9e3779b97f4a7c15ULL;
+        z = (z ^ (z >> 30))*0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27))*0x94d049bb133111ebULL;
+        z ^= (z >> 31);
+        likely::Random::instance()->setSeed((int)(z & 0x7fffffff));
+    }
     class CorrelationAnalyzer::AbsSampler {
     public:
         virtual AbsCorrelationDataCPtr nextSample() = 0;
+        // Advances past the next sample without generating it, if possible. Returns false if
+        // there are no more samples.
+        virtual bool skipSample() { return !!nextSample(); }
     };
     class CorrelationAnalyzer::JackknifeSampler : public CorrelationAnalyzer::AbsSampler {
     public:
@@ -226,19 +344,22 @@ namespace baofit {
     };
     class CorrelationAnalyzer::BootstrapSampler : public CorrelationAnalyzer::AbsSampler {
     public:
-        BootstrapSampler(int trials, int size, bool fix, likely::BinnedDataResampler const &resampler)
-        : _trials(trials), _size(size), _fix(fix), _resampler(resampler), _next(0) { }
+        BootstrapSampler(int trials, int size, bool fix, likely::BinnedDataResampler const &resampler,
+        int seed)
+        : _trials(trials), _size(size), _fix(fix), _resampler(resampler), _next(0), _seed(seed) { }
         virtual AbsCorrelationDataCPtr nextSample() {
             AbsCorrelationDataPtr sample;
             if(++_next <= _trials) {
+                seedSample(_seed,_next-1);
                 sample = boost::dynamic_pointer_cast<baofit::AbsCorrelationData>(
                     _resampler.bootstrap(_size,_fix));
                 sample->finalize();
             }
             return sample;
         }
+        virtual bool skipSample() { return ++_next <= _trials; }
     private:
-        int _trials, _size, _next;
+        int _trials, _size, _next, _seed;
         bool _fix;
         likely::BinnedDataResampler const &_resampler;
     };
@@ -255,6 +376,7 @@ namespace baofit {
             }
             return sample;
         }
+        virtual bool skipSample() { return ++_next <= _resampler.getNObservations(); }
     private:
         int _next;
         likely::BinnedDataResampler const &_resampler;
@@ -262,12 +384,14 @@ namespace baofit {
     class CorrelationAnalyzer::ToyMCSampler : public CorrelationAnalyzer::AbsSampler {
     public:
         ToyMCSampler(int ngen, AbsCorrelationDataPtr prototype, std::vector<double> truth,
-        std::string const &filename)
-        : _remaining(ngen), _prototype(prototype), _truth(truth), _first(true), _filename(filename) { }
+        std::string const &filename, int seed)
+        : _remaining(ngen), _next(0), _seed(seed), _first(true), _filename(filename),
+        _prototype(prototype), _truth(truth) { }
         virtual AbsCorrelationDataCPtr nextSample() {
             AbsCorrelationDataPtr sample;
             if(_remaining-- > 0) {
                 // Generate a noise vector sampling from the prototype's covariance.
+                seedSample(_seed,_next++);
                 _prototype->getCovarianceMatrix()->sample(_noise);
                 // Clone our prototype (which only copies the covariance smart pointer, not
                 // the whole matrix)
@@ -289,8 +413,14 @@ namespace baofit {
             }
             return sample;
         }
+        virtual bool skipSample() {
+            if(_remaining-- <= 0) return false;
+            _next++;
+            _first = false;
+            return true;
+        }
     private:
-        int _remaining;
+        int _remaining, _next, _seed;
         bool _first;
         std::string _filename;
         AbsCorrelationDataPtr _prototype;
@@ -304,6 +434,7 @@ int nsave, double zsave) const {
     if(jackknifeDrop <= 0) {
         throw RuntimeError("CorrelationAnalyzer::doJackknifeAnalysis: expected jackknifeDrop > 0.");
     }
+    _requireObservations("doJackknifeAnalysis");
     if(getNData() <= 1) {
         throw RuntimeError("CorrelationAnalyzer::doJackknifeAnalysis: need > 1 observation.");
     }
@@ -320,16 +451,19 @@ std::string const &refitConfig, std::string const &saveName, int nsave, double z
     if(bootstrapSize < 0) {
         throw RuntimeError("CorrelationAnalyzer::doBootstrapAnalysis: expected bootstrapSize >= 0.");
     }
+    _requireObservations("doBootstrapAnalysis");
     if(getNData() <= 1) {
         throw RuntimeError("CorrelationAnalyzer::doBootstrapAnalysis: need > 1 observation.");
     }
     if(0 == bootstrapSize) bootstrapSize = getNData();
-    CorrelationAnalyzer::BootstrapSampler sampler(bootstrapTrials,bootstrapSize,fixCovariance,_resampler);
+    CorrelationAnalyzer::BootstrapSampler sampler(bootstrapTrials,bootstrapSize,fixCovariance,_resampler,
+        _randomSeed);
     return doSamplingAnalysis(sampler, "Bootstrap", fmin, fmin2, refitConfig, saveName, nsave, zsave);
 }
 
 int local::CorrelationAnalyzer::fitEach(likely::FunctionMinimumPtr fmin, likely::FunctionMinimumPtr fmin2,
 std::string const &refitConfig, std::string const &saveName, int nsave, double zsave) const {
+    _requireObservations("fitEach");
     CorrelationAnalyzer::EachSampler sampler(_resampler);
     return doSamplingAnalysis(sampler, "Individual", fmin, fmin2, refitConfig, saveName, nsave, zsave);    
 }
@@ -368,7 +502,7 @@ std::string const &saveName, int nsave, double zsave) const {
     std::vector<double> truth;
     fitter.getPrediction(pvalues,truth);
     // Build the sampler for this analysis.
-    CorrelationAnalyzer::ToyMCSampler sampler(ngen,prototype,truth,mcSaveFile);
+    CorrelationAnalyzer::ToyMCSampler sampler(ngen,prototype,truth,mcSaveFile,_randomSeed);
     return doSamplingAnalysis(sampler, "MonteCarlo", fmin, fmin2, refitConfig, saveName, nsave, zsave);
 }
 
@@ -376,77 +510,300 @@ namespace baofit {
     // An implementation class to save the results of a sampling analysis in a standard format.
     class SamplingOutput : public boost::noncopyable {
     public:
+        // Opens the specified file and writes its header. If resume is true and the file already
+        // exists with a matching first header line, then its complete sample lines are kept (and
+        // available via getSavedRows) and any new samples are appended.
         SamplingOutput(likely::FunctionMinimumCPtr fmin, likely::FunctionMinimumCPtr fmin2,
-        std::string const &saveName, int nsave, double zsave, CorrelationAnalyzer const &parent)
+        std::string const &saveName, int nsave, double zsave, CorrelationAnalyzer const &parent,
+        bool resume = false)
         : _nsave(nsave), _zsave(zsave), _parent(parent) {
-            if(0 < saveName.length()) {
-                _save.reset(new std::ofstream(saveName.c_str()));
-                // Print a header consisting of the number of parameters, the number of dump points,
-                // and the number of fits (1 = no-refit, 2 = with refit)
-                *_save << fmin->getNParameters() << ' ' << _nsave << ' ' << (fmin2 ? 2:1) << std::endl;
-                // Print the errors in fmin,fmin2.
-                BOOST_FOREACH(double pvalue, fmin->getErrors()) {
-                    *_save << pvalue << ' ';
+            if(0 == saveName.length()) return;
+            // Format our header lines.
+            std::ostringstream header;
+            // Print a header consisting of the number of parameters, the number of dump points,
+            // and the number of fits (1 = no-refit, 2 = with refit)
+            header << fmin->getNParameters() << ' ' << _nsave << ' ' << (fmin2 ? 2:1) << std::endl;
+            std::string firstLine(header.str());
+            // Print the errors in fmin,fmin2.
+            BOOST_FOREACH(double pvalue, fmin->getErrors()) {
+                header << pvalue << ' ';
+            }
+            if(fmin2) {
+                BOOST_FOREACH(double pvalue, fmin2->getErrors()) {
+                    header << pvalue << ' ';
+                }
+            }
+            header << std::endl;
+            // The first line encodes the inputs fmin,fmin2 just like each sample below, for reference.
+            BOOST_FOREACH(double pvalue, fmin->getParameters()) {
+                header << pvalue << ' ';
+            }
+            header << 2*fmin->getMinValue() << ' ';
+            if(fmin2) {
+                BOOST_FOREACH(double pvalue, fmin2->getParameters()) {
+                    header << pvalue << ' ';
                 }
-                if(fmin2) {
-                    BOOST_FOREACH(double pvalue, fmin2->getErrors()) {
-                        *_save << pvalue << ' ';
+                header << 2*fmin2->getMinValue() << ' ';
+            }
+            if(_nsave > 0) {
+                _parent.dumpModel(header,fmin->getFitParameters(),_nsave,_zsave,"",true);
+                if(fmin2) _parent.dumpModel(header,fmin2->getFitParameters(),_nsave,_zsave,"",true);
+            }
+            header << std::endl;
+            // Read any complete sample lines already saved. The header lines of an existing file
+            // are kept since they record the original inputs.
+            std::vector<std::string> headerLines;
+            bool interrupted(false);
+            if(resume) {
+                std::ifstream in(saveName.c_str());
+                std::string line;
+                while(std::getline(in,line)) {
+                    // A final line without a newline was interrupted while being written.
+                    if(in.eof()) {
+                        interrupted = true;
+                        break;
                     }
+                    if(headerLines.size() < 3) headerLines.push_back(line);
+                    else _savedRows.push_back(line);
                 }
-                *_save << std::endl;
-                // The first line encodes the inputs fmin,fmin2 just like each sample below, for reference.
-                BOOST_FOREACH(double pvalue, fmin->getParameters()) {
-                    *_save << pvalue << ' ';
+                if(headerLines.size() > 0 && headerLines[0] + "\n" != firstLine) {
+                    throw RuntimeError("SamplingOutput: cannot resume " + saveName + " with a different header.");
                 }
-                *_save << 2*fmin->getMinValue() << ' ';
-                if(fmin2) {
-                    BOOST_FOREACH(double pvalue, fmin2->getParameters()) {
-                        *_save << pvalue << ' ';
-                    }
-                    *_save << 2*fmin2->getMinValue() << ' ';
+                if(headerLines.size() < 3) {
+                    headerLines.resize(0);
+                    _savedRows.resize(0);
                 }
-                if(_nsave > 0) {
-                    _parent.dumpModel(*_save,fmin->getFitParameters(),_nsave,_zsave,"",true);
-                    if(fmin2) _parent.dumpModel(*_save,fmin2->getFitParameters(),_nsave,_zsave,"",true);
+            }
+            if(headerLines.size() > 0) {
+                // Drop any interrupted last line by rewriting the complete lines via a temporary
+                // file, so that the saved samples survive if we are interrupted again while
+                // rewriting them. New samples are then appended.
+                if(interrupted) {
+                    std::string tmpName = saveName + ".tmp";
+                    std::ofstream tmp(tmpName.c_str());
+                    BOOST_FOREACH(std::string const &line, headerLines) tmp << line << '\n';
+                    BOOST_FOREACH(std::string const &line, _savedRows) tmp << line << '\n';
+                    tmp.close();
+                    if(!tmp) throw RuntimeError("SamplingOutput: error writing " + tmpName);
+                    if(0 != std::rename(tmpName.c_str(),saveName.c_str())) {
+                        throw RuntimeError("SamplingOutput: unable to rename " + tmpName);
+                    }
                 }
-                *_save << std::endl;
-            }            
+                _save.reset(new std::ofstream(saveName.c_str(),std::ios::app));
+            }
+            else {
+                _save.reset(new std::ofstream(saveName.c_str()));
+                *_save << header.str();
+            }
+            _save->flush();
         }
         ~SamplingOutput() {
             if(_save) _save->close();
         }
+        // Returns the complete sample lines that were already saved when resuming, without newlines.
+        std::vector<std::string> const &getSavedRows() const { return _savedRows; }
         void saveSample(likely::FitParameters parameters, double fval,
         likely::FitParameters parameters2 = likely::FitParameters(), double fval2 = 0) {
             if(!_save) return;
+            saveRow(formatSample(parameters,fval,parameters2,fval2));
+        }
+        // Returns the line that saveSample would write, without a newline.
+        std::string formatSample(likely::FitParameters parameters, double fval,
+        likely::FitParameters parameters2 = likely::FitParameters(), double fval2 = 0) const {
+            std::ostringstream row;
             // Save fit parameter values and chisq.
             likely::Parameters pvalues;
             likely::getFitParameterValues(parameters,pvalues);
             BOOST_FOREACH(double pvalue, pvalues) {
-                *_save << pvalue << ' ';
+                row << pvalue << ' ';
             }
             // Factor of 2 converts -logL to chiSquare.
-            *_save << 2*fval << ' ';
+            row << 2*fval << ' ';
             // Save alternate fit parameter values and chisq, if any.
             if(parameters2.size() > 0) {
                 likely::getFitParameterValues(parameters2,pvalues);
                 BOOST_FOREACH(double pvalue, pvalues) {
-                    *_save << pvalue << ' ';
+                    row << pvalue << ' ';
                 }
-                *_save << 2*fval2 << ' ';
+                row << 2*fval2 << ' ';
             }
             // Save best-fit model multipoles, if requested.
             if(_nsave > 0) {
-                _parent.dumpModel(*_save,parameters,_nsave,_zsave,"",true);
-                if(parameters2.size() > 0) _parent.dumpModel(*_save,parameters2,_nsave,_zsave,"",true);
+                _parent.dumpModel(row,parameters,_nsave,_zsave,"",true);
+                if(parameters2.size() > 0) _parent.dumpModel(row,parameters2,_nsave,_zsave,"",true);
             }
-            *_save << std::endl;            
-       }
+            return row.str();
+        }
+        // Writes a line formatted by formatSample, flushing it so that it survives an interrupted job.
+        void saveRow(std::string const &row) {
+            if(!_save) return;
+            *_save << row << std::endl;
+        }
     private:
         int _nsave;
         double _zsave;
         CorrelationAnalyzer const &_parent;
         boost::scoped_ptr<std::ofstream> _save;
+        std::vector<std::string> _savedRows;
     };
+    // Parses the leading parameter values and chi-square of a saved sample line for nfits fits of
+    // npar parameters each, and returns the number of fits that were read. A fit that failed is
+    // saved with a chi-square of zero.
+    int parseSavedSample(std::string const &row, int npar, int nfits, std::vector<likely::Parameters> &values,
+    std::vector<double> &chisq) {
+        std::istringstream in(row);
+        values.resize(nfits);
+        chisq.resize(nfits);
+        for(int fit = 0; fit < nfits; ++fit) {
+            values[fit].resize(npar);
+            for(int k = 0; k < npar; ++k) {
+                if(!(in >> values[fit][k])) return fit;
+            }
+            if(!(in >> chisq[fit])) return fit;
+        }
+        return nfits;
+    }
+}
+
+namespace baofit {
+    // The results of fitting one sample of a sampling analysis.
+    struct SamplingFit {
+        likely::FunctionMinimumPtr fmin, fmin2;
+        bool ok;
+        // Any fit errors, which are printed when this result is merged.
+        std::string errors;
+        // Any error that should abort the analysis.
+        std::string fatal;
+    };
+    // Fits one sample using the specified model, then refits it using refitConfig if refit is
+    // true and the first fit succeeded.
+    void fitSamplingTrial(AbsCorrelationDataCPtr sample, AbsCorrelationModelPtr model,
+    int covSampleSize, bool profileLinear, bool gradient, std::string const &method, bool refit,
+    std::string const &refitConfig, SamplingFit &result) {
+        baofit::CorrelationFitter fitEngine(sample,model,covSampleSize);
+        fitEngine.setProfileLinear(profileLinear);
+        fitEngine.setGradient(gradient);
+        result.ok = false;
+        try {
+            result.fmin = fitEngine.fit(method);
+            result.ok = (result.fmin->getStatus() == likely::FunctionMinimum::OK);
+        }
+        catch(std::runtime_error const &e) {
+            result.errors += std::string("ERROR while fitting:\n  ") + e.what() + "\n";
+            result.ok = false;
+        }
+        // Refit the sample if requested and the first fit succeeded.
+        if(result.ok && refit) {
+            try {
+                result.fmin2 = fitEngine.fit(method,refitConfig);
+                // Did this fit also succeed?
+                if(result.fmin2->getStatus() != likely::FunctionMinimum::OK) result.ok = false;
+            }
+            catch(std::runtime_error const &e) {
+                result.errors += std::string("ERROR while fitting:\n  ") + e.what() + "\n";
+                result.ok = false;
+            }
+        }
+    }
+    // Fits samples on a pool of worker threads, each with its own model, and delivers
+    // the results in the order that the samples were submitted.
+    class SamplingPool : public boost::noncopyable {
+    public:
+        SamplingPool(std::vector<AbsCorrelationModelPtr> const &models, int covSampleSize,
+        bool profileLinear, bool gradient, std::string const &method, bool refit,
+        std::string const &refitConfig)
+        : _covSampleSize(covSampleSize), _profileLinear(profileLinear), _gradient(gradient), _method(method), _refitConfig(refitConfig), _refit(refit),
+        _window(2*models.size()), _submitted(0), _delivered(0), _stopped(false) {
+            BOOST_FOREACH(AbsCorrelationModelPtr model, models) {
+                _workers.create_thread(boost::bind(&SamplingPool::_work,this,model));
+            }
+        }
+        ~SamplingPool() {
+            {
+                boost::mutex::scoped_lock lock(_mutex);
+                _stopped = true;
+            }
+            _changed.notify_all();
+            _workers.join_all();
+        }
+        // Returns true if another sample can be submitted without exceeding our window of
+        // samples that are queued, being fit, or waiting to be delivered.
+        bool hasRoom() const { return _submitted - _delivered < _window; }
+        // Returns true if any submitted samples have not been delivered yet.
+        bool hasPending() const { return _delivered < _submitted; }
+        // Queues the next sample to fit.
+        void submit(AbsCorrelationDataCPtr sample) {
+            // Calculate one chi-square in this thread first, so that any inverse covariance that
+            // is calculated on demand, and possibly shared with other samples, is ready before
+            // a worker uses it.
+            std::vector<double> zero(sample->getNBinsWithData(),0);
+            sample->chiSquare(zero);
+            {
+                boost::mutex::scoped_lock lock(_mutex);
+                _queue.push_back(std::make_pair(_submitted++,sample));
+            }
+            _changed.notify_all();
+        }
+        // Waits for the results of the next sample in submission order.
+        void next(SamplingFit &result) {
+            {
+                boost::mutex::scoped_lock lock(_mutex);
+                std::map<int,SamplingFit>::iterator found;
+                while((found = _done.find(_delivered)) == _done.end()) _changed.wait(lock);
+                result = found->second;
+                _done.erase(found);
+                _delivered++;
+            }
+            if(result.fatal.length() > 0) throw RuntimeError(result.fatal);
+        }
+    private:
+        // Fits queued samples using the specified model until we are stopped.
+        void _work(AbsCorrelationModelPtr model) {
+            while(true) {
+                std::pair<int,AbsCorrelationDataCPtr> job;
+                {
+                    boost::mutex::scoped_lock lock(_mutex);
+                    while(!_stopped && _queue.empty()) _changed.wait(lock);
+                    if(_stopped) return;
+                    job = _queue.front();
+                    _queue.pop_front();
+                }
+                SamplingFit result;
+                try {
+                    fitSamplingTrial(job.second,model,_covSampleSize,_profileLinear,_gradient,_method,
+                        _refit,_refitConfig,result);
+                }
+                catch(std::exception const &e) {
+                    result.ok = false;
+                    result.fatal = e.what();
+                }
+                {
+                    boost::mutex::scoped_lock lock(_mutex);
+                    _done[job.first] = result;
+                }
+                _changed.notify_all();
+            }
+        }
+        int _covSampleSize;
+        bool _profileLinear, _gradient;
+        std::string _method, _refitConfig;
+        bool _refit;
+        int _window, _submitted, _delivered;
+        bool _stopped;
+        std::deque<std::pair<int,AbsCorrelationDataCPtr> > _queue;
+        std::map<int,SamplingFit> _done;
+        boost::mutex _mutex;
+        boost::condition_variable _changed;
+        boost::thread_group _workers;
+    };
+}
+
+bool local::CorrelationAnalyzer::_skipToShard(CorrelationAnalyzer::AbsSampler &sampler, int &seqno) const {
+    while(seqno % _shardCount != _shardIndex) {
+        if(!sampler.skipSample()) return false;
+        seqno++;
+    }
+    return true;
 }
 
 int local::CorrelationAnalyzer::doSamplingAnalysis(CorrelationAnalyzer::AbsSampler &sampler,
@@ -458,7 +815,7 @@ std::string const &refitConfig, std::string const &saveName, int nsave, double z
     if((!fmin2 && 0 < refitConfig.size()) || (!!fmin2 && 0 == refitConfig.size())) {
         throw RuntimeError("CorrelationAnalyzer::doSamplingAnalysis: inconsistent refit parameters.");
     }
-    SamplingOutput output(fmin,fmin2,saveName,nsave,zsave,*this);
+    SamplingOutput output(fmin,fmin2,saveName,nsave,zsave,*this,_resume);
     baofit::AbsCorrelationDataCPtr sample;
     // Make a copy of the initial parameters.
     likely::FitParameters initParams = fmin->getFitParameters();
@@ -470,37 +827,96 @@ std::string const &refitConfig, std::string const &saveName, int nsave, double z
     if(fmin2) {
         refitStats.reset(new likely::FitParameterStatistics(fmin2->getFitParameters()));
     }
+    // Start a pool of worker threads with their own models, if requested.
+    boost::scoped_ptr<SamplingPool> pool;
+    if(_samplingThreads > 1) {
+        std::vector<AbsCorrelationModelPtr> models;
+        for(int k = 0; k < _samplingThreads; ++k) {
+            AbsCorrelationModelPtr model = _modelFactory();
+            if(_coordinatesSet) _setCoordinates(model);
+            models.push_back(model);
+        }
+        pool.reset(new SamplingPool(models,_covSampleSize,_profileLinear,_gradient,_method,
+            !!fmin2,refitConfig));
+        if(_verbose) {
+            std::cout << "Fitting " << method << " samples using " << _samplingThreads
+                << " threads." << std::endl;
+        }
+    }
     int nInvalid(0);
-    // Loop over samples.
     int nsamples(0);
-    // Use double parentheses below to tell clang that the '=' is not a typo.
-    while((sample = sampler.nextSample())) {
-        // Fit the sample.
-        baofit::CorrelationFitter fitEngine(sample,_model,_covSampleSize);
-        likely::FunctionMinimumPtr sampleMin;
-        bool ok(false);
-        try {
-            sampleMin = fitEngine.fit(_method);
-            ok = (sampleMin->getStatus() == likely::FunctionMinimum::OK);
+    // Skip any samples that were already saved, and accumulate their saved fit results.
+    std::vector<likely::Parameters> savedValues;
+    std::vector<double> savedChiSq;
+    std::vector<bool> floating, floating2;
+    BOOST_FOREACH(likely::FitParameter const &param, initParams) floating.push_back(param.isFloating());
+    BOOST_FOREACH(likely::FitParameter const &param, initParams2) floating2.push_back(param.isFloating());
+    // Save the parameter names and floating states of a sharded analysis for baofit-merge.
+    if(_shardCount > 1 && saveName.length() > 0) {
+        std::string paramsName = saveName + ".params";
+        std::ofstream out(paramsName.c_str());
+        for(int k = 0; k < initParams.size(); ++k) {
+            bool floating2 = fmin2 ? initParams2[k].isFloating() : initParams[k].isFloating();
+            out << initParams[k].isFloating() << ' ' << floating2 << ' ' << initParams[k].getName() << std::endl;
         }
-        catch(std::runtime_error const &e) {
-            std::cerr << "ERROR while fitting:\n  " << e.what() << std::endl;
-            ok = false;
+        out.close();
+    }
+    int seqno(0);
+    BOOST_FOREACH(std::string const &row, output.getSavedRows()) {
+        if(!_skipToShard(sampler,seqno) || !sampler.skipSample()) {
+            throw RuntimeError("CorrelationAnalyzer::doSamplingAnalysis: too many saved samples to resume.");
         }
-        // Refit the sample if requested and the first fit succeeded.
-        likely::FunctionMinimumPtr sampleMinRefit;
-        if(ok && fmin2) {
-            try {
-                sampleMinRefit = fitEngine.fit(_method,refitConfig);
-                // Did this fit also succeed?
-                if(sampleMinRefit->getStatus() != likely::FunctionMinimum::OK) ok = false;
-            }
-            catch(std::runtime_error const &e) {
-                std::cerr << "ERROR while fitting:\n  " << e.what() << std::endl;
-                ok = false;
+        seqno++;
+        nsamples++;
+        int nfits(fmin2 ? 2:1);
+        int nread = parseSavedSample(row,initParams.size(),nfits,savedValues,savedChiSq);
+        if(nread < 1 || 0 == savedChiSq[0] || (nfits == 2 && (nread < 2 || 0 == savedChiSq[1]))) {
+            nInvalid++;
+            continue;
+        }
+        likely::Parameters pfloating;
+        for(int k = 0; k < floating.size(); ++k) if(floating[k]) pfloating.push_back(savedValues[0][k]);
+        fitStats->update(pfloating,savedChiSq[0]/2);
+        if(refitStats) {
+            pfloating.resize(0);
+            for(int k = 0; k < floating2.size(); ++k) if(floating2[k]) pfloating.push_back(savedValues[1][k]);
+            refitStats->update(pfloating,savedChiSq[1]/2);
+        }
+    }
+    if(_verbose && nsamples > 0) {
+        std::cout << "Resuming " << method << " analysis after " << nsamples << " saved samples ("
+            << nInvalid << " invalid)" << std::endl;
+    }
+    // Loop over samples.
+    bool moreSamples(true);
+    while(true) {
+        SamplingFit result;
+        if(pool) {
+            // Keep the workers busy with the next samples, generated in order by this thread.
+            while(moreSamples && pool->hasRoom()) {
+                // Use double parentheses below to tell clang that the '=' is not a typo.
+                if(_skipToShard(sampler,seqno) && (sample = sampler.nextSample())) {
+                    pool->submit(sample);
+                    seqno++;
+                }
+                else {
+                    moreSamples = false;
+                }
             }
+            if(!pool->hasPending()) break;
+            // Fetch the fit results for the next sample in order.
+            pool->next(result);
+        }
+        else {
+            if(!_skipToShard(sampler,seqno) || !(sample = sampler.nextSample())) break;
+            seqno++;
+            // Fit the sample.
+            fitSamplingTrial(sample,_model,_covSampleSize,_profileLinear,_gradient,_method,!!fmin2,
+                refitConfig,result);
         }
-        if(ok) {
+        std::cerr << result.errors;
+        likely::FunctionMinimumPtr sampleMin(result.fmin), sampleMinRefit(result.fmin2);
+        if(result.ok) {
             // Accumulate the fit results if the fit was successful.
             bool onlyFloating(true);
             fitStats->update(sampleMin->getParameters(onlyFloating),sampleMin->getMinValue());
@@ -570,35 +986,290 @@ std::string const &saveName, int nsave, double zsave) const {
     paramStats.printToStream(std::cout);
 }
 
+namespace baofit {
+    // The result of fitting one point of a parameter scan.
+    struct ScanResult {
+        // Has this point been fit (or read from a resumed output file)?
+        bool done;
+        // Did the fit succeed? If so, params and fval describe its minimum.
+        bool ok;
+        likely::FitParameters params;
+        double fval;
+        // The line saved for this point.
+        std::string row;
+    };
+    typedef boost::shared_ptr<CorrelationFitter> CorrelationFitterPtr;
+    typedef boost::shared_ptr<const CorrelationFitter> CorrelationFitterCPtr;
+    // The state shared by all threads of a parameter scan.
+    struct ScanState {
+        std::string method;
+        likely::FitParameters initParams;
+        std::vector<std::string> configs;
+        std::vector<ScanResult> results;
+        SamplingOutput *output;
+        boost::mutex mutex;
+    };
+    // Returns a config script that starts each floating parameter at its specified value.
+    std::string warmStartConfig(likely::FitParameters const &params) {
+        std::string config;
+        BOOST_FOREACH(likely::FitParameter const &param, params) {
+            if(!param.isFloating()) continue;
+            config += "value[" + param.getName() + "]=" + boost::lexical_cast<std::string>(param.getValue()) + ";";
+        }
+        return config;
+    }
+    // Fits the scan points path[begin:end] in turn using the specified fitter, and saves each result
+    // as soon as it is available. Each fit starts from the previous successful fit in this range, or
+    // else from the result for the scan point with index start, if this is not negative.
+    void scanStripe(ScanState &state, CorrelationFitterCPtr fitter, std::vector<int> const &path,
+    int begin, int end, int start, bool verbose) {
+        likely::FitParameters previous;
+        if(start >= 0) previous = state.results[start].params;
+        for(int step = begin; step < end; ++step) {
+            int index = path[step];
+            std::string const &gridConfig = state.configs[index];
+            if(verbose) {
+                std::cout << std::endl << "-- Performing scan step " << step+1 << " of " << path.size()
+                    << " using " << gridConfig << std::endl;
+            }
+            // The grid config comes last so that it overrides the warm start of scanned parameters.
+            ScanResult result;
+            result.done = true;
+            std::string error;
+            try {
+                likely::FunctionMinimumPtr gridMin = fitter->fit(state.method,
+                    warmStartConfig(previous) + gridConfig);
+                if(verbose) gridMin->printToStream(std::cout);
+                result.ok = true;
+                result.params = gridMin->getFitParameters();
+                result.fval = gridMin->getMinValue();
+                previous = result.params;
+            }
+            catch(std::runtime_error const &e) {
+                error = e.what();
+                // Use a copy of initial parameters with the config for this step applied.
+                result.ok = false;
+                result.params = state.initParams;
+                likely::modifyFitParameters(result.params,gridConfig);
+                result.fval = 0;
+            }
+            // Save this result now, in case this job is interrupted. Formatting might use the
+            // analyzer's model, so only one thread at a time can do this.
+            boost::mutex::scoped_lock lock(state.mutex);
+            if(error.length() > 0) std::cerr << "ERROR while fitting:\n  " << error << std::endl;
+            result.row = state.output->formatSample(result.params,result.fval);
+            state.output->saveRow(result.row);
+            state.results[index] = result;
+        }
+    }
+    // Fits the scan points along the specified path, split into contiguous stripes that
+    // are fit in parallel when more than one fitter is provided.
+    void fitScanPath(ScanState &state, std::vector<CorrelationFitterCPtr> const &fitters,
+    std::vector<int> const &path, int start, bool verbose) {
+        int npoints = path.size();
+        int nstripes = std::min((int)fitters.size(),npoints);
+        if(nstripes <= 1) {
+            if(npoints > 0) scanStripe(state,fitters[0],path,0,npoints,start,verbose);
+            return;
+        }
+        boost::thread_group workers;
+        for(int stripe = 0; stripe < nstripes; ++stripe) {
+            workers.create_thread(boost::bind(&scanStripe,boost::ref(state),fitters[stripe],
+                boost::cref(path),(stripe*npoints)/nstripes,((stripe+1)*npoints)/nstripes,start,false));
+        }
+        workers.join_all();
+    }
+    // Returns true if bin is one of the points sampled with the specified stride along an
+    // axis with nbins bins, which always include the first and last bins.
+    inline bool onScanLattice(int bin, int stride, int nbins) {
+        return 0 == bin % stride || bin == nbins-1;
+    }
+}
+
 int local::CorrelationAnalyzer::parameterScan(likely::FunctionMinimumCPtr fmin,
-AbsCorrelationDataCPtr sample, std::string const &saveName, int nsave, double zsave) const {
-    int nfits(0);
+AbsCorrelationDataCPtr sample, std::string const &saveName, int nsave, double zsave,
+double refineDChiSquare, int coarseStride) const {
+    if(refineDChiSquare > 0 && (coarseStride < 1 || 0 != (coarseStride & (coarseStride-1)))) {
+        throw RuntimeError("CorrelationAnalyzer::parameterScan: coarse stride must be a power of 2.");
+    }
     // Initialize the grid we will be sampling.
-    likely::FitParameters params = fmin->getFitParameters();
+    ScanState state;
+    state.method = _method;
+    state.initParams = fmin->getFitParameters();
+    likely::FitParameters const &params = state.initParams;
     likely::BinnedGrid grid = likely::getFitParametersGrid(params);
-    // Prepare to output samples at each grid point.
-    SamplingOutput output(fmin,likely::FunctionMinimumCPtr(),saveName,nsave,zsave,*this);
-    // Loop over grid points.
+    int npoints = grid.getNBinsTotal(), naxes = grid.getNAxes();
+    std::vector<int> nbins(naxes);
+    for(int axis = 0; axis < naxes; ++axis) nbins[axis] = grid.getAxisBinning(axis)->getNBins();
+    // Tabulate the config for each grid point and its position along a serpentine path
+    // through the grid, where consecutive points are always neighbours.
+    state.configs.resize(npoints);
+    std::vector<int> order(npoints), bins;
     for(likely::BinnedGrid::Iterator iter = grid.begin(); iter != grid.end(); ++iter) {
-        nfits++;
-        std::string config = likely::getFitParametersGridConfig(params,grid,iter);
+        int index(*iter);
+        state.configs[index] = likely::getFitParametersGridConfig(params,grid,iter);
+        grid.getBinIndices(index,bins);
+        int position(0);
+        for(int axis = 0; axis < naxes; ++axis) {
+            // Reverse direction along this axis when the position along the previous axes is odd.
+            int digit = (position % 2) ? nbins[axis]-1-bins[axis] : bins[axis];
+            position = position*nbins[axis] + digit;
+        }
+        order[position] = index;
+    }
+    ScanResult empty;
+    empty.done = empty.ok = false;
+    state.results.resize(npoints,empty);
+    // Only fit our block of grid points in a sharded scan.
+    if(_shardCount > 1) {
+        if(refineDChiSquare > 0) {
+            throw RuntimeError("CorrelationAnalyzer::parameterScan: adaptive scans cannot be sharded.");
+        }
+        int first = (_shardIndex*npoints)/_shardCount, last = ((_shardIndex+1)*npoints)/_shardCount;
+        std::vector<int> shardOrder;
+        BOOST_FOREACH(int index, order) {
+            if(index >= first && index < last) shardOrder.push_back(index);
+        }
+        order.swap(shardOrder);
+    }
+    // Results are saved as soon as they are available, then rewritten in grid order below.
+    boost::scoped_ptr<SamplingOutput> output(
+        new SamplingOutput(fmin,likely::FunctionMinimumCPtr(),saveName,nsave,zsave,*this,_resume));
+    state.output = output.get();
+    // Locate the grid point of each saved line using the values of the scanned parameters, which
+    // are the parameters with a binning spec.
+    std::vector<int> scanned;
+    for(int k = 0; k < params.size(); ++k) {
+        if(params[k].getBinningSpec().length() > 0) scanned.push_back(k);
+    }
+    std::vector<likely::Parameters> savedValues;
+    std::vector<double> savedChiSq, scannedValues(scanned.size());
+    int nsaved(0);
+    BOOST_FOREACH(std::string const &row, output->getSavedRows()) {
+        if(parseSavedSample(row,params.size(),1,savedValues,savedChiSq) < 1) {
+            throw RuntimeError("CorrelationAnalyzer::parameterScan: unable to resume from " + saveName);
+        }
+        for(int k = 0; k < scanned.size(); ++k) scannedValues[k] = savedValues[0][scanned[k]];
+        ScanResult &result = state.results[grid.getIndex(scannedValues)];
+        result.done = true;
+        result.ok = (0 != savedChiSq[0]);
+        result.params = params;
+        likely::setFitParameterValues(result.params,savedValues[0]);
+        result.fval = savedChiSq[0]/2;
+        result.row = row;
+        nsaved++;
+    }
+    if(_verbose && nsaved > 0) {
+        std::cout << "Resuming parameter scan after " << nsaved << " saved grid points." << std::endl;
+    }
+    // Create one fitter per thread, each with its own model.
+    std::vector<CorrelationFitterCPtr> fitters;
+    int nstripes = std::max(1,std::min(_samplingThreads,npoints));
+    if(1 == nstripes) {
+        CorrelationFitterPtr fitter(new CorrelationFitter(sample,_model,_covSampleSize));
+        fitter->setProfileLinear(_profileLinear);
+        fitter->setGradient(_gradient);
+        fitters.push_back(fitter);
+    }
+    else {
+        if(_verbose) std::cout << "Scanning grid points using " << nstripes << " threads." << std::endl;
+        // Calculate one chi-square before starting any workers, so that any inverse covariance
+        // that is calculated on demand is ready before they share it.
+        std::vector<double> zero(sample->getNBinsWithData(),0);
+        sample->chiSquare(zero);
+        for(int stripe = 0; stripe < nstripes; ++stripe) {
+            AbsCorrelationModelPtr model = _modelFactory();
+            if(_coordinatesSet) _setCoordinates(model);
+            CorrelationFitterPtr fitter(new CorrelationFitter(sample,model,_covSampleSize));
+            fitter->setProfileLinear(_profileLinear);
+            fitter->setGradient(_gradient);
+            fitters.push_back(fitter);
+        }
+    }
+    bool verbose(_verbose && 1 == nstripes);
+    std::vector<ScanResult> const &results = state.results;
+    std::vector<int> path;
+    int nfits(0);
+    if(refineDChiSquare <= 0) {
+        // Fit every grid point.
+        BOOST_FOREACH(int index, order) {
+            if(!results[index].done) path.push_back(index);
+        }
+        fitScanPath(state,fitters,path,-1,verbose);
+        nfits = order.size();
+    }
+    else {
+        // Fit a coarse lattice of grid points, then refine the lattice by a factor of two in each
+        // cell that has a corner within refineDChiSquare of the smallest chi-square found so far.
+        int best(-1);
+        std::vector<int> corner(naxes);
+        for(int stride = coarseStride; stride >= 1; stride /= 2) {
+            path.resize(0);
+            BOOST_FOREACH(int index, order) {
+                if(results[index].done) continue;
+                grid.getBinIndices(index,bins);
+                bool selected(true);
+                for(int axis = 0; axis < naxes; ++axis) {
+                    if(!onScanLattice(bins[axis],stride,nbins[axis])) selected = false;
+                }
+                if(!selected) continue;
+                if(stride < coarseStride) {
+                    // Look for a corner of the enclosing coarser cell that was fit and is close
+                    // enough to the best fit. Axes where this point is already on the coarser
+                    // lattice have only one corner.
+                    selected = false;
+                    for(int mask = 0; mask < (1 << naxes) && !selected; ++mask) {
+                        bool valid(true);
+                        for(int axis = 0; axis < naxes; ++axis) {
+                            int bin(bins[axis]), n(nbins[axis]);
+                            if(onScanLattice(bin,2*stride,n)) {
+                                if(mask & (1 << axis)) valid = false;
+                                corner[axis] = bin;
+                            }
+                            else {
+                                corner[axis] = (mask & (1 << axis)) ? std::min(bin+stride,n-1) : bin-stride;
+                            }
+                        }
+                        if(!valid) continue;
+                        ScanResult const &result = results[grid.getIndex(corner)];
+                        if(result.ok && 2*(result.fval - results[best].fval) <= refineDChiSquare) {
+                            selected = true;
+                        }
+                    }
+                }
+                if(selected) path.push_back(index);
+            }
+            if(_verbose) {
+                std::cout << "Fitting " << path.size() << " scan points with stride " << stride << std::endl;
+            }
+            fitScanPath(state,fitters,path,best,verbose);
+            // Update the best fit, including any saved results from a resumed scan.
+            for(int index = 0; index < npoints; ++index) {
+                if(results[index].ok && (best < 0 || results[index].fval < results[best].fval)) best = index;
+            }
+            if(best < 0) {
+                throw RuntimeError("CorrelationAnalyzer::parameterScan: all coarse scan fits failed.");
+            }
+        }
+        for(int index = 0; index < npoints; ++index) {
+            if(results[index].done) nfits++;
+        }
         if(_verbose) {
-            std::cout << std::endl << "-- Performing scan step " << nfits << " of " << grid.getNBinsTotal()
-                << " using " << config << std::endl;
+            std::cout << "Adaptive scan used " << nfits << " of " << npoints << " grid points." << std::endl;
         }
-        // Do the fit.
-        try {
-            likely::FunctionMinimumCPtr gridMin = fitSample(sample,config);
-            // Add the results to our output file.
-            output.saveSample(gridMin->getFitParameters(),gridMin->getMinValue());
+    }
+    // Rewrite the results in grid order, via a temporary file so that an interrupted rewrite
+    // does not lose any results.
+    output.reset();
+    if(saveName.length() > 0) {
+        std::string tmpName = saveName + ".tmp";
+        output.reset(new SamplingOutput(fmin,likely::FunctionMinimumCPtr(),tmpName,nsave,zsave,*this));
+        for(int index = 0; index < npoints; ++index) {
+            if(results[index].done) output->saveRow(results[index].row);
         }
-        catch(std::runtime_error const &e) {
-            std::cerr << "ERROR while fitting:\n  " << e.what() << std::endl;
-            // Use a copy of initial parameters with the config for this step applied.
-            likely::FitParameters pcopy(params);
-            likely::modifyFitParameters(pcopy,config);
-            // Save results with fval = 0
-            output.saveSample(pcopy,0.);
+        output.reset();
+        if(0 != std::rename(tmpName.c_str(),saveName.c_str())) {
+            throw RuntimeError("CorrelationAnalyzer::parameterScan: unable to rename " + tmpName);
         }
     }
     return nfits;
@@ -621,11 +1292,55 @@ AbsCorrelationDataCPtr combined, std::string const &script, bool dumpGradients)
     likely::Parameters parameterValues,parameterErrors;
     likely::getFitParameterValues(parameters,parameterValues);
     int npar = fmin->getNParameters();
-    if(dumpGradients) likely::getFitParameterErrors(parameters,parameterErrors);
-    // Loop over 3D bins in the combined dataset.
+    // Calculate the prediction for each bin in the combined dataset.
+    std::vector<int> bins(combined->begin(),combined->end());
+    int nbins = bins.size();
+    std::vector<double> predicted;
+    AbsCorrelationModel::Coordinates coords;
+    if(type == AbsCorrelationData::Coordinate) {
+        for(int i = 0; i < nbins; ++i) {
+            coords.r.push_back(combined->getRadius(bins[i]));
+            coords.mu.push_back(combined->getCosAngle(bins[i]));
+            coords.z.push_back(combined->getRedshift(bins[i]));
+            coords.index.push_back(bins[i]);
+        }
+    }
+    // Calculate the gradient of the prediction vector with respect to each parameter with
+    // a non-zero error, using a central difference of width 0.1*error when the model does
+    // not provide an analytic derivative.
+    std::vector<int> indices;
+    std::vector<double> steps, jacobian;
+    if(dumpGradients) {
+        likely::getFitParameterErrors(parameters,parameterErrors);
+        for(int ipar = 0; ipar < npar; ++ipar) {
+            if(parameterErrors[ipar] <= 0) continue;
+            indices.push_back(ipar);
+            steps.push_back(0.05*parameterErrors[ipar]);
+        }
+    }
+    if(type == AbsCorrelationData::Coordinate) {
+        _model->evaluateAllJacobian(coords,parameterValues,indices,steps,predicted,jacobian,
+            _getGradientWorkers());
+    }
+    else {
+        likely::Parameters shifted(parameterValues);
+        std::vector<double> predHi, predLo;
+        jacobian.resize(nbins*indices.size());
+        for(int k = 0; k < indices.size(); ++k) {
+            int ipar = indices[k];
+            shifted[ipar] = parameterValues[ipar] + steps[k];
+            _evaluateMultipoles(combined,bins,shifted,predHi);
+            shifted[ipar] = parameterValues[ipar] - steps[k];
+            _evaluateMultipoles(combined,bins,shifted,predLo);
+            shifted[ipar] = parameterValues[ipar];
+            for(int i = 0; i < nbins; ++i) jacobian[k*nbins+i] = (predHi[i] - predLo[i])/(2*steps[k]);
+        }
+        _evaluateMultipoles(combined,bins,parameterValues,predicted);
+    }
+    // Write one row for each bin.
     std::vector<double> centers;
-    for(likely::BinnedData::IndexIterator iter = combined->begin(); iter != combined->end(); ++iter) {
-        int index(*iter);
+    for(int i = 0; i < nbins; ++i) {
+        int index(bins[i]);
         out << index;
         if(combined->useCustomGrid()) {
             combined->getCustomBinCenters(index,centers);
@@ -640,35 +1355,17 @@ AbsCorrelationDataCPtr combined, std::string const &script, bool dumpGradients)
         double error = combined->hasCovariance() ? std::sqrt(combined->getCovariance(index,index)) : 0;
         double z = combined->getRedshift(index);
         double r = combined->getRadius(index);
-        double predicted,mu;
-        cosmo::Multipole multipole;
         if(type == AbsCorrelationData::Coordinate) {
-            mu = combined->getCosAngle(index);
-            predicted = _model->evaluate(r,mu,z,parameterValues,index);
-            out  << ' ' << r << ' ' << mu << ' ' << z;
+            out  << ' ' << r << ' ' << coords.mu[i] << ' ' << z;
         }
         else {
-            multipole = combined->getMultipole(index);
-            predicted = _model->evaluate(r,multipole,z,parameterValues,index);
-            out  << ' ' << r << ' ' << (int)multipole << ' ' << z;
+            out  << ' ' << r << ' ' << (int)combined->getMultipole(index) << ' ' << z;
         }
-        out << ' ' << predicted << ' ' << data << ' ' << error;
+        out << ' ' << predicted[i] << ' ' << data << ' ' << error;
         if(dumpGradients) {
-            for(int ipar = 0; ipar < npar; ++ipar) {
-                double gradient(0), dpar(0.1*parameterErrors[ipar]);
-                if(dpar > 0) {
-                    double p0 = parameterValues[ipar];
-                    parameterValues[ipar] = p0 + 0.5*dpar;
-                    double predHi = (type == AbsCorrelationData::Coordinate) ?
-                        _model->evaluate(r,mu,z,parameterValues,index) :
-                        _model->evaluate(r,multipole,z,parameterValues,index);
-                    parameterValues[ipar] = p0 - 0.5*dpar;
-                    double predLo = (type == AbsCorrelationData::Coordinate) ?
-                        _model->evaluate(r,mu,z,parameterValues,index) :
-                        _model->evaluate(r,multipole,z,parameterValues,index);
-                    gradient = (predHi - predLo)/dpar;
-                    parameterValues[ipar] = p0;
-                }
+            for(int ipar = 0, k = 0; ipar < npar; ++ipar) {
+                double gradient(0);
+                if(k < indices.size() && indices[k] == ipar) gradient = jacobian[(k++)*nbins+i];
                 out << ' ' << gradient;
             }
         }
@@ -676,6 +1373,16 @@ AbsCorrelationDataCPtr combined, std::string const &script, bool dumpGradients)
     }
 }
 
+void local::CorrelationAnalyzer::_evaluateMultipoles(AbsCorrelationDataCPtr data, std::vector<int> const &bins,
+likely::Parameters const &params, std::vector<double> &out) const {
+    out.resize(bins.size());
+    for(int i = 0; i < bins.size(); ++i) {
+        int index(bins[i]);
+        out[i] = _model->evaluate(data->getRadius(index),data->getMultipole(index),
+            data->getRedshift(index),params,index);
+    }
+}
+
 void local::CorrelationAnalyzer::dumpModel(std::ostream &out, likely::FitParameters parameters,
 int ndump, double zdump, std::string const &script, bool oneLine) const {
     if(ndump <= 1) {
@@ -683,7 +1390,7 @@ int ndump, double zdump, std::string const &script, bool oneLine) const {
     }
     if(zdump < 0) {
         // Use the redshift of the first bin of the first subsample, if none is specified
-        AbsCorrelationDataCPtr subsample =
+        AbsCorrelationDataCPtr subsample = _streaming ? _streamed :
             boost::dynamic_pointer_cast<const baofit::AbsCorrelationData>(_resampler.getObservation(0));
         zdump = subsample->getRedshift(0);
     }
@@ -731,6 +1438,7 @@ namespace baofit {
 
 likely::CovarianceMatrixPtr
 local::CorrelationAnalyzer::estimateCombinedCovariance(int nSamples, std::string const &filename) const {
+    _requireObservations("estimateCombinedCovariance");
     // Print a message every 10 samples during accumulation.
     likely::CovarianceAccumulatorPtr accumulator = _resampler.estimateCombinedCovariance(nSamples,
         likely::BinnedDataResampler::AccumulationCallback(accumulationCallback),10);
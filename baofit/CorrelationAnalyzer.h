@@ -10,6 +10,8 @@
 #include "likely/BinnedDataResampler.h"
 #include "likely/FitParameter.h"
 
+#include "boost/function.hpp"
+
 #include <iosfwd>
 
 namespace baofit {
@@ -29,8 +31,51 @@ namespace baofit {
         int addData(AbsCorrelationDataCPtr data, int reuseCovIndex);
         // Returns the number of data objects added to this analyzer.
         int getNData() const;
+        // Selects streaming mode, where each data object is combined with the running
+        // inverse-covariance weighted sums as soon as it is added, and is then discarded.
+        // This limits memory to a single combined data object, but any analysis that needs
+        // the individual observations (bootstrap, jackknife, fit-each, compare-each and
+        // estimateCombinedCovariance) will throw a RuntimeError. Must be called before any
+        // data is added and is not supported with scalar weights.
+        void setStreaming(bool value);
+        // Returns true if we are in streaming mode.
+        bool isStreaming() const;
         // Sets the correlation model to use.
         void setModel(AbsCorrelationModelPtr model);
+        // Builds a new correlation model that is configured identically to the model passed
+        // to setModel().
+        typedef boost::function<AbsCorrelationModelPtr ()> ModelFactory;
+        // Fits the samples of bootstrap, jackknife, fit-each and toy MC analyses, and the points
+        // of a parameter scan, using nthreads worker threads, each with its own model built by
+        // the specified factory. Samples are still generated in order by the calling thread and
+        // the fit results are merged in sample order, so that the results are identical to
+        // fitting each sample in turn.
+        // Use nthreads <= 1 to fit all samples in the calling thread with the model passed
+        // to setModel().
+        void setSamplingThreads(int nthreads, ModelFactory factory = ModelFactory());
+        // Resumes sampling analyses and parameter scans from their existing output files, if any.
+        // Samples or grid points that are already saved are skipped, and the saved fit results
+        // are included in the final statistics.
+        void setResume(bool value);
+        // Sets the seed used to derive the random numbers of each bootstrap and toy MC sample.
+        // Each sample's random numbers depend only on this seed and the sample's index, so samples
+        // can be generated independently in any order.
+        void setRandomSeed(int seed);
+        // Selects shard index (0 <= index < count) of a sharded analysis, where independent jobs
+        // each fit a deterministic subset of samples or grid points. Sampling analyses fit the
+        // samples whose sequence number modulo count equals index, and also save the floating state and name of
+        // each parameter to <saveName>.params for use by baofit-merge. Parameter scans fit the
+        // index-th of count contiguous blocks of grid points, in grid order.
+        void setShard(int index, int count);
+        // Profiles floating parameters that the model prediction depends on linearly analytically
+        // in all fits. See CorrelationFitter::setProfileLinear for details.
+        void setProfileLinear(bool value);
+        // Provides the minimizer with the gradient of the chi-square in all fits. See
+        // CorrelationFitter::setGradient for details. Finite differences for fits of the combined
+        // data, and for the gradients written by dumpResiduals, are split between nthreads worker
+        // threads, each with its own model built by the specified factory. Sampling analyses and
+        // parameter scans use their own model in each sampling thread instead.
+        void setGradient(bool value, int nthreads = 1, ModelFactory factory = ModelFactory());
         // Sets the grid coordinates to use for the distortion matrix in the correlation model.
         // Returns the number of bins of the coordinate grid.
         int setCoordinates() const;
@@ -97,9 +142,16 @@ namespace baofit {
             double zsave = -1) const;
         // Refits the specified sample on the parameter grid specified by each parameter's binning
         // spec and saves the results to the specified file name. Returns the number of fits performed.
+        // The grid is walked along a serpentine path so that each fit starts from the minimum found
+        // at a neighbouring grid point, and the path is split into contiguous stripes that are fit
+        // in parallel when setSamplingThreads() has been called. Results are saved in grid order.
+        // Use refineDChiSquare > 0 for an adaptive scan that first fits the grid points spaced by
+        // coarseStride (a power of 2) along each axis, then repeatedly halves the spacing within
+        // each cell that has a corner with a chi-square within refineDChiSquare of the smallest
+        // value found so far. Only the grid points that were fit are saved in this case.
         int parameterScan(likely::FunctionMinimumCPtr fmin,
             AbsCorrelationDataCPtr sample, std::string const &saveName = "", int nsave = 0,
-            double zsave = -1) const;
+            double zsave = -1, double refineDChiSquare = 0, int coarseStride = 8) const;
         // Generates and fits toy Monte Carlo samples and returns the number of fits that failed.
         // Samples are generated by calculating the truth corresponding to the best-fit input
         // parameters in fmin and adding noise sampled from the combined dataset covariance matrix.
@@ -115,7 +167,9 @@ namespace baofit {
         // to model that is currently associated with this analyzer. Use the optional script
         // to modify the parameters used in the model. By default, the gradient of each
         // bin with respect to each floating parameter is append to each output row, unless
-        // dumpGradients = false.
+        // dumpGradients = false. Gradients are calculated for the whole prediction vector at once,
+        // using analytic model derivatives where available and otherwise central differences
+        // split between any gradient worker threads (see setGradient).
         void dumpResiduals(std::ostream &out, likely::FunctionMinimumPtr fmin,
             AbsCorrelationDataCPtr combined, std::string const &script = "",
             bool dumpGradients = true) const;
@@ -150,15 +204,36 @@ namespace baofit {
         std::string _method;
         double _rmin, _rmax;
         int _covSampleSize;
-        bool _verbose;
+        bool _verbose, _streaming;
+        int _nstreamed, _samplingThreads, _shardIndex, _shardCount, _randomSeed;
+        bool _resume, _profileLinear, _gradient;
+        int _gradientThreads;
+        ModelFactory _gradientFactory;
+        // Returns the worker models used for the gradients of fitSample and dumpResiduals,
+        // creating them if necessary.
+        std::vector<AbsCorrelationModelPtr> const &_getGradientWorkers() const;
+        mutable std::vector<AbsCorrelationModelPtr> _gradientWorkers;
+        ModelFactory _modelFactory;
+        mutable bool _coordinatesSet;
         likely::BinnedDataResampler _resampler;
+        AbsCorrelationDataPtr _streamed;
         AbsCorrelationModelPtr _model;
+        // Throws a RuntimeError for the specified method if we are in streaming mode.
+        void _requireObservations(std::string const &method) const;
+        // Forwards the grid coordinates of our combined data to the specified model.
+        int _setCoordinates(AbsCorrelationModelPtr model) const;
+        // Fills the vector provided with our model's multipole predictions for the specified bins.
+        void _evaluateMultipoles(AbsCorrelationDataCPtr data, std::vector<int> const &bins,
+            likely::Parameters const &params, std::vector<double> &out) const;
         
         class AbsSampler;
         class JackknifeSampler;
         class BootstrapSampler;
         class EachSampler;
         class ToyMCSampler;
+        // Skips any samples that belong to other shards and returns false if no samples remain.
+        // The seqno of the next sample is updated.
+        bool _skipToShard(AbsSampler &sampler, int &seqno) const;
         int doSamplingAnalysis(AbsSampler &sampler, std::string const &method,
             likely::FunctionMinimumPtr fmin, likely::FunctionMinimumPtr fmin2,
             std::string const &refitConfig, std::string const &saveName, int nsave, double zsave) const;
@@ -166,7 +241,10 @@ namespace baofit {
 	}; // CorrelationAnalyzer
 	
     inline void CorrelationAnalyzer::setVerbose(bool value) { _verbose = value; }
-    inline int CorrelationAnalyzer::getNData() const { return _resampler.getNObservations(); }
+    inline int CorrelationAnalyzer::getNData() const {
+        return _streaming ? _nstreamed : _resampler.getNObservations();
+    }
+    inline bool CorrelationAnalyzer::isStreaming() const { return _streaming; }
     inline void CorrelationAnalyzer::setModel(AbsCorrelationModelPtr model) { _model = model; }
 
 } // baofit
@@ -8,18 +8,104 @@
 #include "likely/FitParameter.h"
 #include "likely/FunctionMinimum.h"
 #include "likely/MarkovChainEngine.h"
+#include "likely/CovarianceMatrix.h"
 
 #include "boost/bind.hpp"
 #include "boost/ref.hpp"
+#include "boost/lexical_cast.hpp"
 
 #include <iostream>
 #include <cmath>
+#include <limits>
 
 namespace local = baofit;
 
+namespace baofit {
+namespace profile {
+    // Maximum relative deviation from linearity allowed for a profiled parameter.
+    const double linearityTolerance = 1e-6;
+    // Central difference step sizes for gradients, relative to each parameter's initial error.
+    const double gradientStepScale = 1e-2;
+    // Shifts used to test for a prior on a parameter, relative to its initial error. The largest
+    // shift detects box priors that bound a parameter without changing the priors near its value.
+    const double priorTestShifts[] = { -1e6, -1, +1, +1e6 };
+    // Returns the Euclidean distance between two vectors of the same size.
+    double distance(std::vector<double> const &a, std::vector<double> const &b) {
+        double sum(0);
+        for(int i = 0; i < a.size(); ++i) sum += (a[i]-b[i])*(a[i]-b[i]);
+        return std::sqrt(sum);
+    }
+    // Replaces the n x n symmetric matrix provided with its lower-triangular Cholesky factor.
+    // Returns false if the matrix is not positive definite.
+    bool choleskyDecompose(std::vector<double> &matrix, int n) {
+        for(int j = 0; j < n; ++j) {
+            double diag = matrix[j*n+j];
+            for(int k = 0; k < j; ++k) diag -= matrix[j*n+k]*matrix[j*n+k];
+            if(!(diag > 0)) return false;
+            diag = std::sqrt(diag);
+            matrix[j*n+j] = diag;
+            for(int i = j+1; i < n; ++i) {
+                double sum = matrix[i*n+j];
+                for(int k = 0; k < j; ++k) sum -= matrix[i*n+k]*matrix[j*n+k];
+                matrix[i*n+j] = sum/diag;
+                matrix[j*n+i] = 0;
+            }
+        }
+        return true;
+    }
+    // Solves L.L^T x = b in place, where L is a Cholesky factor from choleskyDecompose.
+    void choleskySolve(std::vector<double> const &factor, int n, double *b) {
+        for(int i = 0; i < n; ++i) {
+            for(int k = 0; k < i; ++k) b[i] -= factor[i*n+k]*b[k];
+            b[i] /= factor[i*n+i];
+        }
+        for(int i = n-1; i >= 0; --i) {
+            for(int k = i+1; k < n; ++k) b[i] -= factor[k*n+i]*b[k];
+            b[i] /= factor[i*n+i];
+        }
+    }
+} // profile
+} // baofit
+
+struct local::CorrelationFitter::LinearProfile {
+    // Data vector and packed upper triangle of its inverse covariance, for bins with data.
+    std::vector<double> data, icov;
+    // Indices and step sizes of the parameters being profiled.
+    std::vector<int> index;
+    std::vector<double> step;
+    // Prediction with all profiled parameters zero, and its derivative with respect to each
+    // profiled parameter, stored contiguously, with each derivative multiplied by icov.
+    std::vector<double> base, columns, weighted;
+    // Derivatives calculated by the most recent call to _profileParameters.
+    std::vector<double> derivatives;
+    // Cholesky factor of the Fisher matrix columns.icov.columns of the profiled parameters.
+    std::vector<double> fisher;
+    // Profiled parameter values from the last call to _profileParameters.
+    std::vector<double> solution;
+    // Indices and central difference step sizes of the parameters passed to the minimizer,
+    // when calculating gradients.
+    std::vector<int> gradientIndex;
+    std::vector<double> gradientStep;
+    // Multiplies the vector x by icov and saves the result in y.
+    void multiplyByInverseCovariance(double const *x, double *y) const {
+        int n = data.size();
+        std::vector<double>::const_iterator next = icov.begin();
+        for(int i = 0; i < n; ++i) y[i] = 0;
+        for(int i = 0; i < n; ++i) {
+            y[i] += (*next++)*x[i];
+            for(int j = i+1; j < n; ++j) {
+                double value = *next++;
+                y[i] += value*x[j];
+                y[j] += value*x[i];
+            }
+        }
+    }
+};
+
 local::CorrelationFitter::CorrelationFitter(AbsCorrelationDataCPtr data, AbsCorrelationModelPtr model,
 int covSampleSize)
-: _data(data), _model(model), _errorScale(1), _type(data->getTransverseBinningType())
+: _data(data), _model(model), _errorScale(1), _type(data->getTransverseBinningType()), _profileLinear(false),
+_gradient(false)
 {
     if(!data || 0 == data->getNBinsWithData()) {
         throw RuntimeError("CorrelationFitter: need some data to fit.");
@@ -39,6 +125,20 @@ int covSampleSize)
     else {
         _icovScale = 1;
     }
+    // Tabulate the coordinates of each bin with data for batch evaluation of the model.
+    if(_type == AbsCorrelationData::Coordinate) {
+        _coords.r.reserve(n);
+        _coords.mu.reserve(n);
+        _coords.z.reserve(n);
+        _coords.index.reserve(n);
+        for(baofit::AbsCorrelationData::IndexIterator iter = _data->begin(); iter != _data->end(); ++iter) {
+            int index(*iter);
+            _coords.r.push_back(_data->getRadius(index));
+            _coords.mu.push_back(_data->getCosAngle(index));
+            _coords.z.push_back(_data->getRedshift(index));
+            _coords.index.push_back(index);
+        }
+    }
 }
 
 local::CorrelationFitter::~CorrelationFitter() { }
@@ -50,24 +150,30 @@ void local::CorrelationFitter::setErrorScale(double scale) {
     _errorScale = scale;
 }
 
+void local::CorrelationFitter::setProfileLinear(bool value) {
+    _profileLinear = value;
+}
+
+void local::CorrelationFitter::setGradient(bool value, std::vector<AbsCorrelationModelPtr> const &workers) {
+    _gradient = value;
+    _gradientWorkers = workers;
+}
+
 void local::CorrelationFitter::getPrediction(likely::Parameters const &params,
 std::vector<double> &prediction) const {
+    // Evaluate all (r,mu,z) bins with a single call to the model.
+    if(_type == AbsCorrelationData::Coordinate) {
+        _model->evaluateAll(_coords,params,prediction);
+        return;
+    }
     prediction.reserve(_data->getNBinsWithData());
     prediction.resize(0);
     for(baofit::AbsCorrelationData::IndexIterator iter = _data->begin(); iter != _data->end(); ++iter) {
         int index(*iter);
         double z = _data->getRedshift(index);
         double r = _data->getRadius(index);
-        double predicted;
-        if(_type == AbsCorrelationData::Coordinate) {
-            double mu = _data->getCosAngle(index);
-            predicted = _model->evaluate(r,mu,z,params,index);
-        }
-        else {
-            cosmo::Multipole multipole = _data->getMultipole(index);
-            predicted = _model->evaluate(r,multipole,z,params,index);
-        }
-        prediction.push_back(predicted);
+        cosmo::Multipole multipole = _data->getMultipole(index);
+        prediction.push_back(_model->evaluate(r,multipole,z,params,index));
     }    
 }
 
@@ -87,8 +193,344 @@ double local::CorrelationFitter::operator()(likely::Parameters const &params) co
 
 likely::FunctionMinimumPtr local::CorrelationFitter::fit(std::string const &methodName,
 std::string const &config) const {
-    likely::FunctionPtr fptr(new likely::Function(*this));
-    return _model->findMinimum(fptr,methodName,config);
+    std::string fitConfig(config);
+    bool profiled(false);
+    likely::GradientCalculatorPtr gptr;
+    // Find the parameters for this fit and check that our model can use them.
+    likely::FitParameters params(_model->getFitParameters());
+    if(config.length() > 0) likely::modifyFitParameters(params,config);
+    _model->checkFitParameters(params);
+    if(_profileLinear || _gradient) {
+        _tabulateData();
+        if(_profileLinear) {
+            _findLinearParameters(params);
+            std::vector<int> const &index = _profile->index;
+            // Fix the profiled parameters so that only the other floating parameters reach the minimizer.
+            std::string fixConfig;
+            for(int k = 0; k < index.size(); ++k) {
+                likely::FitParameter const &param = params[index[k]];
+                if(k > 0) fixConfig += ";";
+                fixConfig += "fix[" + param.getName() + "]=" + boost::lexical_cast<std::string>(param.getValue());
+            }
+            if(fixConfig.length() > 0) {
+                likely::modifyFitParameters(params,fixConfig);
+                if(fitConfig.length() > 0 && *fitConfig.rbegin() != ';') fitConfig += ";";
+                fitConfig += fixConfig;
+                profiled = true;
+            }
+        }
+        if(_gradient) {
+            // Calculate derivatives with respect to the parameters that reach the minimizer.
+            _profile->gradientIndex.resize(0);
+            _profile->gradientStep.resize(0);
+            for(int index = 0; index < params.size(); ++index) {
+                if(!params[index].isFloating()) continue;
+                double error = params[index].getError();
+                _profile->gradientIndex.push_back(index);
+                _profile->gradientStep.push_back(error > 0 ? profile::gradientStepScale*error : profile::gradientStepScale);
+            }
+            gptr.reset(new likely::GradientCalculator(
+                boost::bind(&CorrelationFitter::_evaluateGradient,this,_1,_2)));
+        }
+    }
+    likely::FunctionPtr fptr;
+    if(profiled) {
+        fptr.reset(new likely::Function(boost::bind(&CorrelationFitter::_evaluateProfiled,this,_1)));
+    }
+    else {
+        fptr.reset(new likely::Function(*this));
+    }
+    likely::FunctionMinimumPtr fmin = gptr ?
+        _model->findMinimum(fptr,gptr,methodName,fitConfig) : _model->findMinimum(fptr,methodName,fitConfig);
+    return profiled ? _addProfiledParameters(fmin) : fmin;
+}
+
+void local::CorrelationFitter::_tabulateData() const {
+    if(_profile) return;
+    _profile.reset(new LinearProfile());
+    int n = _data->getNBinsWithData();
+    std::vector<int> bins(_data->begin(),_data->end());
+    _profile->data.reserve(n);
+    _profile->icov.reserve((n*(n+1))/2);
+    for(int i = 0; i < n; ++i) {
+        _profile->data.push_back(_data->getData(bins[i]));
+        for(int j = i; j < n; ++j) _profile->icov.push_back(_data->getInverseCovariance(bins[i],bins[j]));
+    }
+}
+
+void local::CorrelationFitter::_evaluateGradient(likely::Parameters const &params,
+likely::Parameters &gradient) const {
+    LinearProfile &lp = *_profile;
+    // The profiled chi-square is stationary with respect to the profiled parameters, so its
+    // gradient is the partial derivative with respect to the other parameters at the profiled values.
+    likely::Parameters values(params);
+    if(lp.index.size() > 0) _profileParameters(values);
+    std::vector<int> const &indices = lp.gradientIndex;
+    std::vector<double> const &steps = lp.gradientStep;
+    int n = lp.data.size(), nindices = indices.size();
+    std::vector<double> pred, jacobian;
+    if(_type == AbsCorrelationData::Coordinate) {
+        _model->evaluateAllJacobian(_coords,values,indices,steps,pred,jacobian,_gradientWorkers);
+    }
+    else {
+        // Use central differences for multipole data.
+        jacobian.resize(n*nindices);
+        likely::Parameters shifted(values);
+        std::vector<double> minus;
+        for(int k = 0; k < nindices; ++k) {
+            shifted[indices[k]] = values[indices[k]] + steps[k];
+            getPrediction(shifted,pred);
+            shifted[indices[k]] = values[indices[k]] - steps[k];
+            getPrediction(shifted,minus);
+            shifted[indices[k]] = values[indices[k]];
+            for(int i = 0; i < n; ++i) jacobian[k*n+i] = (pred[i] - minus[i])/(2*steps[k]);
+        }
+        getPrediction(values,pred);
+    }
+    // The gradient of chiSquare/2 is -J^T.icov.(data - prediction), scaled as in operator().
+    std::vector<double> residual(n), weighted(n);
+    for(int i = 0; i < n; ++i) residual[i] = lp.data[i] - pred[i];
+    lp.multiplyByInverseCovariance(&residual[0],&weighted[0]);
+    gradient.assign(params.size(),0);
+    likely::Parameters shifted(values);
+    for(int k = 0; k < nindices; ++k) {
+        double sum(0);
+        for(int i = 0; i < n; ++i) sum += jacobian[k*n+i]*weighted[i];
+        // Add the derivative of any priors using central differences.
+        int index = indices[k];
+        shifted[index] = values[index] + steps[k];
+        double priorPlus = _model->evaluatePriorsAt(shifted);
+        shifted[index] = values[index] - steps[k];
+        double priorMinus = _model->evaluatePriorsAt(shifted);
+        shifted[index] = values[index];
+        gradient[index] = (-_icovScale*sum + (priorPlus - priorMinus)/(2*steps[k]))/_errorScale;
+    }
+}
+
+void local::CorrelationFitter::_findLinearParameters(likely::FitParameters const &params) const {
+    LinearProfile &lp = *_profile;
+    lp.index.resize(0);
+    lp.step.resize(0);
+    likely::Parameters values, joint;
+    likely::getFitParameterValues(params,values);
+    joint = values;
+    int nfloating = likely::countFloatingFitParameters(params);
+    // Each parameter is tested for linearity on its own, then in combination with all
+    // parameters already selected, to exclude products of parameters (e.g., an amplitude
+    // and a multiplicative broadband coefficient).
+    std::vector<double> pred0, predPlus, predMinus, predJoint, expected;
+    getPrediction(values,pred0);
+    expected = pred0;
+    double prior0 = _model->evaluatePriorsAt(values);
+    int ntests = sizeof(profile::priorTestShifts)/sizeof(double);
+    for(int k = 0; k < params.size(); ++k) {
+        if(!params[k].isFloating()) continue;
+        // Always leave at least one floating parameter for the minimizer.
+        if(lp.index.size() + 1 >= nfloating) break;
+        double step = params[k].getError();
+        if(step <= 0) step = 1;
+        // Parameters with a prior (including a box prior that bounds them) are left to the
+        // minimizer, since the least-squares solution for profiled parameters ignores priors.
+        double value = values[k];
+        bool hasPrior(false);
+        for(int test = 0; test < ntests && !hasPrior; ++test) {
+            values[k] = value + profile::priorTestShifts[test]*step;
+            hasPrior = (_model->evaluatePriorsAt(values) != prior0);
+        }
+        values[k] = value;
+        if(hasPrior) continue;
+        values[k] += step;
+        getPrediction(values,predPlus);
+        values[k] -= 2*step;
+        getPrediction(values,predMinus);
+        values[k] += step;
+        double slope = profile::distance(predPlus,predMinus)/2;
+        for(int i = 0; i < predMinus.size(); ++i) predMinus[i] = 2*pred0[i] - predMinus[i];
+        if(!(slope > 0) || profile::distance(predPlus,predMinus) > profile::linearityTolerance*slope) continue;
+        joint[k] += step;
+        getPrediction(joint,predJoint);
+        for(int i = 0; i < predPlus.size(); ++i) predPlus[i] += expected[i] - pred0[i];
+        if(profile::distance(predJoint,predPlus) >
+        profile::linearityTolerance*profile::distance(predPlus,pred0)) {
+            joint[k] -= step;
+            continue;
+        }
+        expected = predPlus;
+        lp.index.push_back(k);
+        lp.step.push_back(step);
+    }
+    // Invalidate any derivatives saved from a previous fit.
+    int n = lp.data.size(), nlin = lp.index.size();
+    lp.columns.assign(nlin*n,std::numeric_limits<double>::quiet_NaN());
+    lp.weighted.resize(nlin*n);
+    lp.fisher.resize(nlin*nlin);
+    lp.solution.resize(nlin);
+}
+
+void local::CorrelationFitter::_profileParameters(likely::Parameters &params) const {
+    LinearProfile &lp = *_profile;
+    int n = lp.data.size(), nlin = lp.index.size();
+    // Calculate the prediction with all profiled parameters set to zero, and its derivative with
+    // respect to each profiled parameter.
+    for(int k = 0; k < nlin; ++k) params[lp.index[k]] = 0;
+    if(_type == AbsCorrelationData::Coordinate) {
+        // Use the model's analytic derivatives where it provides them (e.g., for additive broadband
+        // coefficients), which only falls back to finite differences for any other parameters.
+        _model->evaluateAllJacobian(_coords,params,lp.index,lp.step,lp.base,lp.derivatives,_gradientWorkers);
+    }
+    else {
+        getPrediction(params,lp.base);
+        lp.derivatives.resize(nlin*n);
+        std::vector<double> pred;
+        for(int k = 0; k < nlin; ++k) {
+            params[lp.index[k]] = lp.step[k];
+            getPrediction(params,pred);
+            params[lp.index[k]] = 0;
+            for(int i = 0; i < n; ++i) lp.derivatives[k*n+i] = (pred[i] - lp.base[i])/lp.step[k];
+        }
+    }
+    // The derivatives often do not depend on the other parameters, so we only update the
+    // weighted derivatives when they change.
+    bool changed(false);
+    for(int k = 0; k < nlin; ++k) {
+        double *column = &lp.columns[k*n];
+        bool same(true);
+        for(int i = 0; i < n; ++i) {
+            double value = lp.derivatives[k*n+i];
+            if(value != column[i]) {
+                column[i] = value;
+                same = false;
+            }
+        }
+        if(!same) {
+            lp.multiplyByInverseCovariance(column,&lp.weighted[k*n]);
+            changed = true;
+        }
+    }
+    if(changed) {
+        for(int j = 0; j < nlin; ++j) {
+            for(int k = 0; k <= j; ++k) {
+                double sum(0);
+                for(int i = 0; i < n; ++i) sum += lp.columns[j*n+i]*lp.weighted[k*n+i];
+                lp.fisher[j*nlin+k] = lp.fisher[k*nlin+j] = sum;
+            }
+        }
+        if(!profile::choleskyDecompose(lp.fisher,nlin)) {
+            // Force the derivatives to be recalculated next time.
+            lp.columns[0] = std::numeric_limits<double>::quiet_NaN();
+            throw RuntimeError("CorrelationFitter: profiled parameters are degenerate.");
+        }
+    }
+    // Solve for the profiled parameter values that minimize the chi-square.
+    for(int k = 0; k < nlin; ++k) {
+        double sum(0);
+        for(int i = 0; i < n; ++i) sum += lp.weighted[k*n+i]*(lp.data[i] - lp.base[i]);
+        lp.solution[k] = sum;
+    }
+    profile::choleskySolve(lp.fisher,nlin,&lp.solution[0]);
+    for(int k = 0; k < nlin; ++k) params[lp.index[k]] = lp.solution[k];
+}
+
+double local::CorrelationFitter::_evaluateProfiled(likely::Parameters const &params) const {
+    likely::Parameters profiled(params);
+    _profileParameters(profiled);
+    // Evaluating the model at the profiled values also updates the values used by evaluatePriors.
+    return (*this)(profiled);
+}
+
+likely::FunctionMinimumPtr local::CorrelationFitter::_addProfiledParameters(
+likely::FunctionMinimumCPtr fmin) const {
+    LinearProfile &lp = *_profile;
+    int nlin = lp.index.size();
+    likely::FitParameters params(fmin->getFitParameters());
+    likely::Parameters values;
+    likely::getFitParameterValues(params,values);
+    // Find the profiled parameter values at the minimum and their covariance for fixed values
+    // of the other parameters, which is the inverse of the Fisher matrix scaled by the
+    // chi-square normalization used by operator().
+    _profileParameters(values);
+    std::vector<double> solution(lp.solution), cov(nlin*nlin,0);
+    for(int k = 0; k < nlin; ++k) {
+        cov[k*nlin+k] = _errorScale/_icovScale;
+        profile::choleskySolve(lp.fisher,nlin,&cov[k*nlin]);
+    }
+    // Find the floating parameters used by the minimizer.
+    std::vector<int> other;
+    for(int j = 0; j < params.size(); ++j) {
+        if(params[j].isFloating()) other.push_back(j);
+    }
+    int nother = other.size();
+    likely::CovarianceMatrixCPtr otherCov;
+    if(fmin->hasCovariance()) otherCov = fmin->getCovariance();
+    // Propagate the covariance of the other parameters using the derivatives of the profiled
+    // values with respect to each of them: C(lin) += J.C(other).J^T and C(lin,other) = J.C(other).
+    std::vector<double> jacobian(nlin*nother,0), crossCov(nlin*nother,0);
+    if(otherCov) {
+        likely::Parameters shifted;
+        for(int j = 0; j < nother; ++j) {
+            double step = 0.1*params[other[j]].getError();
+            if(!(step > 0)) continue;
+            shifted = values;
+            shifted[other[j]] += step;
+            _profileParameters(shifted);
+            std::vector<double> plus(lp.solution);
+            shifted[other[j]] -= 2*step;
+            _profileParameters(shifted);
+            for(int k = 0; k < nlin; ++k) jacobian[k*nother+j] = (plus[k] - lp.solution[k])/(2*step);
+        }
+        for(int k = 0; k < nlin; ++k) {
+            for(int j = 0; j < nother; ++j) {
+                double sum(0);
+                for(int m = 0; m < nother; ++m) sum += jacobian[k*nother+m]*otherCov->getCovariance(m,j);
+                crossCov[k*nother+j] = sum;
+            }
+        }
+        for(int k1 = 0; k1 < nlin; ++k1) {
+            for(int k2 = 0; k2 < nlin; ++k2) {
+                double sum(0);
+                for(int j = 0; j < nother; ++j) sum += crossCov[k1*nother+j]*jacobian[k2*nother+j];
+                cov[k1*nlin+k2] += sum;
+            }
+        }
+    }
+    // Release the profiled parameters at their values for this minimum.
+    std::vector<int> position(params.size(),-1);
+    for(int k = 0; k < nlin; ++k) {
+        likely::FitParameter &param = params[lp.index[k]];
+        likely::modifyFitParameters(params,"release[" + param.getName() + "]");
+        param.setValue(solution[k]);
+        param.setError(std::sqrt(cov[k*nlin+k]));
+        position[lp.index[k]] = k;
+    }
+    likely::FunctionMinimumPtr result;
+    if(!otherCov) {
+        result.reset(new likely::FunctionMinimum(fmin->getMinValue(),params));
+        result->setStatus(fmin->getStatus(),fmin->getStatusMessage());
+        return result;
+    }
+    // Build the covariance of all floating parameters, in parameter order.
+    std::vector<int> floating;
+    for(int j = 0; j < params.size(); ++j) {
+        if(params[j].isFloating()) floating.push_back(j);
+    }
+    std::vector<int> otherPosition(params.size(),-1);
+    for(int j = 0; j < nother; ++j) otherPosition[other[j]] = j;
+    likely::CovarianceMatrixPtr fullCov(new likely::CovarianceMatrix(floating.size()));
+    for(int row = 0; row < floating.size(); ++row) {
+        for(int col = 0; col <= row; ++col) {
+            int k1(position[floating[row]]), k2(position[floating[col]]);
+            int j1(otherPosition[floating[row]]), j2(otherPosition[floating[col]]);
+            double value;
+            if(k1 >= 0 && k2 >= 0) value = cov[k1*nlin+k2];
+            else if(k1 >= 0) value = crossCov[k1*nother+j2];
+            else if(k2 >= 0) value = crossCov[k2*nother+j1];
+            else value = otherCov->getCovariance(j1,j2);
+            fullCov->setCovariance(row,col,value);
+        }
+    }
+    result.reset(new likely::FunctionMinimum(fmin->getMinValue(),params,fullCov));
+    result->setStatus(fmin->getStatus(),fmin->getStatusMessage());
+    return result;
 }
 
 likely::FunctionMinimumPtr local::CorrelationFitter::guess() const {
@@ -113,6 +555,7 @@ std::vector<double> &samples) const {
     // update it (but we will ignore the updates).
     likely::FunctionMinimumPtr fmin(new likely::FunctionMinimum(*fminStart));
     likely::FitParameters params(fmin->getFitParameters());
+    _model->checkFitParameters(params);
     int npar(params.size());
     samples.reserve(nchain*npar);
     samples.resize(0);
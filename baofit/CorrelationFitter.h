@@ -4,9 +4,12 @@
 #define BAOFIT_CORRELATION_FITTER
 
 #include "baofit/AbsCorrelationData.h"
+#include "baofit/AbsCorrelationModel.h"
 #include "baofit/types.h"
 #include "likely/types.h"
 
+#include "boost/smart_ptr.hpp"
+
 #include <vector>
 
 namespace baofit {
@@ -19,6 +22,24 @@ namespace baofit {
 		// Changes the error scale definition. The default value of 1 corresponds to the
 		// usual 1-sigma errors.
         void setErrorScale(double scale);
+        // Enables analytic profiling of linear parameters in fit(). When enabled, any floating
+        // parameters that the model prediction depends on linearly (e.g., additive broadband
+        // coefficients) are solved for in closed form by generalized least squares at each
+        // chi-square evaluation, and only the remaining floating parameters are passed to the
+        // minimizer. Linearity is tested numerically at the start of each fit, using steps equal
+        // to each parameter's initial error. Parameters with priors (including box priors used as
+        // bounds) are never profiled. Derivatives with respect to profiled parameters are taken
+        // from the model's analytic derivatives where it provides them. The function minimum
+        // returned includes the profiled parameters, with errors and correlations that account
+        // for their dependence on the other parameters.
+        void setProfileLinear(bool value);
+        // Provides fit() with the gradient of the chi-square. Derivatives of the model prediction are
+        // calculated analytically where the model provides them, and otherwise using central
+        // differences with steps of 1% of each parameter's initial error. Any finite differences
+        // are split between the workers provided, which should be configured identically to our
+        // model (including the coordinates of any distortion matrix), using one thread per worker.
+        void setGradient(bool value,
+            std::vector<AbsCorrelationModelPtr> const &workers = std::vector<AbsCorrelationModelPtr>());
         // Fills the vector provided with the model prediction for the specified parameter values.
         void getPrediction(likely::Parameters const &params, std::vector<double> &prediction) const;
         // Returns chiSquare/2 for the specified model parameter values.
@@ -37,10 +58,35 @@ namespace baofit {
         void mcmc(likely::FunctionMinimumCPtr fmin, int nchain, int interval,
             std::vector<double> &samples) const;
 	private:
+        // The state used to profile linear parameters and calculate gradients, which is shared
+        // with any copies of this object.
+        struct LinearProfile;
+        // Tabulates our data vector and its inverse covariance, if this has not already been done.
+        void _tabulateData() const;
+        // Fills the gradient provided with the derivatives of our chiSquare/2 with respect to
+        // each parameter, which are zero for fixed and profiled parameters.
+        void _evaluateGradient(likely::Parameters const &params, likely::Parameters &gradient) const;
+        // Finds the floating parameters that the prediction depends on linearly, starting from
+        // the specified parameter values.
+        void _findLinearParameters(likely::FitParameters const &params) const;
+        // Replaces the values of the profiled parameters with the values that minimize the
+        // chi-square given the values of all other parameters.
+        void _profileParameters(likely::Parameters &params) const;
+        // Returns chiSquare/2 with the values of any profiled parameters replaced by their
+        // generalized least-squares solution.
+        double _evaluateProfiled(likely::Parameters const &params) const;
+        // Returns a copy of the function minimum found with profiled parameters fixed, where these
+        // parameters are floating at their profiled values, with the corresponding covariance.
+        likely::FunctionMinimumPtr _addProfiledParameters(likely::FunctionMinimumCPtr fmin) const;
         AbsCorrelationData::TransverseBinningType _type;
         AbsCorrelationDataCPtr _data;
         AbsCorrelationModelPtr _model;
         double _errorScale, _icovScale;
+        bool _profileLinear, _gradient;
+        std::vector<AbsCorrelationModelPtr> _gradientWorkers;
+        mutable boost::shared_ptr<LinearProfile> _profile;
+        // Coordinates of each bin with data, for batch evaluation of Coordinate-binned data.
+        AbsCorrelationModel::Coordinates _coords;
 	}; // CorrelationFitter
 } // baofit
 
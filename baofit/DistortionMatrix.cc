@@ -2,84 +2,339 @@
 
 #include "baofit/DistortionMatrix.h"
 #include "baofit/RuntimeError.h"
+#include "baofit/TextTableReader.h"
 
 #include "boost/lexical_cast.hpp"
-#include "boost/algorithm/string.hpp"
-#include "boost/spirit/include/qi.hpp"
-#include "boost/spirit/include/phoenix_core.hpp"
-#include "boost/spirit/include/phoenix_operator.hpp"
-#include "boost/spirit/include/phoenix_stl.hpp"
+#include "boost/interprocess/file_mapping.hpp"
+#include "boost/interprocess/mapped_region.hpp"
+#include "boost/cstdint.hpp"
 
 #include <fstream>
 #include <iostream>
+#include <algorithm>
+#include <cstring>
 
-namespace qi = boost::spirit::qi;
-namespace ascii = boost::spirit::ascii;
-namespace phoenix = boost::phoenix;
+#include <sys/stat.h>
 
 namespace local = baofit;
 
-local::DistortionMatrix::DistortionMatrix(std::string const &distMatrixName, int distMatrixOrder, bool verbose)
-: _nbins(distMatrixOrder)
+namespace baofit {
+    // Number of columns of the distortion matrix processed together by applyDistortion,
+    // chosen so that the corresponding block of the undistorted correlation function
+    // stays in the L1 cache while it is applied to every row.
+    const int distortionBlockSize = 512;
+    // Matrices with a smaller fraction of non-zero values than this are stored in CSR format.
+    // Each non-zero CSR value needs 12 bytes (value and column) versus 8 bytes per dense value,
+    // and the sparse kernel has an extra indirection, so we require a comfortable margin.
+    const double sparseDensityThreshold = 0.25;
+    // Returns the dot product of the n-element arrays a and b, accumulated in four
+    // independent partial sums that the compiler can map onto SIMD lanes.
+    inline double blockDotProduct(double const *a, double const *b, int n) {
+        double sum0(0), sum1(0), sum2(0), sum3(0);
+        int i = 0;
+        for(; i + 4 <= n; i += 4) {
+            sum0 += a[i]*b[i];
+            sum1 += a[i+1]*b[i+1];
+            sum2 += a[i+2]*b[i+2];
+            sum3 += a[i+3]*b[i+3];
+        }
+        for(; i < n; ++i) sum0 += a[i]*b[i];
+        return (sum0 + sum1) + (sum2 + sum3);
+    }
+    // Header of our binary file format, which is padded to 32 bytes so that the payload
+    // that follows it is aligned for any element type.
+    struct DistortionMatrixHeader {
+        char magic[8];
+        boost::int32_t version, elementSize;
+        boost::int64_t order;
+        boost::int32_t flags, reserved;
+    };
+    // Header flag indicating that the payload is stored in CSR format.
+    const boost::int32_t distortionMatrixSparseFlag = 1;
+    // Returns the offset of the CSR values in a sparse payload, which follow the row starts and
+    // column indices, padded so that the values are aligned for any element type.
+    std::size_t getSparseValuesOffset(int nbins, std::size_t nonzero) {
+        std::size_t offset = (nbins + 1 + nonzero)*sizeof(boost::int32_t);
+        return (offset + 7)/8*8;
+    }
+    const char distortionMatrixMagic[8] = { 'B','A','O','F','I','T','D','M' };
+    const boost::int32_t distortionMatrixVersion = 1;
+    // Returns true if the specified file exists and stores its modification time.
+    bool getModificationTime(std::string const &filename, time_t &mtime) {
+        struct stat info;
+        if(0 != ::stat(filename.c_str(),&info)) return false;
+        mtime = info.st_mtime;
+        return true;
+    }
+}
+
+local::DistortionMatrix::DistortionMatrix(std::string const &distMatrixName, int distMatrixOrder, bool verbose,
+bool useBinary)
+: _nbins(distMatrixOrder), _distData(0), _rowStartData(0), _csrColumnData(0), _csrValueData(0)
 {
     // Initialize the undistorted correlation function.
     if(_nbins<=0) throw RuntimeError("DistortionMatrix: expected distortion matrix order > 0.");
     _ucf.resize(_nbins,0.);
+    _dcf.resize(_nbins,0.);
     
+    // Use the binary format when it is available, unless the text file has been modified since
+    // the binary file was written.
+    std::string binName = distMatrixName + (".dmat.bin"), textName = distMatrixName + (".dmat");
+    time_t binTime, textTime;
+    bool useBinaryFile = useBinary && getModificationTime(binName,binTime);
+    if(useBinaryFile && getModificationTime(textName,textTime) && textTime > binTime) {
+        std::cout << "WARNING: ignoring " << binName << " since it is older than " << textName << std::endl;
+        useBinaryFile = false;
+    }
+    if(useBinaryFile) {
+        // Mapped files are used in the format they were saved with, which is already sparse when
+        // that saves memory, so that we do not need to scan or copy them here.
+        _mapBinary(binName,verbose);
+    }
+    else {
+        _readText(textName,verbose);
+        _compress(verbose);
+    }
+}
+
+void local::DistortionMatrix::_readText(std::string const &distName, bool verbose) {
     // Initialize the distortion matrix.
     int nbinstot = _nbins*_nbins;
     _dist.resize(nbinstot,0.);
+    _distData = &_dist[0];
     
-    // General stuff needed for reading the file.
-    std::string line;
-    int lines(0),index1,index2;
-    double value;
-    
-    // Import boost spirit parser symbols.
-    using qi::double_;
-    using qi::int_;
-    using qi::_1;
-    using phoenix::ref;
-    using phoenix::push_back;
-    
-    // Loop over lines in the distortion matrix file.
-    std::string distName = distMatrixName + (".dmat");
-    std::ifstream distIn(distName.c_str());
-    if(!distIn.good()) throw RuntimeError("DistortionMatrix: Unable to open " + distName);
-    while(std::getline(distIn,line)) {
-        lines++;
-        bool ok = qi::phrase_parse(line.begin(),line.end(),
-            (
-                int_[ref(index1) = _1] >> int_[ref(index2) = _1] >> double_[ref(value) = _1]
-            ),
-            ascii::space);
-        if(!ok) {
-            throw RuntimeError("DistortionMatrix: error reading line " +
-                boost::lexical_cast<std::string>(lines) + " of " + distName);
-        }
+    // Read and parse the distortion matrix file.
+    TextTableReader reader(distName,2,1,"DistortionMatrix",0);
+    int lines = reader.getNLines();
+    for(int line = 0; line < lines; ++line) {
+        int index1 = reader.getInt(line,0), index2 = reader.getInt(line,1);
         // Check for invalid indices.
         if(index1 < 0 || index2 < 0 || index1 >= _nbins || index2 >= _nbins) {
             throw RuntimeError("DistortionMatrix: invalid indices on line " +
-                boost::lexical_cast<std::string>(lines) + " of " + distName);
+                boost::lexical_cast<std::string>(line+1) + " of " + distName);
         }
         int index = index1*_nbins + index2;
-        _dist[index] = value;
+        _dist[index] = reader.getFloat(line,0);
     }
-    distIn.close();
     if(verbose) {
         std::cout << "Read " << lines << " of " << nbinstot
             << " distortion matrix values from " << distName << std::endl;
     }
 }
 
+void local::DistortionMatrix::_mapBinary(std::string const &binName, bool verbose) {
+    namespace bip = boost::interprocess;
+    try {
+        bip::file_mapping mapping(binName.c_str(),bip::read_only);
+        _region.reset(new bip::mapped_region(mapping,bip::read_only));
+    }
+    catch(bip::interprocess_exception const &e) {
+        throw RuntimeError("DistortionMatrix: Unable to map " + binName + ": " + e.what());
+    }
+    // Validate the header.
+    std::size_t size = _region->get_size();
+    char const *base = static_cast<char const*>(_region->get_address());
+    DistortionMatrixHeader header;
+    if(size < sizeof(header)) {
+        throw RuntimeError("DistortionMatrix: missing header in " + binName);
+    }
+    std::memcpy(&header,base,sizeof(header));
+    if(0 != std::memcmp(header.magic,distortionMatrixMagic,sizeof(header.magic))) {
+        throw RuntimeError("DistortionMatrix: invalid header in " + binName);
+    }
+    if(header.version != distortionMatrixVersion) {
+        throw RuntimeError("DistortionMatrix: unsupported version " +
+            boost::lexical_cast<std::string>(header.version) + " in " + binName);
+    }
+    if(header.order != _nbins) {
+        throw RuntimeError("DistortionMatrix: order " + boost::lexical_cast<std::string>(header.order) +
+            " in " + binName + " does not match expected order " + boost::lexical_cast<std::string>(_nbins));
+    }
+    if(header.elementSize != sizeof(double) && header.elementSize != sizeof(float)) {
+        throw RuntimeError("DistortionMatrix: unsupported element size in " + binName);
+    }
+    if(header.flags & ~distortionMatrixSparseFlag) {
+        throw RuntimeError("DistortionMatrix: unsupported flags in " + binName);
+    }
+    bool sparse = (header.flags & distortionMatrixSparseFlag);
+    std::size_t nbinstot = (std::size_t)_nbins*_nbins;
+    char const *payload = base + sizeof(header);
+    if(sparse) {
+        // Validate the CSR row starts before using them to locate the columns and values.
+        if(size < sizeof(header) + (_nbins+1)*sizeof(boost::int32_t)) {
+            throw RuntimeError("DistortionMatrix: unexpected size of " + binName);
+        }
+        int const *rowStart = reinterpret_cast<int const*>(payload);
+        if(rowStart[0] != 0) {
+            throw RuntimeError("DistortionMatrix: invalid row starts in " + binName);
+        }
+        for(int row = 0; row < _nbins; ++row) {
+            if(rowStart[row] < 0 || rowStart[row+1] < rowStart[row]) {
+                throw RuntimeError("DistortionMatrix: invalid row starts in " + binName);
+            }
+        }
+        std::size_t nonzero = rowStart[_nbins], valuesOffset = getSparseValuesOffset(_nbins,nonzero);
+        if(size != sizeof(header) + valuesOffset + nonzero*header.elementSize) {
+            throw RuntimeError("DistortionMatrix: unexpected size of " + binName);
+        }
+        // Validate the columns, which must be sorted within each row, as when reading a text file.
+        int const *column = rowStart + _nbins + 1;
+        for(int row = 0; row < _nbins; ++row) {
+            for(int k = rowStart[row]; k < rowStart[row+1]; ++k) {
+                if(column[k] < 0 || column[k] >= _nbins || (k > rowStart[row] && column[k] <= column[k-1])) {
+                    throw RuntimeError("DistortionMatrix: invalid column indices in " + binName);
+                }
+            }
+        }
+        _rowStartData = rowStart;
+        _csrColumnData = column;
+        if(header.elementSize == sizeof(double)) {
+            // Use the mapped values directly.
+            _csrValueData = reinterpret_cast<double const*>(payload + valuesOffset);
+        }
+        else {
+            // Convert single-precision values and copy the indices into our own storage,
+            // and release the mapping.
+            float const *values = reinterpret_cast<float const*>(payload + valuesOffset);
+            _csrValue.assign(values,values + nonzero);
+            _rowStart.assign(_rowStartData,_rowStartData + _nbins + 1);
+            _csrColumn.assign(_csrColumnData,_csrColumnData + nonzero);
+            _useCsrVectors();
+            _region.reset();
+        }
+        if(verbose) {
+            std::cout << "Mapped sparse distortion matrix with " << nonzero << " non-zero values ("
+                << (header.elementSize == sizeof(double) ? "float64" : "float32")
+                << ") from " << binName << std::endl;
+        }
+        return;
+    }
+    if(size != sizeof(header) + nbinstot*header.elementSize) {
+        throw RuntimeError("DistortionMatrix: unexpected size of " + binName);
+    }
+    if(header.elementSize == sizeof(double)) {
+        // Use the mapped values directly.
+        _distData = reinterpret_cast<double const*>(payload);
+    }
+    else {
+        // Convert single-precision values into our own storage, and release the mapping.
+        float const *values = reinterpret_cast<float const*>(payload);
+        _dist.assign(values,values + nbinstot);
+        _distData = &_dist[0];
+        _region.reset();
+    }
+    if(verbose) {
+        std::cout << "Mapped " << nbinstot << " distortion matrix values ("
+            << (header.elementSize == sizeof(double) ? "float64" : "float32")
+            << ") from " << binName << std::endl;
+    }
+}
+
+void local::DistortionMatrix::_useCsrVectors() {
+    _rowStartData = &_rowStart[0];
+    _csrColumnData = _csrColumn.empty() ? 0 : &_csrColumn[0];
+    _csrValueData = _csrValue.empty() ? 0 : &_csrValue[0];
+}
+
+void local::DistortionMatrix::_compress(bool verbose) {
+    // Count the non-zero values.
+    std::size_t nbinstot = (std::size_t)_nbins*_nbins;
+    std::size_t nonzero = nbinstot - std::count(_distData,_distData + nbinstot,0.);
+    if(0 == nonzero || nonzero >= sparseDensityThreshold*nbinstot) return;
+    // Build the CSR representation.
+    _rowStart.reserve(_nbins+1);
+    _csrColumn.reserve(nonzero);
+    _csrValue.reserve(nonzero);
+    _rowStart.push_back(0);
+    for(int row = 0; row < _nbins; ++row) {
+        double const *rowData = _distData + (std::size_t)row*_nbins;
+        for(int col = 0; col < _nbins; ++col) {
+            if(0 == rowData[col]) continue;
+            _csrColumn.push_back(col);
+            _csrValue.push_back(rowData[col]);
+        }
+        _rowStart.push_back(_csrValue.size());
+    }
+    _useCsrVectors();
+    // Release the dense values.
+    std::vector<double>().swap(_dist);
+    _distData = 0;
+    if(verbose) {
+        std::cout << "Using sparse distortion matrix with " << nonzero << " non-zero values ("
+            << 100.*nonzero/nbinstot << "%)" << std::endl;
+    }
+}
+
+void local::DistortionMatrix::_getRow(int row, double *values) const {
+    if(isSparse()) {
+        std::fill(values,values + _nbins,0.);
+        for(int k = _rowStartData[row]; k < _rowStartData[row+1]; ++k) values[_csrColumnData[k]] = _csrValueData[k];
+    }
+    else {
+        std::copy(_distData + (std::size_t)row*_nbins,_distData + (std::size_t)(row+1)*_nbins,values);
+    }
+}
+
 local::DistortionMatrix::~DistortionMatrix() { }
 
 double local::DistortionMatrix::getDistortion(int index1, int index2) const {
     if(index1 < 0 || index2 < 0 || index1 >= _nbins || index2 >= _nbins) {
         throw RuntimeError("DistortionMatrix::getDistortion: invalid indices.");
     }
+    if(isSparse()) {
+        // Look up the column in this row's sorted column indices.
+        int const *begin(_csrColumnData + _rowStartData[index1]), *end(_csrColumnData + _rowStartData[index1+1]);
+        int const *found = std::lower_bound(begin,end,index2);
+        return (found != end && *found == index2) ? _csrValueData[found - _csrColumnData] : 0;
+    }
     int index = index1*_nbins + index2;
-    return _dist[index];
+    return _distData[index];
+}
+
+void local::DistortionMatrix::saveBinary(std::string const &filename, bool singlePrecision) const {
+    DistortionMatrixHeader header;
+    std::memset(&header,0,sizeof(header));
+    std::memcpy(header.magic,distortionMatrixMagic,sizeof(header.magic));
+    header.version = distortionMatrixVersion;
+    header.elementSize = singlePrecision ? sizeof(float) : sizeof(double);
+    header.order = _nbins;
+    if(isSparse()) header.flags |= distortionMatrixSparseFlag;
+    std::ofstream out(filename.c_str(),std::ios::binary);
+    if(!out.good()) throw RuntimeError("DistortionMatrix::saveBinary: Unable to open " + filename);
+    out.write(reinterpret_cast<char const*>(&header),sizeof(header));
+    if(isSparse()) {
+        // Write the row starts and column indices, padded to align the values that follow.
+        std::size_t nonzero = _rowStartData[_nbins];
+        out.write(reinterpret_cast<char const*>(_rowStartData),(_nbins+1)*sizeof(int));
+        out.write(reinterpret_cast<char const*>(_csrColumnData),nonzero*sizeof(int));
+        std::size_t padding = getSparseValuesOffset(_nbins,nonzero) - (_nbins+1+nonzero)*sizeof(int);
+        char const zeros[8] = { 0 };
+        out.write(zeros,padding);
+        if(singlePrecision) {
+            std::vector<float> valuesSingle(_csrValueData,_csrValueData + nonzero);
+            if(nonzero) out.write(reinterpret_cast<char const*>(&valuesSingle[0]),nonzero*sizeof(float));
+        }
+        else {
+            out.write(reinterpret_cast<char const*>(_csrValueData),nonzero*sizeof(double));
+        }
+    }
+    else {
+        // Write one row at a time.
+        std::vector<double> row(_nbins);
+        std::vector<float> rowSingle(singlePrecision ? _nbins : 0);
+        for(int index = 0; index < _nbins; ++index) {
+            _getRow(index,&row[0]);
+            if(singlePrecision) {
+                std::copy(row.begin(),row.end(),rowSingle.begin());
+                out.write(reinterpret_cast<char const*>(&rowSingle[0]),_nbins*sizeof(float));
+            }
+            else {
+                out.write(reinterpret_cast<char const*>(&row[0]),_nbins*sizeof(double));
+            }
+        }
+    }
+    out.close();
+    if(!out) throw RuntimeError("DistortionMatrix::saveBinary: error writing " + filename);
 }
 
 void local::DistortionMatrix::setCorrelation(int bin, double value) {
@@ -95,3 +350,34 @@ double local::DistortionMatrix::getCorrelation(int bin) const {
     }
     return _ucf[bin];
 }
+
+void local::DistortionMatrix::applyDistortion() {
+    double const *ucf = &_ucf[0];
+    if(isSparse()) {
+        // Sparse matrix-vector product over the non-zero values of each row.
+        int const *rowStart = _rowStartData, *column = _csrColumnData;
+        double const *value = _csrValueData;
+        for(int row = 0; row < _nbins; ++row) {
+            double sum(0);
+            for(int k = rowStart[row]; k < rowStart[row+1]; ++k) sum += value[k]*ucf[column[k]];
+            _dcf[row] = sum;
+        }
+        return;
+    }
+    std::fill(_dcf.begin(),_dcf.end(),0.);
+    double const *dist = _distData;
+    // Loop over blocks of columns, accumulating the contribution of each block to every row.
+    for(int col = 0; col < _nbins; col += distortionBlockSize) {
+        int ncol = std::min(distortionBlockSize,_nbins - col);
+        for(int row = 0; row < _nbins; ++row) {
+            _dcf[row] += blockDotProduct(dist + row*_nbins + col,ucf + col,ncol);
+        }
+    }
+}
+
+double local::DistortionMatrix::getDistortedCorrelation(int bin) const {
+    if(bin < 0 || bin >= _nbins) {
+        throw RuntimeError("DistortionMatrix::getDistortedCorrelation: invalid index.");
+    }
+    return _dcf[bin];
+}
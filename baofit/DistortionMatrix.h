@@ -5,27 +5,82 @@
 
 #include "likely/types.h"
 
+#include "boost/smart_ptr.hpp"
+
+#include <string>
 #include <vector>
 
+namespace boost { namespace interprocess { class mapped_region; } }
+
 namespace baofit {
 	// Represents a distortion matrix that models the continuum fitting broadband distortion
 	class DistortionMatrix {
 	public:
-	    // Creates a distortion matrix based on values read from file. Missing entries
-	    // are assigned the value zero.
-	    DistortionMatrix(std::string const &distMatrixName, int distMatrixOrder, bool verbose = false);
+	    // Creates a distortion matrix based on values read from file. If useBinary is set and
+	    // <name>.dmat.bin exists and is not older than <name>.dmat, it is memory mapped (see
+	    // saveBinary below) and used in the (dense or CSR) format it was saved with. Otherwise,
+	    // values are read from the text triplets "index1 index2 value" in <name>.dmat, missing
+	    // entries are assigned the value zero, and the matrix is converted to a compressed
+	    // sparse row (CSR) representation if enough of its entries are zero.
+	    DistortionMatrix(std::string const &distMatrixName, int distMatrixOrder, bool verbose = false,
+	        bool useBinary = true);
 	    virtual ~DistortionMatrix();
+	    // Saves this distortion matrix to the specified file in our binary format: a 32-byte
+	    // header (the magic string "BAOFITDM", an int32 version, an int32 element size in bytes,
+	    // an int64 order, int32 flags and 4 reserved bytes) followed by the matrix elements in
+	    // native byte order, stored as float32 if singlePrecision is set, or else float64.
+	    // Dense matrices are stored as row-major elements. Sparse matrices set flag 1 and are
+	    // stored in CSR format: int32 row starts[order+1], int32 column indices, zero padding
+	    // to a multiple of 8 bytes, then the non-zero elements. Float64 files are mapped
+	    // directly without copying, so that concurrent fits on the same node share the same
+	    // physical pages.
+	    void saveBinary(std::string const &filename, bool singlePrecision = false) const;
+	    // Returns the order of this distortion matrix.
+	    int getOrder() const;
+	    // Returns true if this matrix is stored in compressed sparse row format.
+	    bool isSparse() const;
 	    // Returns the value of the distortion matrix for the specified indices.
 	    double getDistortion(int index1, int index2) const;
 	    // Sets the value of the undistorted correlation function for the specified bin.
 	    void setCorrelation(int bin, double value);
 	    // Returns the value of the undistorted correlation function for the specified bin.
 	    double getCorrelation(int bin) const;
+	    // Multiplies the undistorted correlation function by the distortion matrix and
+	    // caches the result. Call this once after setting the correlation of every bin.
+	    void applyDistortion();
+	    // Returns the value of the distorted correlation function for the specified bin,
+	    // as calculated by the most recent call to applyDistortion().
+	    double getDistortedCorrelation(int bin) const;
 	protected:
 	private:
+	    // Reads our values from the specified text file.
+	    void _readText(std::string const &distName, bool verbose);
+	    // Maps our values from the specified binary file.
+	    void _mapBinary(std::string const &binName, bool verbose);
+	    // Converts our dense values to CSR format and releases them, if our fraction of
+	    // non-zero values is small enough for this to save memory and time.
+	    void _compress(bool verbose);
+	    // Points our CSR data at the _rowStart, _csrColumn and _csrValue vectors.
+	    void _useCsrVectors();
+	    // Fills the specified row of the dense matrix, with _nbins elements.
+	    void _getRow(int row, double *values) const;
 	    int _nbins;
-	    std::vector<double> _ucf, _dist;
+	    std::vector<double> _ucf, _dcf, _dist;
+	    // Points to the row-major matrix elements, either in _dist or in _region, or is
+	    // zero when we are sparse.
+	    double const *_distData;
+	    boost::shared_ptr<boost::interprocess::mapped_region> _region;
+	    // CSR representation: the non-zero values and column indices of row i are stored
+	    // at offsets [_rowStartData[i],_rowStartData[i+1]) of _csrValueData and _csrColumnData,
+	    // which point either into the vectors below or into _region.
+	    int const *_rowStartData, *_csrColumnData;
+	    double const *_csrValueData;
+	    std::vector<int> _rowStart, _csrColumn;
+	    std::vector<double> _csrValue;
     }; // DistortionMatrix
+    
+    inline int DistortionMatrix::getOrder() const { return _nbins; }
+    inline bool DistortionMatrix::isSparse() const { return 0 == _distData; }
 } // baofit
 
 #endif // BAOFIT_BAO_DISTORTION_MATRIX
@@ -2,6 +2,7 @@
 
 #include "baofit/MetalCorrelationModel.h"
 #include "baofit/RuntimeError.h"
+#include "baofit/TextTableReader.h"
 
 #include "likely/BiCubicInterpolator.h"
 #include "likely/RuntimeError.h"
@@ -9,18 +10,12 @@
 #include "boost/format.hpp"
 #include "boost/lexical_cast.hpp"
 #include "boost/algorithm/string.hpp"
-#include "boost/spirit/include/qi.hpp"
-#include "boost/spirit/include/phoenix_core.hpp"
-#include "boost/spirit/include/phoenix_operator.hpp"
-#include "boost/spirit/include/phoenix_stl.hpp"
 
 #include <fstream>
 #include <iostream>
 #include <cmath>
-
-namespace qi = boost::spirit::qi;
-namespace ascii = boost::spirit::ascii;
-namespace phoenix = boost::phoenix;
+#include <algorithm>
+#include <limits>
 
 namespace local = baofit;
 
@@ -56,6 +51,7 @@ _metalCIV(metalCIV), _toyMetal(toyMetal), _crossCorrelation(crossCorrelation), _
         boost::format gridName("%s%s%s.grid");
         std::vector<double> metaldata, griddata;
         _lastLines = -1;
+        _nbins = 0;
         if(metalModel && !crossCorrelation) {
             _nmet = 5;
             _ncomb = 14;
@@ -65,15 +61,15 @@ _metalCIV(metalCIV), _toyMetal(toyMetal), _crossCorrelation(crossCorrelation), _
             int metalindex2 [14] = {1,2,3,4,1,2,3,2,3,3,1,2,3,4};
             for(int i = 0; i < _ncomb; ++i) {
                 _initialize(metaldata,boost::str(fileName % metalModelName % metallist1[i] % metallist2[i] % 0));
-                _metaltemplates.push_back(metaldata);
+                _templates.insert(_templates.end(),metaldata.begin(),metaldata.end());
                 _initialize(metaldata,boost::str(fileName % metalModelName % metallist1[i] % metallist2[i] % 2));
-                _metaltemplates.push_back(metaldata);
+                _templates.insert(_templates.end(),metaldata.begin(),metaldata.end());
                 _initialize(metaldata,boost::str(fileName % metalModelName % metallist1[i] % metallist2[i] % 4));
-                _metaltemplates.push_back(metaldata);
+                _templates.insert(_templates.end(),metaldata.begin(),metaldata.end());
                 _paramindex1.push_back(metalindex1[i]);
                 _paramindex2.push_back(metalindex2[i]);
                 _initializeGrid(griddata,boost::str(gridName % metalModelName % metallist1[i] % metallist2[i]));
-                _zgrid.push_back(griddata);
+                _zgrid.insert(_zgrid.end(),griddata.begin(),griddata.end());
             }
             
             if(metalCIV) {
@@ -86,15 +82,15 @@ _metalCIV(metalCIV), _toyMetal(toyMetal), _crossCorrelation(crossCorrelation), _
                 int civindex2 [6] = {5,5,5,5,5,5};
                 for(int i = 0; i < nciv; ++i) {
                     _initialize(metaldata,boost::str(fileName % metalModelName % civlist1[i] % civlist2[i] % 0));
-                    _metaltemplates.push_back(metaldata);
+                    _templates.insert(_templates.end(),metaldata.begin(),metaldata.end());
                     _initialize(metaldata,boost::str(fileName % metalModelName % civlist1[i] % civlist2[i] % 2));
-                    _metaltemplates.push_back(metaldata);
+                    _templates.insert(_templates.end(),metaldata.begin(),metaldata.end());
                     _initialize(metaldata,boost::str(fileName % metalModelName % civlist1[i] % civlist2[i] % 4));
-                    _metaltemplates.push_back(metaldata);
+                    _templates.insert(_templates.end(),metaldata.begin(),metaldata.end());
                     _paramindex1.push_back(civindex1[i]);
                     _paramindex2.push_back(civindex2[i]);
                     _initializeGrid(griddata,boost::str(gridName % metalModelName % civlist1[i] % civlist2[i]));
-                    _zgrid.push_back(griddata);
+                    _zgrid.insert(_zgrid.end(),griddata.begin(),griddata.end());
                 }
             }
         }
@@ -113,7 +109,7 @@ _metalCIV(metalCIV), _toyMetal(toyMetal), _crossCorrelation(crossCorrelation), _
                     _paramindex1.push_back(qsometalindex1[i]);
                     _paramindex2.push_back(qsometalindex2[i]);
                     _initializeGrid(griddata,boost::str(gridName % metalModelName % qsometallist1[i] % qsometallist2[i]));
-                    _zgrid.push_back(griddata);
+                    _zgrid.insert(_zgrid.end(),griddata.begin(),griddata.end());
                 }
             }
             catch(likely::RuntimeError const &e) {
@@ -140,7 +136,7 @@ _metalCIV(metalCIV), _toyMetal(toyMetal), _crossCorrelation(crossCorrelation), _
                         _paramindex1.push_back(qsocivindex1[i]);
                         _paramindex2.push_back(qsocivindex2[i]);
                         _initializeGrid(griddata,boost::str(gridName % metalModelName % qsocivlist1[i] % qsocivlist2[i]));
-                        _zgrid.push_back(griddata);
+                        _zgrid.insert(_zgrid.end(),griddata.begin(),griddata.end());
                     }
                 }
                 catch(likely::RuntimeError const &e) {
@@ -148,6 +144,7 @@ _metalCIV(metalCIV), _toyMetal(toyMetal), _crossCorrelation(crossCorrelation), _
                 }
             }
         }
+        _nbins = _lastLines;
     }
     // Initialize toy metal correlation model.
     else if(toyMetal) {
@@ -161,141 +158,156 @@ _metalCIV(metalCIV), _toyMetal(toyMetal), _crossCorrelation(crossCorrelation), _
 }
 
 void local::MetalCorrelationModel::_initialize(std::vector<double> &vector, std::string const &filename) {
-    // General stuff needed for reading the file.
-    std::string line;
-    int lines(0), index;
-    double corr;
-    vector.resize(0);
-    
-    // Import boost spirit parser symbols.
-    using qi::double_;
-    using qi::int_;
-    using qi::_1;
-    using phoenix::ref;
-    using phoenix::push_back;
-    
-    // Loop over lines in the metal correlation file.
-    std::ifstream metalIn(filename.c_str());
-    if(!metalIn.good()) throw RuntimeError("MetalCorrelationModel: Unable to open " + filename);
-    while(std::getline(metalIn,line)) {
-        lines++;
-        bool ok = qi::phrase_parse(line.begin(),line.end(),
-            (
-                int_[ref(index) = _1] >> double_[ref(corr) = _1]
-            ),
-            ascii::space);
-        if(!ok) {
-            throw RuntimeError("MetalCorrelationModel: error reading line " +
-                boost::lexical_cast<std::string>(lines) + " of " + filename);
-        }
-        vector.push_back(corr);
-    }
-    metalIn.close();
+    // Read the correlation values from the metal correlation file.
+    TextTableReader metalIn(filename,1,1,"MetalCorrelationModel",0);
+    int lines = metalIn.getNLines();
+    vector.resize(lines);
+    for(int line = 0; line < lines; ++line) vector[line] = metalIn.getFloat(line,0);
     if(_lastLines>=0 && _lastLines != lines) throw RuntimeError("MetalCorrelationModel: deviating number of lines in " + filename);
     _lastLines = lines;
 }
 
 void local::MetalCorrelationModel::_initializeGrid(std::vector<double> &vector, std::string const &filename) {
-    // General stuff needed for reading the file.
-    std::string line;
-    int lines(0), index;
-    double rpar, rperp, z;
-    vector.resize(0);
-    
-    // Import boost spirit parser symbols.
-    using qi::double_;
-    using qi::int_;
-    using qi::_1;
-    using phoenix::ref;
-    using phoenix::push_back;
-    
-    // Loop over lines in the coordinate grid file.
-    std::ifstream gridIn(filename.c_str());
-    if(!gridIn.good()) throw RuntimeError("MetalCorrelationModel: Unable to open " + filename);
-    while(std::getline(gridIn,line)) {
-        lines++;
-        bool ok = qi::phrase_parse(line.begin(),line.end(),
-            (
-                int_[ref(index) = _1] >> double_[ref(rpar) = _1] >> double_[ref(rperp) = _1] >> double_[ref(z) = _1]
-            ),
-            ascii::space);
-        if(!ok) {
-            throw RuntimeError("MetalCorrelationModel: error reading line " +
-                boost::lexical_cast<std::string>(lines) + " of " + filename);
-        }
-        vector.push_back(z);
-    }
-    gridIn.close();
+    // Read the redshift values from the coordinate grid file, whose columns are index rpar rperp z.
+    TextTableReader gridIn(filename,1,3,"MetalCorrelationModel",0);
+    int lines = gridIn.getNLines();
+    vector.resize(lines);
+    for(int line = 0; line < lines; ++line) vector[line] = gridIn.getFloat(line,2);
     if(_lastLines>=0 && _lastLines != lines) throw RuntimeError("MetalCorrelationModel: deviating number of lines in " + filename);
     _lastLines = lines;
 }
 
 local::MetalCorrelationModel::~MetalCorrelationModel() { }
 
+void local::MetalCorrelationModel::_updateCoefficients() const {
+    // Look up the bias and beta of each tracer, where tracer 0 is Lya (or quasars for a
+    // cross correlation) and metal i > 0 uses parameters _indexBase+2*(i-1) for beta and
+    // _indexBase+2*(i-1)+1 for bias.
+    _tracerBeta.resize(_nmet);
+    _tracerBias.resize(_nmet);
+    _tracerBeta[0] = _crossCorrelation ? _base._getBeta2() : _base._getBeta();
+    _tracerBias[0] = _crossCorrelation ? _base._getBias2() : _base._getBias();
+    for(int i = 1; i < _nmet; ++i) {
+        _tracerBeta[i] = _base.getParameterValue(_indexBase+2*(i-1));
+        _tracerBias[i] = _base.getParameterValue(_indexBase+2*(i-1)+1);
+    }
+    // Calculate the coefficients biasSq, biasSq*betaAvg, biasSq*betaProd of each combination.
+    _coefsChanged = _coefs.empty();
+    _coefs.resize(3*_ncomb);
+    for(int comb = 0; comb < _ncomb; ++comb) {
+        int i1(_paramindex1[comb]), i2(_paramindex2[comb]);
+        double biasSq = _tracerBias[i1]*_tracerBias[i2];
+        double coefs[] = { biasSq, biasSq*0.5*(_tracerBeta[i1] + _tracerBeta[i2]),
+            biasSq*_tracerBeta[i1]*_tracerBeta[i2] };
+        for(int term = 0; term < 3; ++term) {
+            if(_coefs[3*comb+term] != coefs[term]) _coefsChanged = true;
+            _coefs[3*comb+term] = coefs[term];
+        }
+    }
+}
+
+void local::MetalCorrelationModel::_updateEvolution() const {
+    double gammaBias = _base._getGammaBias(), gammaBeta = _base._getGammaBeta();
+    _evolutionChanged = _evolBias.empty() || gammaBias != _evolGammaBias || gammaBeta != _evolGammaBeta;
+    if(!_evolutionChanged) return;
+    _evolGammaBias = gammaBias;
+    _evolGammaBeta = gammaBeta;
+    // Calculate log((1+z)/(1+zref)) for each combination and bin the first time.
+    int nz = _ncomb*_nbins;
+    if(_logz.empty()) {
+        double zref = _base._getZRef();
+        _logz.resize(nz);
+        for(int k = 0; k < nz; ++k) _logz[k] = std::log((1+_zgrid[k])/(1+zref));
+    }
+    _evolBias.resize(nz);
+    _evolBeta.resize(nz);
+    for(int k = 0; k < nz; ++k) {
+        _evolBias[k] = std::exp(gammaBias*_logz[k]);
+        _evolBeta[k] = std::exp(gammaBeta*_logz[k]);
+    }
+}
+
+double const *local::MetalCorrelationModel::_getInterpolatedTemplates(double r, double mu, int index) const {
+    double rperp = std::min(_rperpMax,std::max(_rperpMin,r*std::sqrt(1-mu*mu)));
+    double rpar = std::min(_rparMax,std::max(_rparMin,r*mu));
+    int nt = 3*_ncomb;
+    if(_interpolated.empty()) {
+        _interpolated.resize(_nbins*nt);
+        _interpolatedAt.resize(2*_nbins,std::numeric_limits<double>::quiet_NaN());
+    }
+    double *templates = &_interpolated[index*nt];
+    // Interpolate the templates again only when this bin has moved, e.g., after a change of delta-v.
+    if(rperp != _interpolatedAt[2*index] || rpar != _interpolatedAt[2*index+1]) {
+        for(int k = 0; k < nt; ++k) templates[k] = (*_metalintertemplates[k])(rperp,rpar);
+        _interpolatedAt[2*index] = rperp;
+        _interpolatedAt[2*index+1] = rpar;
+    }
+    return templates;
+}
+
+void local::MetalCorrelationModel::_updateBasis() const {
+    _updateEvolution();
+    _basisChanged = _basis.empty() || _evolutionChanged;
+    if(!_basisChanged) return;
+    int nz = _ncomb*_nbins;
+    // Expanding the multipole normalization factors of each combination in powers of its
+    // betaAvg and betaProd, the templates multiplied by each coefficient are:
+    //   biasSq: (Eb) T0
+    //   biasSq*betaAvg: (Eb E) (2/3 T0 + 4/3 T2)
+    //   biasSq*betaProd: (Eb E^2) (1/5 T0 + 4/7 T2 + 8/35 T4)
+    // where Eb = ((1+z)/(1+zref))^gammaBias and E = ((1+z)/(1+zref))^gammaBeta.
+    _basis.resize(3*nz);
+    for(int comb = 0; comb < _ncomb; ++comb) {
+        double const *T0 = &_templates[(3*comb)*_nbins];
+        double const *T2 = T0 + _nbins, *T4 = T2 + _nbins;
+        double const *evolBiasRow = &_evolBias[comb*_nbins], *evolBetaRow = &_evolBeta[comb*_nbins];
+        for(int bin = 0; bin < _nbins; ++bin) {
+            double evolBias = evolBiasRow[bin], evolBeta = evolBetaRow[bin];
+            double *basis = &_basis[3*(bin*_ncomb + comb)];
+            basis[0] = evolBias*T0[bin];
+            basis[1] = evolBias*evolBeta*((2./3.)*T0[bin] + (4./3.)*T2[bin]);
+            basis[2] = evolBias*evolBeta*evolBeta*((1./5.)*T0[bin] + (4./7.)*T2[bin] + (8./35.)*T4[bin]);
+        }
+    }
+}
+
 double local::MetalCorrelationModel::_evaluate(double r, double mu, double z, bool anyChanged, int index) const {
     double xi(0);
     // Metal correlation model.
     if(_metalModel && !_crossCorrelation) {
-        if(index<0) throw RuntimeError("MetalCorrelationModel::_evaluate: invalid index.");
-        double biasSq, betaAvg, betaProd, norm0(0), norm2(0), norm4(0);
-        double zref = _base._getZRef();
-        double gammaBias = _base._getGammaBias();
-        double gammaBeta = _base._getGammaBeta();
-        std::vector<double> betaparams, biasparams;
-        for(int i = 0; i < _nmet; ++i) {
-            if(i==0) {
-                betaparams.push_back(_base._getBeta());
-                biasparams.push_back(_base._getBias());
-            }
-            else {
-                betaparams.push_back(_base.getParameterValue(_indexBase+2*(i-1)));
-                biasparams.push_back(_base.getParameterValue(_indexBase+2*(i-1)+1));
+        if(index<0 || index>=_nbins) throw RuntimeError("MetalCorrelationModel::_evaluate: invalid index.");
+        // Recalculate the metal correlation of every bin, which is a matrix-vector product of our
+        // basis with our coefficients, only after changes to the parameters they depend on.
+        if(anyChanged || _xi.empty()) {
+            _updateCoefficients();
+            _updateBasis();
+            if(_coefsChanged || _basisChanged || _xi.empty()) {
+                int nc = 3*_ncomb;
+                _xi.resize(_nbins);
+                double const *coefs = &_coefs[0];
+                for(int bin = 0; bin < _nbins; ++bin) {
+                    double const *basis = &_basis[bin*nc];
+                    double sum(0);
+                    for(int k = 0; k < nc; ++k) sum += coefs[k]*basis[k];
+                    _xi[bin] = sum;
+                }
             }
         }
-        for(int i = 0; i < _ncomb; ++i) {
-            biasSq = biasparams[_paramindex1[i]]*biasparams[_paramindex2[i]];
-            betaAvg = 0.5*(betaparams[_paramindex1[i]]+betaparams[_paramindex2[i]]);
-            betaProd = betaparams[_paramindex1[i]]*betaparams[_paramindex2[i]];
-            biasSq = redshiftEvolution(biasSq,gammaBias,_zgrid[i][index],zref);
-            betaAvg = redshiftEvolution(betaAvg,gammaBeta,_zgrid[i][index],zref);
-            betaProd = redshiftEvolution(betaProd,2*gammaBeta,_zgrid[i][index],zref);
-            updateNormFactors(norm0,norm2,norm4,biasSq,betaAvg,betaProd);
-            xi += norm0*_metaltemplates[3*i][index] + norm2*_metaltemplates[3*i+1][index] + norm4*_metaltemplates[3*i+2][index];
-        }
-        return xi;
+        return _xi[index];
     }
     // Metal correlation model (cross-correlation).
     if(_metalModelInterpolate && _crossCorrelation) {
-        double rperp = r*std::sqrt(1-mu*mu);
-        double rpar = r*mu;
-        if(rperp<_rperpMin) rperp = _rperpMin;
-        if(rperp>_rperpMax) rperp = _rperpMax;
-        if(rpar<_rparMin) rpar = _rparMin;
-        if(rpar>_rparMax) rpar = _rparMax;
-        double biasSq, betaAvg, betaProd, norm0(0), norm2(0), norm4(0);
-        double zref = _base._getZRef();
-        double gammaBias = _base._getGammaBias();
-        double gammaBeta = _base._getGammaBeta();
-        std::vector<double> betaparams, biasparams;
-        for(int i = 0; i < _nmet; ++i) {
-            if(i==0) {
-                betaparams.push_back(_base._getBeta2());
-                biasparams.push_back(_base._getBias2());
-            }
-            else {
-                betaparams.push_back(_base.getParameterValue(_indexBase+2*(i-1)));
-                biasparams.push_back(_base.getParameterValue(_indexBase+2*(i-1)+1));
-            }
+        if(index<0 || index>=_nbins) throw RuntimeError("MetalCorrelationModel::_evaluate: invalid index.");
+        if(anyChanged || _coefs.empty()) {
+            _updateCoefficients();
+            _updateEvolution();
         }
+        double const *templates = _getInterpolatedTemplates(r,mu,index);
         for(int i = 0; i < _ncomb; ++i) {
-            biasSq = biasparams[_paramindex1[i]]*biasparams[_paramindex2[i]];
-            betaAvg = 0.5*(betaparams[_paramindex1[i]]+betaparams[_paramindex2[i]]);
-            betaProd = betaparams[_paramindex1[i]]*betaparams[_paramindex2[i]];
-            biasSq = redshiftEvolution(biasSq,gammaBias,_zgrid[i][index],zref);
-            betaAvg = redshiftEvolution(betaAvg,gammaBeta,_zgrid[i][index],zref);
-            betaProd = redshiftEvolution(betaProd,2*gammaBeta,_zgrid[i][index],zref);
-            updateNormFactors(norm0,norm2,norm4,biasSq,betaAvg,betaProd);
-            xi += norm0*(*_metalintertemplates[3*i])(rperp,rpar) + norm2*(*_metalintertemplates[3*i+1])(rperp,rpar) + norm4*(*_metalintertemplates[3*i+2])(rperp,rpar);
+            double evolBias = _evolBias[i*_nbins+index], evolBeta = _evolBeta[i*_nbins+index];
+            double const *coefs = &_coefs[3*i], *T = &templates[3*i];
+            xi += evolBias*(coefs[0]*T[0] + coefs[1]*evolBeta*((2./3.)*T[0] + (4./3.)*T[1])
+                + coefs[2]*evolBeta*evolBeta*((1./5.)*T[0] + (4./7.)*T[1] + (8./35.)*T[2]));
         }
         return xi;
     }
@@ -350,6 +362,54 @@ double local::MetalCorrelationModel::_evaluate(double r, double mu, double z, bo
     }
 }
 
+void local::MetalCorrelationModel::_evaluateAllJacobian(Coordinates const &coords,
+std::vector<int> const &indices, std::vector<double> &jacobian, std::vector<bool> &analytic) const {
+    bool autoTemplates(_metalModel && !_crossCorrelation), crossTemplates(_metalModelInterpolate && _crossCorrelation);
+    if(!autoTemplates && !crossTemplates) return;
+    // Find the requested parameters that are metal biases, where metal i > 0 uses parameters
+    // _indexBase+2*(i-1) for beta and _indexBase+2*(i-1)+1 for bias.
+    int n = coords.r.size();
+    std::vector<int> column(_nmet,-1);
+    bool any(false);
+    for(int k = 0; k < indices.size(); ++k) {
+        int offset = indices[k] - _indexBase;
+        if(offset < 0 || offset >= 2*(_nmet-1) || offset % 2 != 1) continue;
+        column[1 + offset/2] = k;
+        analytic[k] = any = true;
+        for(int i = 0; i < n; ++i) jacobian[k*n+i] = 0;
+    }
+    if(!any) return;
+    _updateCoefficients();
+    if(autoTemplates) _updateBasis();
+    else _updateEvolution();
+    // Each combination contributes biasSq = bias1*bias2 times a term that does not depend on either bias.
+    for(int i = 0; i < n; ++i) {
+        int index = coords.index[i];
+        if(index < 0 || index >= _nbins) throw RuntimeError("MetalCorrelationModel::_evaluateAllJacobian: invalid index.");
+        double const *templates = crossTemplates ? _getInterpolatedTemplates(coords.r[i],coords.mu[i],index) : 0;
+        for(int comb = 0; comb < _ncomb; ++comb) {
+            int i1(_paramindex1[comb]), i2(_paramindex2[comb]);
+            int k1 = column[i1], k2 = column[i2];
+            if(k1 < 0 && k2 < 0) continue;
+            double betaAvg = 0.5*(_tracerBeta[i1]+_tracerBeta[i2]);
+            double betaProd = _tracerBeta[i1]*_tracerBeta[i2];
+            double term;
+            if(autoTemplates) {
+                double const *basis = &_basis[3*(index*_ncomb + comb)];
+                term = basis[0] + betaAvg*basis[1] + betaProd*basis[2];
+            }
+            else {
+                double evolBias = _evolBias[comb*_nbins+index], evolBeta = _evolBeta[comb*_nbins+index];
+                double const *T = &templates[3*comb];
+                term = evolBias*(T[0] + betaAvg*evolBeta*((2./3.)*T[0] + (4./3.)*T[1])
+                    + betaProd*evolBeta*evolBeta*((1./5.)*T[0] + (4./7.)*T[1] + (8./35.)*T[2]));
+            }
+            if(k1 >= 0) jacobian[k1*n+i] += _tracerBias[i2]*term;
+            if(k2 >= 0) jacobian[k2*n+i] += _tracerBias[i1]*term;
+        }
+    }
+}
+
 double local::MetalCorrelationModel::_evaluateKSpace(double k, double mu_k, double pk, double z) const { return 0; }
 
 int local::MetalCorrelationModel::_getIndexBase() const { return _indexBase; }
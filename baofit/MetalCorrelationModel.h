@@ -32,13 +32,42 @@ namespace baofit {
 	    virtual double _evaluate(double r, double mu, double z, bool anyChanged, int index) const;
 	    virtual double _evaluateKSpace(double k, double mu_k, double pk, double z) const;
 	    virtual int _getIndexBase() const;
+	    // Provides the analytic derivatives with respect to each metal bias parameter of
+	    // the template models.
+	    virtual void _evaluateAllJacobian(Coordinates const &coords, std::vector<int> const &indices,
+	        std::vector<double> &jacobian, std::vector<bool> &analytic) const;
 	private:
 	    void _initialize(std::vector<double> &vector, std::string const &filename);
 	    void _initializeGrid(std::vector<double> &vector, std::string const &filename);
-	    std::vector<std::vector<double> > _metaltemplates, _zgrid;
+	    // Updates the bias and beta of each tracer and the coefficients of each combination.
+	    void _updateCoefficients() const;
+	    // Updates the redshift evolution factors of each combination and bin, after a change of gammas.
+	    void _updateEvolution() const;
+	    // Updates the redshift-evolved template combinations of each bin, after a change of gammas.
+	    void _updateBasis() const;
+	    // Returns the interpolated templates of the specified bin at (r,mu), stored as [combination][ell/2]
+	    // and only interpolated again when the clamped (rperp,rpar) of this bin changes.
+	    double const *_getInterpolatedTemplates(double r, double mu, int index) const;
+	    // Templates stored contiguously as [combination][ell/2][bin] and redshifts as [combination][bin].
+	    std::vector<double> _templates, _zgrid;
 	    std::vector<likely::BiCubicInterpolatorPtr> _metalintertemplates;
 	    std::vector<int> _paramindex1, _paramindex2;
-	    int _indexBase, _lastLines, _nmet, _ncomb;
+	    int _indexBase, _lastLines, _nmet, _ncomb, _nbins;
+	    // Bias and beta of each tracer, and the coefficients biasSq, biasSq*betaAvg, biasSq*betaProd
+	    // of each combination stored as [combination][term].
+	    mutable std::vector<double> _tracerBias, _tracerBeta, _coefs;
+	    // Template combinations multiplying each coefficient, including their redshift evolution,
+	    // stored as [bin][combination][term], and log((1+z)/(1+zref)) stored as [combination][bin].
+	    mutable std::vector<double> _basis, _logz;
+	    // Redshift evolution factors ((1+z)/(1+zref))^gamma of each combination stored as [combination][bin].
+	    mutable std::vector<double> _evolBias, _evolBeta;
+	    // Interpolated templates of each bin stored as [bin][combination][ell/2], and the (rperp,rpar)
+	    // of each bin where they were interpolated.
+	    mutable std::vector<double> _interpolated, _interpolatedAt;
+	    // Metal correlation of each bin for the current coefficients and basis.
+	    mutable std::vector<double> _xi;
+	    mutable double _evolGammaBias, _evolGammaBeta;
+	    mutable bool _coefsChanged, _evolutionChanged, _basisChanged;
 	    double _rperpMin, _rparMin, _rperpMax, _rparMax;
 	    bool _metalModel, _metalModelInterpolate, _metalCIV, _toyMetal, _crossCorrelation;
 	    AbsCorrelationModel &_base;
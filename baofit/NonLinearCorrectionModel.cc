@@ -46,6 +46,10 @@ void local::NonLinearCorrectionModel::_initialize() {
 
 local::NonLinearCorrectionModel::~NonLinearCorrectionModel() { }
 
+void local::NonLinearCorrectionModel::setParameterLookup(ParameterLookup lookup) {
+    _lookup = lookup;
+}
+
 double local::NonLinearCorrectionModel::_evaluateKSpace(double k, double mu_k, double pk, double z) const {
     double growth, pecvelocity, pressure, nonlinearcorr;
     // Non-linear correction model of http://arxiv.org/abs/1506.04519
@@ -56,8 +60,8 @@ double local::NonLinearCorrectionModel::_evaluateKSpace(double k, double mu_k, d
         double bv = (*_bvInterpolator)(z);
         double kp = (*_kpInterpolator)(z);
         if(_fitNLCorrection) {
-            qnl = _base.getParameterValue(_indexBase);
-            kp = _base.getParameterValue(_indexBase+1);
+            qnl = _lookup ? _lookup(_indexBase) : _base.getParameterValue(_indexBase);
+            kp = _lookup ? _lookup(_indexBase+1) : _base.getParameterValue(_indexBase+1);
         }
         double sigma8Sim(0.8338);
         double pi(4*std::atan(1));
@@ -7,6 +7,8 @@
 
 #include "likely/types.h"
 
+#include "boost/function.hpp"
+
 namespace baofit {
 	// Represents a non-linear correction in the flux power spectrum model
 	class NonLinearCorrectionModel : public AbsCorrelationModel {
@@ -18,6 +20,11 @@ namespace baofit {
 	    NonLinearCorrectionModel(double zref, double sigma8, bool nlCorrection = false,
 	        bool fitNLCorrection = false, bool nlCorrectionAlt = false, AbsCorrelationModel *base = 0);
 	    virtual ~NonLinearCorrectionModel();
+	    // Function used to look up the value of a parameter by its index.
+	    typedef boost::function<double (int index)> ParameterLookup;
+	    // Uses the specified function to look up the values of our fitted parameters, instead
+	    // of asking our base model directly.
+	    void setParameterLookup(ParameterLookup lookup);
 	    // Prints a multi-line description of this object to the specified output stream.
         virtual void printToStream(std::ostream &out, std::string const &formatSpec = "%12.6f") const;
 	protected:
@@ -34,6 +41,7 @@ namespace baofit {
 	    void _initialize();
 	    mutable likely::InterpolatorPtr _qnlInterpolator, _kvInterpolator, _avInterpolator, _bvInterpolator, _kpInterpolator;
 	    AbsCorrelationModel &_base;
+	    ParameterLookup _lookup;
     }; // NonLinearCorrectionModel
 } // baofit
 
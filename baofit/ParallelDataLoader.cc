@@ -0,0 +1,92 @@
+// Created 16-Oct-2026 by agent <agent@local>
+
+#include "baofit/ParallelDataLoader.h"
+#include "baofit/RuntimeError.h"
+
+#include "boost/bind.hpp"
+
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+
+namespace local = baofit;
+
+local::ParallelDataLoader::ParallelDataLoader(std::vector<std::string> const &filenames,
+LoadFunction loader, int nthreads, int window)
+: _filenames(filenames), _loader(loader), _window(window), _parseThreads(1), _nextLoad(0), _nextDeliver(0),
+_stopped(false)
+{
+    if(nthreads <= 0) throw RuntimeError("ParallelDataLoader: expected nthreads > 0.");
+    _parseThreads = std::max(1,(int)boost::thread::hardware_concurrency()/nthreads);
+    if(_window <= 0) _window = 2*nthreads;
+    Slot empty = { false };
+    _slots.resize(_window,empty);
+    for(int k = 0; k < nthreads; ++k) {
+        _workers.create_thread(boost::bind(&ParallelDataLoader::_work,this));
+    }
+}
+
+local::ParallelDataLoader::~ParallelDataLoader() {
+    {
+        boost::mutex::scoped_lock lock(_mutex);
+        _stopped = true;
+    }
+    _changed.notify_all();
+    _workers.join_all();
+}
+
+void local::ParallelDataLoader::_work() {
+    int nfiles = _filenames.size();
+    while(true) {
+        // Claim the next file once there is room for it in our window.
+        int index;
+        {
+            boost::mutex::scoped_lock lock(_mutex);
+            while(!_stopped && _nextLoad < nfiles && _nextLoad >= _nextDeliver + _window) _changed.wait(lock);
+            if(_stopped || _nextLoad >= nfiles) return;
+            index = _nextLoad++;
+        }
+        // Load it without holding the lock.
+        AbsCorrelationDataPtr data;
+        std::ostringstream warnings;
+        std::string error;
+        try {
+            data = _loader(_filenames[index],_parseThreads,warnings);
+        }
+        catch(std::exception const &e) {
+            error = e.what();
+        }
+        // Store the result in its slot.
+        {
+            boost::mutex::scoped_lock lock(_mutex);
+            Slot &slot = _slots[index % _window];
+            slot.data = data;
+            slot.warnings = warnings.str();
+            slot.error = error;
+            slot.ready = true;
+        }
+        _changed.notify_all();
+    }
+}
+
+baofit::AbsCorrelationDataPtr local::ParallelDataLoader::next() {
+    if(_nextDeliver >= (int)_filenames.size()) {
+        throw RuntimeError("ParallelDataLoader::next: no more datasets.");
+    }
+    Slot slot;
+    {
+        boost::mutex::scoped_lock lock(_mutex);
+        Slot &mine = _slots[_nextDeliver % _window];
+        while(!mine.ready) _changed.wait(lock);
+        slot = mine;
+        // Release this slot for the next file to load.
+        mine.ready = false;
+        mine.data.reset();
+        _nextDeliver++;
+    }
+    _changed.notify_all();
+    std::cerr << slot.warnings;
+    if(slot.error.length() > 0) throw RuntimeError(slot.error);
+    return slot.data;
+}
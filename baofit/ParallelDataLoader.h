@@ -0,0 +1,57 @@
+// Created 16-Oct-2026 by agent <agent@local>
+
+#ifndef BAOFIT_PARALLEL_DATA_LOADER
+#define BAOFIT_PARALLEL_DATA_LOADER
+
+#include "baofit/types.h"
+
+#include "boost/function.hpp"
+#include "boost/thread.hpp"
+
+#include <iosfwd>
+#include <string>
+#include <vector>
+
+namespace baofit {
+	// Loads a list of correlation data files on a pool of worker threads and delivers
+	// them in their original order.
+	class ParallelDataLoader {
+	public:
+	    // Loads a single file using up to parseThreads threads to parse it, and returns the result.
+	    // Any warnings should be written to the stream provided, which is forwarded to std::cerr
+	    // by next() to preserve their order.
+	    typedef boost::function<AbsCorrelationDataPtr (std::string const &filename,
+	        int parseThreads, std::ostream &warnings)> LoadFunction;
+	    // Starts nthreads workers that call the specified function for each of the specified
+	    // files, sharing the available cores between them for parsing. At most window files
+	    // (two per thread if window <= 0) are held in memory at once, counting files being
+	    // loaded and files waiting to be delivered.
+	    ParallelDataLoader(std::vector<std::string> const &filenames, LoadFunction loader,
+	        int nthreads, int window = 0);
+	    // Stops any workers that are still running.
+	    virtual ~ParallelDataLoader();
+	    // Returns the next dataset in the original order, waiting for it to be loaded if
+	    // necessary. Throws a RuntimeError if loading this dataset failed, or if all datasets
+	    // have already been delivered.
+	    AbsCorrelationDataPtr next();
+	private:
+	    // Loads files until there are none left or we are stopped.
+	    void _work();
+	    std::vector<std::string> _filenames;
+	    LoadFunction _loader;
+	    int _window, _parseThreads, _nextLoad, _nextDeliver;
+	    bool _stopped;
+	    // Ring buffer of window slots, where file i uses slot i % window.
+	    struct Slot {
+	        bool ready;
+	        AbsCorrelationDataPtr data;
+	        std::string warnings, error;
+	    };
+	    std::vector<Slot> _slots;
+	    boost::mutex _mutex;
+	    boost::condition_variable _changed;
+	    boost::thread_group _workers;
+	}; // ParallelDataLoader
+} // baofit
+
+#endif // BAOFIT_PARALLEL_DATA_LOADER
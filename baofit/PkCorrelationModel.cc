@@ -248,6 +248,29 @@ bool anyChanged, int index) const {
     return _getNormFactor(multipole,z)*_xi(r,multipole);
 }
 
+void local::PkCorrelationModel::_evaluateAll(Coordinates const &coords, bool anyChanged,
+std::vector<double> &out) const {
+    // Normalization factors only need to be recalculated when the redshift changes.
+    double zLast(-1);
+    for(int i = 0; i < out.size(); ++i) {
+        double r(coords.r[i]), mu(coords.mu[i]), z(coords.z[i]);
+        if(z != zLast) {
+            _norm0 = _getNormFactor(cosmo::Monopole,z);
+            _norm2 = _getNormFactor(cosmo::Quadrupole,z);
+            _norm4 = _getNormFactor(cosmo::Hexadecapole,z);
+            zLast = z;
+        }
+        // Cache expensive sine integrals.
+        _fillCache(r);
+        // Calculate the Legendre weights.
+        double muSq(mu*mu);
+        double L2 = (3*muSq - 1)/2., L4 = (35*muSq*muSq - 30*muSq + 3)/8.;
+        // Put the pieces together.
+        out[i] = _norm0*_xi(r,cosmo::Monopole) + _norm2*L2*_xi(r,cosmo::Quadrupole) +
+            _norm4*L4*_xi(r,cosmo::Hexadecapole);
+    }
+}
+
 double local::PkCorrelationModel::_evaluateKSpace(double k, double mu_k, double pk, double z) const { return 0; }
 
 int local::PkCorrelationModel::_getIndexBase() const { return _indexBase; }
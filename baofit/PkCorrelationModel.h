@@ -38,6 +38,9 @@ namespace baofit {
         // Returns the correlation function for the specified multipole at co-moving pair separation
         // r and average pair redshift z.
         virtual double _evaluate(double r, cosmo::Multipole multipole, double z, bool anyChanged, int index) const;
+        // Fills the vector provided with the correlation function evaluated at each of the
+        // specified coordinates.
+        virtual void _evaluateAll(Coordinates const &coords, bool anyChanged, std::vector<double> &out) const;
         virtual double _evaluateKSpace(double k, double mu_k, double pk, double z) const;
         virtual int _getIndexBase() const;
 	private:
@@ -0,0 +1,217 @@
+// Created 16-Oct-2026 by agent <agent@local>
+
+#include "baofit/TextTableReader.h"
+#include "baofit/RuntimeError.h"
+
+#include "boost/lexical_cast.hpp"
+#include "boost/thread.hpp"
+#include "boost/bind.hpp"
+#include "boost/cstdint.hpp"
+#include "boost/interprocess/file_mapping.hpp"
+#include "boost/interprocess/mapped_region.hpp"
+
+#include <fstream>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+namespace local = baofit;
+
+namespace baofit {
+namespace text {
+    // Files smaller than this are parsed by a single thread.
+    const std::size_t minChunkSize = 1<<20;
+    // Powers of ten that are exactly representable as doubles.
+    const double exactPowersOfTen[] = {
+        1e0,1e1,1e2,1e3,1e4,1e5,1e6,1e7,1e8,1e9,1e10,1e11,
+        1e12,1e13,1e14,1e15,1e16,1e17,1e18,1e19,1e20,1e21,1e22
+    };
+    inline bool isSpace(char c) { return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f'; }
+    inline bool isDigit(char c) { return c >= '0' && c <= '9'; }
+    // Parses an optionally signed integer starting at ptr, after skipping any leading spaces.
+    // Advances ptr past the integer and returns true if successful.
+    inline bool parseInt(char const *&ptr, char const *end, int &value) {
+        while(ptr != end && isSpace(*ptr)) ++ptr;
+        bool negative(false);
+        if(ptr != end && (*ptr == '-' || *ptr == '+')) negative = (*ptr++ == '-');
+        if(ptr == end || !isDigit(*ptr)) return false;
+        boost::int64_t result(0);
+        while(ptr != end && isDigit(*ptr)) {
+            result = 10*result + (*ptr++ - '0');
+            if(result > 2147483648LL) return false;
+        }
+        if(!negative && result > 2147483647LL) return false;
+        value = negative ? -result : result;
+        return true;
+    }
+    // Parses a floating-point value starting at ptr, after skipping any leading spaces.
+    // Advances ptr past the value and returns true if successful. Values with at most
+    // 19 significant digits and a small decimal exponent are converted exactly using a
+    // single multiplication or division. Anything else (including nan and inf) is passed
+    // to strtod, so that the result is always correctly rounded.
+    inline bool parseFloat(char const *&ptr, char const *end, double &value) {
+        while(ptr != end && isSpace(*ptr)) ++ptr;
+        char const *start(ptr);
+        bool negative(false);
+        if(ptr != end && (*ptr == '-' || *ptr == '+')) negative = (*ptr++ == '-');
+        boost::uint64_t mantissa(0);
+        int ndigits(0), nsignificant(0), exponent(0);
+        while(ptr != end && isDigit(*ptr)) {
+            if(mantissa || *ptr != '0') {
+                mantissa = 10*mantissa + (*ptr - '0');
+                nsignificant++;
+            }
+            ++ptr;
+            ndigits++;
+        }
+        if(ptr != end && *ptr == '.') {
+            ++ptr;
+            while(ptr != end && isDigit(*ptr)) {
+                if(mantissa || *ptr != '0') {
+                    mantissa = 10*mantissa + (*ptr - '0');
+                    nsignificant++;
+                }
+                ++ptr;
+                ndigits++;
+                exponent--;
+            }
+        }
+        bool fast(ndigits > 0 && nsignificant <= 19);
+        if(fast && ptr != end && (*ptr == 'e' || *ptr == 'E')) {
+            char const *mark(ptr);
+            int expValue;
+            ++ptr;
+            if(ptr != end && (isDigit(*ptr) || *ptr == '-' || *ptr == '+') && parseInt(ptr,end,expValue)) {
+                exponent += expValue;
+            }
+            else {
+                // An 'e' without a valid exponent is not part of the number.
+                ptr = mark;
+            }
+        }
+        if(fast && mantissa <= (boost::uint64_t(1) << 53) && exponent >= -22 && exponent <= 22) {
+            value = (double)mantissa;
+            if(exponent < 0) value /= exactPowersOfTen[-exponent];
+            else value *= exactPowersOfTen[exponent];
+            if(negative) value = -value;
+            return true;
+        }
+        // Fall back to strtod on a null-terminated copy of this token.
+        char buffer[128];
+        std::size_t length(0);
+        for(ptr = start; ptr != end && !isSpace(*ptr) && *ptr != '\n' && length < sizeof(buffer)-1; ++ptr) {
+            buffer[length++] = *ptr;
+        }
+        buffer[length] = 0;
+        char *last;
+        value = std::strtod(buffer,&last);
+        if(last == buffer) return false;
+        ptr = start + (last - buffer);
+        return true;
+    }
+    // Holds the results of parsing one newline-aligned chunk of a file.
+    struct Chunk {
+        char const *begin, *end;
+        int nlines, errorLine;
+        std::vector<int> ints;
+        std::vector<double> floats;
+    };
+    // Parses each line of the specified chunk. Stops at the first line that cannot be parsed,
+    // and records its line number within this chunk, counting from one.
+    void parseChunk(Chunk &chunk, int nint, int nfloat) {
+        chunk.nlines = chunk.errorLine = 0;
+        char const *ptr(chunk.begin);
+        while(ptr != chunk.end) {
+            char const *eol = std::find(ptr,chunk.end,'\n');
+            chunk.nlines++;
+            int ivalue;
+            double fvalue;
+            for(int col = 0; col < nint; ++col) {
+                if(!parseInt(ptr,eol,ivalue)) {
+                    chunk.errorLine = chunk.nlines;
+                    return;
+                }
+                chunk.ints.push_back(ivalue);
+            }
+            for(int col = 0; col < nfloat; ++col) {
+                if(!parseFloat(ptr,eol,fvalue)) {
+                    chunk.errorLine = chunk.nlines;
+                    return;
+                }
+                chunk.floats.push_back(fvalue);
+            }
+            ptr = (eol == chunk.end) ? eol : eol + 1;
+        }
+    }
+} // text
+} // baofit
+
+local::TextTableReader::TextTableReader(std::string const &filename, int nint, int nfloat,
+std::string const &prefix, int nthreads)
+: _nint(nint), _nfloat(nfloat), _nlines(0)
+{
+    if(nint < 0 || nfloat < 0 || nint + nfloat == 0) {
+        throw RuntimeError("TextTableReader: invalid number of columns.");
+    }
+    std::size_t size;
+    {
+        std::ifstream in(filename.c_str(),std::ios::binary | std::ios::ate);
+        if(!in.good()) throw RuntimeError(prefix + ": Unable to open " + filename);
+        size = in.tellg();
+    }
+    if(0 == size) return;
+    namespace bip = boost::interprocess;
+    bip::mapped_region region;
+    try {
+        bip::file_mapping mapping(filename.c_str(),bip::read_only);
+        bip::mapped_region(mapping,bip::read_only).swap(region);
+    }
+    catch(bip::interprocess_exception const &e) {
+        throw RuntimeError(prefix + ": Unable to open " + filename);
+    }
+    char const *begin = static_cast<char const*>(region.get_address());
+    char const *end = begin + region.get_size();
+    // Split the file into newline-aligned chunks.
+    if(nthreads <= 0) nthreads = boost::thread::hardware_concurrency();
+    int nchunks = std::max(1,std::min(nthreads,(int)(size/text::minChunkSize)));
+    std::vector<text::Chunk> chunks(nchunks);
+    char const *ptr(begin);
+    for(int k = 0; k < nchunks; ++k) {
+        chunks[k].begin = ptr;
+        if(k == nchunks-1) {
+            ptr = end;
+        }
+        else {
+            ptr = std::min(end,std::max(ptr,begin + (k+1)*(size/nchunks)));
+            ptr = std::find(ptr,end,'\n');
+            if(ptr != end) ++ptr;
+        }
+        chunks[k].end = ptr;
+    }
+    // Parse each chunk in its own thread, using this thread for the first chunk.
+    boost::thread_group workers;
+    for(int k = 1; k < nchunks; ++k) {
+        workers.create_thread(boost::bind(&text::parseChunk,boost::ref(chunks[k]),nint,nfloat));
+    }
+    text::parseChunk(chunks[0],nint,nfloat);
+    workers.join_all();
+    // Report the first error in the file, if any.
+    for(int k = 0; k < nchunks; ++k) {
+        if(chunks[k].errorLine) {
+            throw RuntimeError(prefix + ": error reading line " +
+                boost::lexical_cast<std::string>(_nlines + chunks[k].errorLine) + " of " + filename);
+        }
+        _nlines += chunks[k].nlines;
+    }
+    // Concatenate the values parsed from each chunk.
+    _ints.reserve(_nlines*nint);
+    _floats.reserve(_nlines*nfloat);
+    for(int k = 0; k < nchunks; ++k) {
+        _ints.insert(_ints.end(),chunks[k].ints.begin(),chunks[k].ints.end());
+        _floats.insert(_floats.end(),chunks[k].floats.begin(),chunks[k].floats.end());
+        std::vector<int>().swap(chunks[k].ints);
+        std::vector<double>().swap(chunks[k].floats);
+    }
+}
+
+local::TextTableReader::~TextTableReader() { }
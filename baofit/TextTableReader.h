@@ -0,0 +1,45 @@
+// Created 16-Oct-2026 by agent <agent@local>
+
+#ifndef BAOFIT_TEXT_TABLE_READER
+#define BAOFIT_TEXT_TABLE_READER
+
+#include <string>
+#include <vector>
+
+namespace baofit {
+	// Reads a text file where each line contains whitespace-separated integer columns
+	// followed by floating-point columns, e.g., "index1 index2 value" triplets.
+	class TextTableReader {
+	public:
+	    // Reads the specified file, which should have nint integer values followed by nfloat
+	    // floating-point values on each line. Any remaining text on a line is ignored. The file is
+	    // memory mapped and split into newline-aligned chunks that are parsed in parallel by up to
+	    // nthreads threads, or one per available core if nthreads <= 0. The default is a single
+	    // thread, since callers might already be reading several files concurrently. Throws a
+	    // RuntimeError whose message starts with the specified prefix if the file cannot be
+	    // opened, or else reports the first line that could not be parsed.
+	    TextTableReader(std::string const &filename, int nint, int nfloat,
+	        std::string const &prefix, int nthreads = 1);
+	    virtual ~TextTableReader();
+	    // Returns the number of lines read.
+	    int getNLines() const;
+	    // Returns the integer value in the specified column of the specified line, where
+	    // lines are numbered from zero.
+	    int getInt(int line, int column) const;
+	    // Returns the floating-point value in the specified column of the specified line,
+	    // where lines are numbered from zero and columns start after the integer columns.
+	    double getFloat(int line, int column) const;
+	private:
+	    int _nint, _nfloat, _nlines;
+	    std::vector<int> _ints;
+	    std::vector<double> _floats;
+	}; // TextTableReader
+
+    inline int TextTableReader::getNLines() const { return _nlines; }
+    inline int TextTableReader::getInt(int line, int column) const { return _ints[line*_nint + column]; }
+    inline double TextTableReader::getFloat(int line, int column) const {
+        return _floats[line*_nfloat + column];
+    }
+} // baofit
+
+#endif // BAOFIT_TEXT_TABLE_READER
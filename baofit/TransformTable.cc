@@ -0,0 +1,112 @@
+// Created 16-Oct-2026 by agent <agent@local>
+
+#include "baofit/TransformTable.h"
+#include "baofit/RuntimeError.h"
+
+#include "cosmo/DistortedPowerCorrelation.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+namespace local = baofit;
+
+local::TransformTable::TransformTable(double rmin, double rmax, int nr, int ellMax)
+: _rmin(rmin), _nr(nr), _nell(ellMax/2+1)
+{
+    if(nr < 2) throw RuntimeError("TransformTable: expected nr >= 2.");
+    if(rmin >= rmax) throw RuntimeError("TransformTable: expected rmin < rmax.");
+    if(ellMax < 0 || ellMax % 2) throw RuntimeError("TransformTable: expected even ellMax >= 0.");
+    _dr = (rmax - rmin)/(nr - 1);
+    _values.resize(_nell*_nr,0);
+    _second.resize(_nell*_nr,0);
+}
+
+local::TransformTable::~TransformTable() { }
+
+void local::TransformTable::fill(cosmo::DistortedPowerCorrelation const &transform) {
+    for(int j = 0; j < _nell; ++j) {
+        double *values = &_values[j*_nr];
+        for(int i = 0; i < _nr; ++i) values[i] = transform.getCorrelationMultipole(_rmin + i*_dr,2*j);
+    }
+    _initializeSplines();
+}
+
+void local::TransformTable::combine(std::vector<TransformTablePtr> const &tables,
+std::vector<double> const &weights) {
+    if(tables.size() != weights.size()) {
+        throw RuntimeError("TransformTable::combine: expected the same number of tables and weights.");
+    }
+    std::fill(_values.begin(),_values.end(),0.);
+    std::fill(_second.begin(),_second.end(),0.);
+    for(int k = 0; k < tables.size(); ++k) {
+        TransformTable const &table = *tables[k];
+        if(table._values.size() != _values.size()) {
+            throw RuntimeError("TransformTable::combine: tables have different sizes.");
+        }
+        // Spline second derivatives are linear in the values so combine them directly.
+        double weight = weights[k];
+        if(0 == weight) continue;
+        for(int i = 0; i < _values.size(); ++i) {
+            _values[i] += weight*table._values[i];
+            _second[i] += weight*table._second[i];
+        }
+    }
+}
+
+void local::TransformTable::write(std::ostream &out) const {
+    out.write(reinterpret_cast<char const*>(&_values[0]),_values.size()*sizeof(double));
+    if(!out) throw RuntimeError("TransformTable::write: error writing table.");
+}
+
+void local::TransformTable::read(std::istream &in) {
+    in.read(reinterpret_cast<char*>(&_values[0]),_values.size()*sizeof(double));
+    if(!in) throw RuntimeError("TransformTable::read: error reading table.");
+    _initializeSplines();
+}
+
+void local::TransformTable::_initializeSplines() {
+    // Solve the tridiagonal system M[i-1] + 4 M[i] + M[i+1] = 6 (y[i-1] - 2 y[i] + y[i+1])/dr^2
+    // with natural boundary conditions M[0] = M[nr-1] = 0.
+    std::vector<double> diag(_nr);
+    double scale = 6/(_dr*_dr);
+    for(int j = 0; j < _nell; ++j) {
+        double const *y = &_values[j*_nr];
+        double *M = &_second[j*_nr];
+        M[0] = M[_nr-1] = 0;
+        if(_nr < 3) continue;
+        // Forward elimination.
+        diag[1] = 4;
+        M[1] = scale*(y[0] - 2*y[1] + y[2]);
+        for(int i = 2; i < _nr-1; ++i) {
+            double factor = 1/diag[i-1];
+            diag[i] = 4 - factor;
+            M[i] = scale*(y[i-1] - 2*y[i] + y[i+1]) - factor*M[i-1];
+        }
+        // Back substitution.
+        M[_nr-2] /= diag[_nr-2];
+        for(int i = _nr-3; i >= 1; --i) M[i] = (M[i] - M[i+1])/diag[i];
+    }
+}
+
+double local::TransformTable::getCorrelation(double r, double mu) const {
+    // Locate the spline interval containing r.
+    double x = (r - _rmin)/_dr;
+    int i = (int)std::floor(x);
+    if(i < 0) i = 0;
+    else if(i > _nr-2) i = _nr-2;
+    double b = x - i, a = 1 - b;
+    double ca = (a*a*a - a)*_dr*_dr/6, cb = (b*b*b - b)*_dr*_dr/6;
+    // Sum the multipoles weighted by Legendre polynomials, using their recursion relation
+    // to step through odd and even ell.
+    double result(0), Plo(1), Phi(mu);
+    for(int j = 0; j < _nell; ++j) {
+        int offset = j*_nr + i;
+        result += Plo*(a*_values[offset] + b*_values[offset+1] + ca*_second[offset] + cb*_second[offset+1]);
+        int ell = 2*j+1;
+        // Advance from (P_{ell-1},P_ell) to (P_{ell+1},P_{ell+2}).
+        Plo = ((2*ell+1)*mu*Phi - ell*Plo)/(ell+1);
+        Phi = ((2*ell+3)*mu*Plo - (ell+1)*Phi)/(ell+2);
+    }
+    return result;
+}
@@ -0,0 +1,45 @@
+// Created 16-Oct-2026 by agent <agent@local>
+
+#ifndef BAOFIT_TRANSFORM_TABLE
+#define BAOFIT_TRANSFORM_TABLE
+
+#include "baofit/types.h"
+
+#include "cosmo/types.h"
+
+#include <iosfwd>
+#include <vector>
+
+namespace baofit {
+	// Represents a snapshot of the even multipoles xi_ell(r) of a k-space transform, tabulated
+	// on a uniform radial grid and interpolated with natural cubic splines. Tables can be filled
+	// from a transform or combined linearly, and are evaluated independently of the transform
+	// they were filled from.
+	class TransformTable {
+	public:
+	    // Creates a new table of the even multipoles ell = 0,2,...,ellMax at nr points uniformly
+	    // spaced over [rmin,rmax]. The table is zero until it is filled.
+	    TransformTable(double rmin, double rmax, int nr, int ellMax);
+	    virtual ~TransformTable();
+	    // Fills this table with the multipoles of the specified transform.
+	    void fill(cosmo::DistortedPowerCorrelation const &transform);
+	    // Sets this table to a linear combination of the specified tables, which must all have
+	    // the same size as this table.
+	    void combine(std::vector<TransformTablePtr> const &tables, std::vector<double> const &weights);
+	    // Returns the correlation function at (r,mu), where rmin <= r <= rmax.
+	    double getCorrelation(double r, double mu) const;
+	    // Writes the tabulated values of this table to the specified binary stream.
+	    void write(std::ostream &out) const;
+	    // Reads tabulated values written by write() into this table, which must have the same size.
+	    void read(std::istream &in);
+	private:
+	    // Calculates the spline second derivatives of each multipole from its values.
+	    void _initializeSplines();
+	    double _rmin, _dr;
+	    int _nr, _nell;
+	    // Values and spline second derivatives, stored as [ell/2][r index].
+	    std::vector<double> _values, _second;
+	}; // TransformTable
+} // baofit
+
+#endif // BAOFIT_TRANSFORM_TABLE
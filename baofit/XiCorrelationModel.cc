@@ -185,6 +185,28 @@ bool anyChanged, int index) const {
     throw RuntimeError("XiCorrelationModel: invalid multipole.");
 }
 
+void local::XiCorrelationModel::_evaluateAll(Coordinates const &coords, bool anyChanged,
+std::vector<double> &out) const {
+    // Rebuild our interpolators, if necessary.
+    if(anyChanged) _initializeInterpolators();
+    // Normalization factors only need to be recalculated when the redshift changes.
+    double zLast(-1), norm0(0), norm2(0), norm4(0);
+    for(int i = 0; i < out.size(); ++i) {
+        double r(coords.r[i]), mu(coords.mu[i]), z(coords.z[i]);
+        if(z != zLast) {
+            norm0 = _getNormFactor(cosmo::Monopole,z);
+            norm2 = _getNormFactor(cosmo::Quadrupole,z);
+            norm4 = _getNormFactor(cosmo::Hexadecapole,z);
+            zLast = z;
+        }
+        // Calculate the Legendre weights.
+        double muSq(mu*mu);
+        double L2 = (3*muSq - 1)/2., L4 = (35*muSq*muSq - 30*muSq + 3)/8.;
+        // Put the pieces together.
+        out[i] = (norm0*(*_xi0)(r) + norm2*L2*(*_xi2)(r) + norm4*L4*(*_xi4)(r))/(r*r);
+    }
+}
+
 double local::XiCorrelationModel::_evaluateKSpace(double k, double mu_k, double pk, double z) const { return 0; }
 
 int local::XiCorrelationModel::_getIndexBase() const { return _indexBase; }
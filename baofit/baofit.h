@@ -22,3 +22,4 @@
 
 #include "baofit/CorrelationFitter.h"
 #include "baofit/CorrelationAnalyzer.h"
+#include "baofit/ParallelDataLoader.h"
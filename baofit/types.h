@@ -19,6 +19,10 @@ namespace baofit {
     typedef boost::shared_ptr<AbsCorrelationData> AbsCorrelationDataPtr;    
     typedef boost::shared_ptr<const AbsCorrelationData> AbsCorrelationDataCPtr;    
 
+    class TransformTable;
+    typedef boost::shared_ptr<TransformTable> TransformTablePtr;
+    typedef boost::shared_ptr<const TransformTable> TransformTableCPtr;
+
 } // baofit
 
 #endif // BAOFIT_TYPES
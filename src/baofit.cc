@@ -9,6 +9,8 @@
 #include "boost/format.hpp"
 #include "boost/smart_ptr.hpp"
 #include "boost/foreach.hpp"
+#include "boost/bind.hpp"
+#include "boost/lexical_cast.hpp"
 
 #include <fstream>
 #include <iostream>
@@ -16,9 +18,124 @@
 #include <vector>
 #include <algorithm>
 #include <stdexcept>
+#include <cstdio>
 
 namespace po = boost::program_options;
 
+// Loads a single data file, parsing it with up to parseThreads threads, and applies any requested
+// positive-definite check and mode scale corrections, writing any warnings to the stream provided.
+baofit::AbsCorrelationDataPtr loadAndFixData(std::string const &filename,
+baofit::AbsCorrelationDataCPtr prototype, bool verbose, bool loadICov, bool loadWData, bool customGrid,
+bool checkPosDef, std::vector<double> const &modeScales, int parseThreads, std::ostream &warnings) {
+    baofit::AbsCorrelationDataPtr data = baofit::loadCorrelationData(filename,prototype,verbose,
+        loadICov,loadWData,customGrid,parseThreads);
+    if(checkPosDef && !data->getCovarianceMatrix()->isPositiveDefinite()) {
+        warnings << "!!! Covariance matrix not positive-definite for "
+            << filename << std::endl;
+    }
+    if(modeScales.size() > 0) {
+        if(verbose) std::cout << "Correcting mode scales..." << std::endl;
+        data->rescaleEigenvalues(modeScales);
+    }
+    return data;
+}
+
+// Loads data files quietly with fixed options, for workers that load several files concurrently.
+struct QuietDataLoader {
+    baofit::AbsCorrelationDataCPtr prototype;
+    bool loadICov,loadWData,customGrid,checkPosDef;
+    std::vector<double> modeScales;
+    baofit::AbsCorrelationDataPtr operator()(std::string const &filename, int parseThreads,
+    std::ostream &warnings) const {
+        return loadAndFixData(filename,prototype,false,loadICov,loadWData,customGrid,checkPosDef,
+            modeScales,parseThreads,warnings);
+    }
+};
+
+// Builds a new fit model from the model options. Sampling analyses that run on several
+// threads use this to build a separate model for each thread, since models cache
+// intermediate results between evaluations.
+struct ModelBuilder {
+    std::string modelrootName,fiducialName,nowigglesName,distMatrixName,metalModelName,xiPoints,
+        xiMethod,distAdd,distMul,distMatrixDistAdd,distMatrixDistMul,emulatorGrid,emulatorFile;
+    double zref,OmegaMatter,kloSpline,khiSpline,rmin,rmax,dilmin,dilmax,relerr,abserr,distR0,zeff,
+        sigma8,dzmin,gridspacing,zcorr0,zcorr1,zcorr2,kxmax,abserrHybrid,relerrHybrid;
+    int nSpline,splineOrder,ellMax,samplesPerDecade,distMatrixOrder,ngridx,ngridy,ngridz,gridscaling,
+        transformCacheSize;
+    bool constrainedMultipoles,crossCorrelation,kspace,kspacefft,kspacehybrid,anisotropic,decoupled,
+        nlBroadband,nlCorrection,fitNLCorrection,nlCorrectionAlt,binSmooth,binSmoothAlt,hcdModel,
+        hcdModelAlt,uvfluctuation,radiationModel,smoothGauss,smoothLorentz,distMatrix,metalModel,
+        metalModelInterpolate,metalCIV,toyMetal,combinedBias,combinedScale,distortionAlt,
+        noDistortion,zNodeTransforms,zNodeInterpolate,rsdDecomposition,verbose;
+    std::vector<std::string> modelConfig;
+    // A previously built model whose k-space emulator tables should be shared, if any.
+    baofit::AbsCorrelationModelCPtr emulatorSource;
+    baofit::AbsCorrelationModelPtr operator()() const {
+        baofit::AbsCorrelationModelPtr model;
+        if(nSpline > 0) {
+            model.reset(new baofit::PkCorrelationModel(modelrootName,nowigglesName,
+                kloSpline,khiSpline,nSpline,splineOrder,!constrainedMultipoles,zref,OmegaMatter,
+                crossCorrelation));
+        }
+        else if(xiPoints.length() > 0) {
+            model.reset(new baofit::XiCorrelationModel(xiPoints,xiMethod,!constrainedMultipoles,
+                zref,OmegaMatter,crossCorrelation));
+        }
+        else if(kspace) {
+            // Build our fit model from tabulated P(k) on disk.
+            model.reset(new baofit::BaoKSpaceCorrelationModel(
+                modelrootName,fiducialName,nowigglesName,distMatrixName,metalModelName,
+                zref,OmegaMatter,rmin,rmax,dilmin,dilmax,relerr,abserr,ellMax,samplesPerDecade,
+                distAdd,distMul,distR0,zeff,sigma8,dzmin,distMatrixOrder,distMatrixDistAdd,
+                distMatrixDistMul,transformCacheSize,zNodeTransforms,zNodeInterpolate,rsdDecomposition,
+                emulatorGrid,emulatorFile,anisotropic,decoupled,nlBroadband,nlCorrection,fitNLCorrection,
+                nlCorrectionAlt,binSmooth,binSmoothAlt,hcdModel,hcdModelAlt,uvfluctuation,
+                radiationModel,smoothGauss,smoothLorentz,distMatrix,metalModel,metalModelInterpolate,
+                metalCIV,toyMetal,combinedBias,combinedScale,crossCorrelation,verbose));
+        }
+        else if(kspacefft) {
+            // Build our fit model from tabulated P(k) on disk and use a 3D FFT.
+            model.reset(new baofit::BaoKSpaceFftCorrelationModel(
+                modelrootName,fiducialName,nowigglesName,zref,OmegaMatter,
+                gridspacing,ngridx,ngridy,ngridz,distAdd,distMul,distR0,
+                zcorr0,zcorr1,zcorr2,sigma8,anisotropic,decoupled,nlBroadband,nlCorrection,
+                fitNLCorrection,nlCorrectionAlt,distortionAlt,noDistortion,crossCorrelation,verbose));
+        }
+        else if(kspacehybrid) {
+            // Build our fit model from tabulated P(k) on disk and use a hybrid transformation.
+            model.reset(new baofit::BaoKSpaceHybridCorrelationModel(
+                modelrootName,fiducialName,nowigglesName,zref,OmegaMatter,
+                kxmax,ngridx,gridspacing,ngridy,gridscaling,rmax,dilmax,abserrHybrid,relerrHybrid,
+                distAdd,distMul,distR0,zcorr0,zcorr1,zcorr2,sigma8,anisotropic,decoupled,
+                nlBroadband,nlCorrection,fitNLCorrection,nlCorrectionAlt,distortionAlt,noDistortion,
+                crossCorrelation,verbose));
+        }
+        else {
+            // Build our fit model from tabulated ell=0,2,4 correlation functions on disk.
+            model.reset(new baofit::BaoCorrelationModel(
+                modelrootName,fiducialName,nowigglesName,metalModelName,distAdd,distMul,
+                distR0,zref,OmegaMatter,anisotropic,decoupled,metalModel,metalModelInterpolate,
+                metalCIV,toyMetal,combinedBias,combinedScale,crossCorrelation));
+        }
+        // Configure our fit model parameters by applying all model-config options in turn,
+        // starting with those in the INI file and ending with any command-line options.
+        BOOST_FOREACH(std::string const &config, modelConfig) {
+            model->configureFitParameters(config);
+        }
+        // Build any k-space emulator now, using the configured parameter values, or share
+        // the tables already built by another model.
+        if(kspace && emulatorGrid.length() > 0) {
+            boost::shared_ptr<baofit::BaoKSpaceCorrelationModel> kspaceModel =
+                boost::dynamic_pointer_cast<baofit::BaoKSpaceCorrelationModel>(model);
+            boost::shared_ptr<const baofit::BaoKSpaceCorrelationModel> source =
+                boost::dynamic_pointer_cast<const baofit::BaoKSpaceCorrelationModel>(emulatorSource);
+            if(source) kspaceModel->shareEmulator(*source);
+            else kspaceModel->buildEmulator();
+        }
+        return model;
+    }
+};
+
 int main(int argc, char **argv) {
     
     // Configure option processing
@@ -30,15 +147,16 @@ int main(int argc, char **argv) {
         rVetoWidth,rVetoCenter,muMin,muMax,kloSpline,khiSpline,toymcScale,saveICovScale,
         zMin,zMax,llMin,llMax,sepMin,sepMax,distR0,zdump,relerr,abserr,dilmin,dilmax,
         rperpMin,rperpMax,rparMin,rparMax,gridspacing,kxmax,relerrHybrid,abserrHybrid,
-        zcorr0,zcorr1,zcorr2,zeff,sigma8,dzmin;
+        zcorr0,zcorr1,zcorr2,zeff,sigma8,dzmin,scanRefineDChiSq;
     int nsep,nz,maxPlates,bootstrapTrials,bootstrapSize,randomSeed,ndump,jackknifeDrop,lmin,lmax,
         mcmcSave,mcmcInterval,toymcSamples,reuseCov,nSpline,splineOrder,bootstrapCovTrials,
         projectModesNKeep,covSampleSize,ellMax,samplesPerDecade,ngridx,ngridy,ngridz,gridscaling,
-        distMatrixOrder;
+        distMatrixOrder,loadThreads,loadWindow,samplingThreads,scanCoarseStride,gradientThreads,
+        transformCacheSize;
     std::string modelrootName,fiducialName,nowigglesName,dataName,xiPoints,toymcConfig,
         platelistName,platerootName,iniName,refitConfig,minMethod,xiMethod,outputPrefix,altConfig,
         fixModeScales,distAdd,distMul,dataFormat,axis1Bins,axis2Bins,axis3Bins,distMatrixName,
-        distMatrixDistAdd,distMatrixDistMul,metalModelName;
+        distMatrixDistAdd,distMatrixDistMul,metalModelName,shardSpec,emulatorGrid,emulatorFile;
     std::vector<std::string> modelConfig;
 
     // Default values in quotes below are to avoid roundoff errors leading to ugly --help
@@ -73,6 +191,8 @@ int main(int argc, char **argv) {
             "Relative error target for k-space transforms")
         ("abserr", po::value<double>(&abserr)->default_value(1e-5),
             "Absolute error target for k-space transforms")
+        ("transform-cache-size", po::value<int>(&transformCacheSize)->default_value(0),
+            "Number of k-space transforms to cache for re-use when parameter values are revisited (0 disables).")
         ("kspace-fft", "Use a k-space model with 3D FFT (default is r-space)")
         ("gridspacing", po::value<double>(&gridspacing)->default_value(4),
             "Grid spacing in Mpc/h for 3D FFT.")
@@ -107,6 +227,13 @@ int main(int argc, char **argv) {
             "Second order correction of the effective redshift for each (r,mu) bin.")
         ("dzmin", po::value<double>(&dzmin)->default_value(0.5),
             "Minimum redshift step required for repeating the k-space to r-space transformation.")
+        ("z-node-transforms", "Keeps k-space transforms at redshift nodes separated by at least dzmin.")
+        ("z-node-interpolate", "Interpolates k-space transforms linearly between redshift nodes spaced by dzmin.")
+        ("rsd-decomposition", "Transforms each power of beta in the k-space model separately, so RSD changes need no transforms.")
+        ("emulator-grid", po::value<std::string>(&emulatorGrid)->default_value(""),
+            "Interpolates k-space transforms on a grid of parameter values, e.g. 'SigmaNL-perp={2:5}*7;1+f={1.5:2.5}*5'.")
+        ("emulator-file", po::value<std::string>(&emulatorFile)->default_value(""),
+            "Name of a file used to save and re-use the k-space transforms of the emulator grid.")
         ("zeff", po::value<double>(&zeff)->default_value(0),
             "Effective redshift used by the non-linear correction and UV fluctuation model.")
         ("sigma8", po::value<double>(&sigma8)->default_value(0.8338),
@@ -147,7 +274,7 @@ int main(int argc, char **argv) {
         ("smooth-lorentz", "Include line-of-sight smoothing (Lorentzian).")
         ("dist-matrix", "Uses distortion matrix to model continuum fitting broadband distortion.")
         ("dist-matrix-name", po::value<std::string>(&distMatrixName)->default_value(""),
-            "Distortion matrix will be read from the specified file. If not specified, the data name will be used by default.")
+            "Distortion matrix will be read from the specified file (<name>.dmat.bin if it exists, else <name>.dmat). If not specified, the data name will be used by default.")
         ("dist-matrix-order", po::value<int>(&distMatrixOrder)->default_value(2500),
             "Order of the (square) distortion matrix.")
         ("dist-matrix-dist-add", po::value<std::string>(&distMatrixDistAdd)->default_value(""),
@@ -184,11 +311,16 @@ int main(int argc, char **argv) {
         ("load-wdata", "Load inverse covariance weighed data (.wdata) instead of unweighted (.data)")
         ("max-plates", po::value<int>(&maxPlates)->default_value(0),
             "Maximum number of plates to load (zero uses all available plates).")
+        ("load-threads", po::value<int>(&loadThreads)->default_value(1),
+            "Number of threads to use for loading, validating and fixing plate files.")
+        ("load-window", po::value<int>(&loadWindow)->default_value(0),
+            "Maximum number of plates in memory while loading with load-threads > 1 (zero uses 2 per thread).")
         ("check-posdef", "Checks that each covariance is positive-definite (slow).")
         ("save-data", "Saves the combined (unweighted) data after final cuts.")
         ("save-icov", "Saves the inverse covariance of the combined data after final cuts.")
         ("save-icov-scale", po::value<double>(&saveICovScale)->default_value(1),
             "Scale factor applied to inverse covariance elements when using save-icov.")
+        ("save-binary", "Saves the combined (unweighted) data and inverse covariance after final cuts to a binary container save.corr.bin, which is loaded with load-icov.")
         ("fix-mode-scales", po::value<std::string>(&fixModeScales)->default_value(""),
             "Fixes covariance matrix using mode scales from the specified file.")
         ("project-modes-keep", po::value<int>(&projectModesNKeep)->default_value(0),
@@ -274,6 +406,10 @@ int main(int argc, char **argv) {
         ("compare-each-final", "Compares each observation to the combined data, after final cuts.")
         ("fit-each", "Fits each observation separately.")
         ("parameter-scan", "Refits at each point of the parameter binning grid.")
+        ("scan-refine-dchisq", po::value<double>(&scanRefineDChiSq)->default_value(0),
+            "Adaptive parameter scan that only refines cells within this delta chi-square of the minimum (zero scans every point).")
+        ("scan-coarse-stride", po::value<int>(&scanCoarseStride)->default_value(8),
+            "Initial spacing of grid points (a power of 2) for an adaptive parameter scan.")
         ("bootstrap-trials", po::value<int>(&bootstrapTrials)->default_value(0),
             "Number of bootstrap trials to run if a platelist was provided.")
         ("bootstrap-size", po::value<int>(&bootstrapSize)->default_value(0),
@@ -293,10 +429,19 @@ int main(int argc, char **argv) {
         ("toymc-save", "Saves first generated toy MC sample.")
         ("toymc-scale", po::value<double>(&toymcScale)->default_value(1),
             "Scales the covariance used for toy MC noise sampling (but not fitting).")
+        ("sampling-threads", po::value<int>(&samplingThreads)->default_value(1),
+            "Number of threads to use for toy MC, bootstrap, jackknife and fit-each analyses.")
+        ("resume", "Resumes interrupted toy MC, bootstrap, jackknife, fit-each and scan analyses from their output files.")
+        ("shard", po::value<std::string>(&shardSpec)->default_value(""),
+            "Only fits shard i/N (0 <= i < N) of toy MC, bootstrap, jackknife, fit-each and scan samples.")
         ("random-seed", po::value<int>(&randomSeed)->default_value(1966),
-            "Random seed to use for generating bootstrap samples.")
+            "Random seed to use for generating bootstrap and toy MC samples.")
         ("min-method", po::value<std::string>(&minMethod)->default_value("mn2::vmetric"),
             "Minimization method to use for fitting.")
+        ("profile-linear", "Solves for floating parameters that the model depends on linearly at each step of a fit.")
+        ("gradient", "Provides the minimizer with the chi-square gradient, using analytic model derivatives where available.")
+        ("gradient-threads", po::value<int>(&gradientThreads)->default_value(1),
+            "Number of threads to use for finite-difference gradients of the combined data fit and residuals.")
         ;
 
     allOptions.add(genericOptions).add(modelOptions).add(dataOptions)
@@ -354,6 +499,8 @@ int main(int argc, char **argv) {
         nlBroadband(vm.count("nl-broadband")), nlCorrection(vm.count("nl-correction")),
         fitNLCorrection(vm.count("fit-nl-correction")), nlCorrectionAlt(vm.count("nl-correction-alt")),
         distortionAlt(vm.count("distortion-alt")), noDistortion(vm.count("no-distortion")),
+        zNodeTransforms(vm.count("z-node-transforms")), zNodeInterpolate(vm.count("z-node-interpolate")),
+        rsdDecomposition(vm.count("rsd-decomposition")),
         binSmooth(vm.count("bin-smooth")), binSmoothAlt(vm.count("bin-smooth-alt")),
         hcdModel(vm.count("hcd-model")), hcdModelAlt(vm.count("hcd-model-alt")),
         uvfluctuation(vm.count("uvfluctuation")), radiationModel(vm.count("radiation-model")),
@@ -361,7 +508,24 @@ int main(int argc, char **argv) {
         distMatrix(vm.count("dist-matrix")), metalModel(vm.count("metal-model")),
         metalModelInterpolate(vm.count("metal-model-interpolate")), metalCIV(vm.count("metal-civ")),
         toyMetal(vm.count("toy-metal")), customGrid(vm.count("custom-grid")),
-        combinedBias(vm.count("combined-bias")), combinedScale(vm.count("combined-scale"));
+        combinedBias(vm.count("combined-bias")), combinedScale(vm.count("combined-scale")),
+        saveBinary(vm.count("save-binary")), resume(vm.count("resume")),
+        profileLinear(vm.count("profile-linear")), gradient(vm.count("gradient"));
+
+    // Parse any shard specification.
+    int shardIndex(0), shardCount(1);
+    std::string shardTag;
+    if(shardSpec.length() > 0) {
+        char extra;
+        if(2 != std::sscanf(shardSpec.c_str(),"%d/%d%c",&shardIndex,&shardCount,&extra) ||
+        shardCount < 1 || shardIndex < 0 || shardIndex >= shardCount) {
+            std::cerr << "Expected --shard i/N with 0 <= i < N but got " << shardSpec << std::endl;
+            return -1;
+        }
+        // Each shard saves its samples to its own files, e.g. bs-2of8.dat
+        shardTag = "-" + boost::lexical_cast<std::string>(shardIndex) + "of" +
+            boost::lexical_cast<std::string>(shardCount);
+    }
 
     // Check that we have a recognized data format.
     if(dataFormat != "comoving-cartesian" && dataFormat != "comoving-polar" &&
@@ -404,64 +568,60 @@ int main(int argc, char **argv) {
     // Initialize our analyzer.
     likely::Random::instance()->setSeed(randomSeed);
     baofit::CorrelationAnalyzer analyzer(minMethod,rmin,rmax,covSampleSize,verbose,scalarWeights);
+    // Combine observations as they are loaded, and discard them, unless an analysis needs
+    // access to the individual observations.
+    bool streaming = !scalarWeights && 0 == bootstrapTrials && 0 == jackknifeDrop && !fitEach &&
+        !compareEach && !compareEachFinal && 0 == bootstrapCovTrials;
+    analyzer.setStreaming(streaming);
+    analyzer.setResume(resume);
+    analyzer.setShard(shardIndex,shardCount);
+    analyzer.setRandomSeed(randomSeed);
+    analyzer.setProfileLinear(profileLinear);
 
     // Initialize the fit model we will use.
+    ModelBuilder buildModel;
+    buildModel.modelrootName = modelrootName; buildModel.fiducialName = fiducialName;
+    buildModel.nowigglesName = nowigglesName; buildModel.distMatrixName = distMatrixName;
+    buildModel.metalModelName = metalModelName; buildModel.xiPoints = xiPoints;
+    buildModel.xiMethod = xiMethod; buildModel.distAdd = distAdd; buildModel.distMul = distMul;
+    buildModel.distMatrixDistAdd = distMatrixDistAdd; buildModel.distMatrixDistMul = distMatrixDistMul;
+    buildModel.zref = zref; buildModel.OmegaMatter = OmegaMatter; buildModel.kloSpline = kloSpline;
+    buildModel.khiSpline = khiSpline; buildModel.rmin = rmin; buildModel.rmax = rmax;
+    buildModel.dilmin = dilmin; buildModel.dilmax = dilmax; buildModel.relerr = relerr;
+    buildModel.abserr = abserr; buildModel.distR0 = distR0; buildModel.zeff = zeff;
+    buildModel.sigma8 = sigma8; buildModel.dzmin = dzmin; buildModel.gridspacing = gridspacing;
+    buildModel.zcorr0 = zcorr0; buildModel.zcorr1 = zcorr1; buildModel.zcorr2 = zcorr2;
+    buildModel.kxmax = kxmax; buildModel.abserrHybrid = abserrHybrid; buildModel.relerrHybrid = relerrHybrid;
+    buildModel.nSpline = nSpline; buildModel.splineOrder = splineOrder; buildModel.ellMax = ellMax;
+    buildModel.samplesPerDecade = samplesPerDecade; buildModel.distMatrixOrder = distMatrixOrder;
+    buildModel.transformCacheSize = transformCacheSize;
+    buildModel.ngridx = ngridx; buildModel.ngridy = ngridy; buildModel.ngridz = ngridz;
+    buildModel.gridscaling = gridscaling; buildModel.constrainedMultipoles = constrainedMultipoles;
+    buildModel.crossCorrelation = crossCorrelation; buildModel.kspace = kspace;
+    buildModel.kspacefft = kspacefft; buildModel.kspacehybrid = kspacehybrid;
+    buildModel.anisotropic = anisotropic; buildModel.decoupled = decoupled;
+    buildModel.nlBroadband = nlBroadband; buildModel.nlCorrection = nlCorrection;
+    buildModel.fitNLCorrection = fitNLCorrection; buildModel.nlCorrectionAlt = nlCorrectionAlt;
+    buildModel.binSmooth = binSmooth; buildModel.binSmoothAlt = binSmoothAlt;
+    buildModel.hcdModel = hcdModel; buildModel.hcdModelAlt = hcdModelAlt;
+    buildModel.uvfluctuation = uvfluctuation; buildModel.radiationModel = radiationModel;
+    buildModel.smoothGauss = smoothGauss; buildModel.smoothLorentz = smoothLorentz;
+    buildModel.distMatrix = distMatrix; buildModel.metalModel = metalModel;
+    buildModel.metalModelInterpolate = metalModelInterpolate; buildModel.metalCIV = metalCIV;
+    buildModel.toyMetal = toyMetal; buildModel.combinedBias = combinedBias;
+    buildModel.combinedScale = combinedScale; buildModel.distortionAlt = distortionAlt;
+    buildModel.noDistortion = noDistortion; buildModel.zNodeTransforms = zNodeTransforms;
+    buildModel.zNodeInterpolate = zNodeInterpolate; buildModel.rsdDecomposition = rsdDecomposition;
+    buildModel.emulatorGrid = emulatorGrid; buildModel.emulatorFile = emulatorFile;
+    buildModel.verbose = verbose;
+    buildModel.modelConfig = modelConfig;
     cosmo::AbsHomogeneousUniversePtr cosmology;
     baofit::AbsCorrelationModelPtr model;
     try {
         // Build the homogeneous cosmology we will use.
         cosmology.reset(new cosmo::LambdaCdmRadiationUniverse(OmegaMatter,0,hubbleConstant));
-        
-        if(nSpline > 0) {
-            model.reset(new baofit::PkCorrelationModel(modelrootName,nowigglesName,
-                kloSpline,khiSpline,nSpline,splineOrder,!constrainedMultipoles,zref,OmegaMatter,
-                crossCorrelation));
-        }
-        else if(xiPoints.length() > 0) {
-            model.reset(new baofit::XiCorrelationModel(xiPoints,xiMethod,!constrainedMultipoles,
-                zref,OmegaMatter,crossCorrelation));
-        }
-        else if(kspace) {
-            // Build our fit model from tabulated P(k) on disk.
-            model.reset(new baofit::BaoKSpaceCorrelationModel(
-                modelrootName,fiducialName,nowigglesName,distMatrixName,metalModelName,
-                zref,OmegaMatter,rmin,rmax,dilmin,dilmax,relerr,abserr,ellMax,samplesPerDecade,
-                distAdd,distMul,distR0,zeff,sigma8,dzmin,distMatrixOrder,distMatrixDistAdd,
-                distMatrixDistMul,anisotropic,decoupled,nlBroadband,nlCorrection,fitNLCorrection,
-                nlCorrectionAlt,binSmooth,binSmoothAlt,hcdModel,hcdModelAlt,uvfluctuation,
-                radiationModel,smoothGauss,smoothLorentz,distMatrix,metalModel,metalModelInterpolate,
-                metalCIV,toyMetal,combinedBias,combinedScale,crossCorrelation,verbose));
-        }
-        else if(kspacefft) {
-            // Build our fit model from tabulated P(k) on disk and use a 3D FFT.
-            model.reset(new baofit::BaoKSpaceFftCorrelationModel(
-                modelrootName,fiducialName,nowigglesName,zref,OmegaMatter,
-                gridspacing,ngridx,ngridy,ngridz,distAdd,distMul,distR0,
-                zcorr0,zcorr1,zcorr2,sigma8,anisotropic,decoupled,nlBroadband,nlCorrection,
-                fitNLCorrection,nlCorrectionAlt,distortionAlt,noDistortion,crossCorrelation,verbose));
-        }
-        else if(kspacehybrid) {
-            // Build our fit model from tabulated P(k) on disk and use a hybrid transformation.
-            model.reset(new baofit::BaoKSpaceHybridCorrelationModel(
-                modelrootName,fiducialName,nowigglesName,zref,OmegaMatter,
-                kxmax,ngridx,gridspacing,ngridy,gridscaling,rmax,dilmax,abserrHybrid,relerrHybrid,
-                distAdd,distMul,distR0,zcorr0,zcorr1,zcorr2,sigma8,anisotropic,decoupled,
-                nlBroadband,nlCorrection,fitNLCorrection,nlCorrectionAlt,distortionAlt,noDistortion,
-                crossCorrelation,verbose));
-        }
-        else {
-            // Build our fit model from tabulated ell=0,2,4 correlation functions on disk.
-            model.reset(new baofit::BaoCorrelationModel(
-                modelrootName,fiducialName,nowigglesName,metalModelName,distAdd,distMul,
-                distR0,zref,OmegaMatter,anisotropic,decoupled,metalModel,metalModelInterpolate,
-                metalCIV,toyMetal,combinedBias,combinedScale,crossCorrelation));
-        }
-             
-        // Configure our fit model parameters by applying all model-config options in turn,
-        // starting with those in the INI file and ending with any command-line options.
-        BOOST_FOREACH(std::string const &config, modelConfig) {
-            model->configureFitParameters(config);
-        }
+
+        model = buildModel();
 
         if(verbose) std::cout << "Model initialized." << std::endl;
     }
@@ -471,6 +631,19 @@ int main(int argc, char **argv) {
     }
     if(verbose) model->printToStream(std::cout);
     analyzer.setModel(model);
+    if(samplingThreads > 1) {
+        // Each sampling thread builds its own model, quietly since it duplicates the model above.
+        ModelBuilder buildWorkerModel(buildModel);
+        buildWorkerModel.verbose = false;
+        buildWorkerModel.emulatorSource = model;
+        analyzer.setSamplingThreads(samplingThreads,buildWorkerModel);
+    }
+    if(gradient || (calculateGradients && gradientThreads > 1)) {
+        ModelBuilder buildWorkerModel(buildModel);
+        buildWorkerModel.verbose = false;
+        buildWorkerModel.emulatorSource = model;
+        analyzer.setGradient(gradient,gradientThreads,buildWorkerModel);
+    }
     
     // Load the data we will fit.
     baofit::AbsCorrelationDataCPtr combined;
@@ -557,19 +730,34 @@ int main(int argc, char **argv) {
             }
         }
         
-        // Load each file into our analyzer.
+        // Load each file into our analyzer, in the order they were listed.
         int reuseCovIndex(-1); // each subsample has its own matching (i)cov file
+        boost::scoped_ptr<baofit::ParallelDataLoader> loader;
+        if(verbose && analyzer.isStreaming() && filelist.size() > 1) {
+            std::cout << "Combining observations as they are loaded (no resampling analysis requested)."
+                << std::endl;
+        }
+        if(loadThreads > 1) {
+            // Individual files are loaded quietly, since workers run concurrently.
+            if(verbose) {
+                std::cout << "Loading " << filelist.size() << " files using " << loadThreads
+                    << " threads..." << std::endl;
+            }
+            QuietDataLoader loadQuietly;
+            loadQuietly.prototype = prototype;
+            loadQuietly.loadICov = loadICov;
+            loadQuietly.loadWData = loadWData;
+            loadQuietly.customGrid = customGrid;
+            loadQuietly.checkPosDef = checkPosDef;
+            loadQuietly.modeScales = modeScales;
+            loader.reset(new baofit::ParallelDataLoader(filelist,loadQuietly,loadThreads,loadWindow));
+        }
         for(std::vector<std::string>::const_iterator filename = filelist.begin();
         filename != filelist.end(); ++filename) {
-            baofit::AbsCorrelationDataPtr data =
-                baofit::loadCorrelationData(*filename,prototype,verbose,loadICov,loadWData,customGrid);
-            if(checkPosDef && !data->getCovarianceMatrix()->isPositiveDefinite()) {
-                std::cerr << "!!! Covariance matrix not positive-definite for "
-                    << *filename << std::endl;
-            }
+            baofit::AbsCorrelationDataPtr data = loader ? loader->next() :
+                loadAndFixData(*filename,prototype,verbose,loadICov,loadWData,customGrid,
+                    checkPosDef,modeScales,0,std::cerr);
             if(modeScales.size() > 0) {
-                if(verbose) std::cout << "Correcting mode scales..." << std::endl;
-                data->rescaleEigenvalues(modeScales);
                 {
                     std::string outName = outputPrefix + "fixed.data";
                     std::ofstream out(outName.c_str());
@@ -611,6 +799,11 @@ int main(int argc, char **argv) {
             std::cerr << "Combined covariance matrix is not positive definite." << std::endl;
             return -3;
         }
+        // Save the combined (unweighted) data and inverse covariance to a binary
+        // container, if requested, that can be loaded using the name prefix + "save".
+        if(saveBinary) {
+            baofit::saveCorrelationDataBinary(outputPrefix + "save.corr.bin",combined);
+        }
         // Save the combined (unweighted) data, if requested.
         if(saveData) {
             std::string outName = outputPrefix + "save.data";
@@ -786,7 +979,7 @@ int main(int argc, char **argv) {
         }
         // Generate and fit MC samples, if requested.
         if(toymcSamples > 0) {
-            std::string outName = outputPrefix + "toymc.dat";
+            std::string outName = outputPrefix + "toymc" + shardTag + ".dat";
             std::string toymcSaveName;
             if(toymcSave) toymcSaveName = outputPrefix + "toymcsave.data";
             analyzer.doToyMCSampling(toymcSamples,toymcConfig,toymcSaveName,toymcScale,
@@ -794,23 +987,24 @@ int main(int argc, char **argv) {
         }
         // Perform a bootstrap analysis, if requested.
         if(bootstrapTrials > 0) {
-            std::string outName = outputPrefix + "bs.dat";
+            std::string outName = outputPrefix + "bs" + shardTag + ".dat";
             analyzer.doBootstrapAnalysis(bootstrapTrials,bootstrapSize,fixCovariance,
                 fmin,fmin2,refitConfig,outName,ndump,zdump);
         }
         // Perform a jackknife analysis, if requested.
         if(jackknifeDrop > 0) {
-            std::string outName = outputPrefix + "jk.dat";
+            std::string outName = outputPrefix + "jk" + shardTag + ".dat";
             analyzer.doJackknifeAnalysis(jackknifeDrop,fmin,fmin2,refitConfig,outName,ndump,zdump);
         }
         // Fit each observation separately, if requested.
         if(fitEach) {
-            std::string outName = outputPrefix + "each.dat";
+            std::string outName = outputPrefix + "each" + shardTag + ".dat";
             analyzer.fitEach(fmin,fmin2,refitConfig,outName,ndump,zdump);
         }
         // Refit on the parameter grid specified by each parameter's binning spec.
         if(parameterScan) {
-            analyzer.parameterScan(fmin,combined,outputPrefix + "scan.dat",ndump,zdump);
+            analyzer.parameterScan(fmin,combined,outputPrefix + "scan" + shardTag + ".dat",ndump,zdump,
+                scanRefineDChiSq,scanCoarseStride);
         }
     }
     catch(std::runtime_error const &e) {
@@ -0,0 +1,75 @@
+// Created 16-Oct-2026 by agent <agent@local>
+
+#include "baofit/baofit.h"
+
+#include "boost/program_options.hpp"
+
+#include <iostream>
+#include <string>
+#include <stdexcept>
+
+namespace po = boost::program_options;
+
+int main(int argc, char **argv) {
+
+    // Configure option processing
+    po::options_description allOptions(
+        "Converts a text distortion matrix <name>.dmat to the binary format <name>.dmat.bin");
+
+    std::string distMatrixName,outputName;
+    int distMatrixOrder;
+
+    allOptions.add_options()
+        ("help,h", "Prints this info and exits.")
+        ("quiet,q", "Runs in quiet mode.")
+        ("dist-matrix-name", po::value<std::string>(&distMatrixName)->default_value(""),
+            "Name of the distortion matrix to convert, without the .dmat extension.")
+        ("dist-matrix-order", po::value<int>(&distMatrixOrder)->default_value(2500),
+            "Order of the distortion matrix.")
+        ("output", po::value<std::string>(&outputName)->default_value(""),
+            "Name of the binary file to write (default is <dist-matrix-name>.dmat.bin).")
+        ("single-precision", "Stores matrix elements as float32 instead of float64.")
+        ;
+
+    // Do the command line parsing now.
+    po::variables_map vm;
+    try {
+        po::store(po::parse_command_line(argc, argv, allOptions), vm);
+        po::notify(vm);
+    }
+    catch(std::exception const &e) {
+        std::cerr << "Unable to parse command line options: " << e.what() << std::endl;
+        return -1;
+    }
+    if(vm.count("help")) {
+        std::cout << allOptions << std::endl;
+        return 1;
+    }
+    bool verbose(0 == vm.count("quiet")), singlePrecision(vm.count("single-precision"));
+
+    if(0 == distMatrixName.length()) {
+        std::cerr << "Missing required parameter --dist-matrix-name." << std::endl;
+        return -1;
+    }
+    if(0 == outputName.length()) outputName = distMatrixName + ".dmat.bin";
+    if(outputName == distMatrixName + ".dmat") {
+        std::cerr << "Refusing to overwrite the input text file." << std::endl;
+        return -1;
+    }
+
+    try {
+        // Always read the text format here, even if a binary file already exists.
+        baofit::DistortionMatrix distMat(distMatrixName,distMatrixOrder,verbose,false);
+        distMat.saveBinary(outputName,singlePrecision);
+        if(verbose) {
+            std::cout << "Saved distortion matrix of order " << distMat.getOrder()
+                << (singlePrecision ? " (float32)" : " (float64)") << " to " << outputName << std::endl;
+        }
+    }
+    catch(std::runtime_error const &e) {
+        std::cerr << "ERROR during conversion:\n  " << e.what() << std::endl;
+        return -2;
+    }
+    // All done: normal exit.
+    return 0;
+}
@@ -0,0 +1,209 @@
+// Created 16-Oct-2026 by agent <agent@local>
+
+#include "likely/likely.h"
+
+#include "boost/program_options.hpp"
+#include "boost/foreach.hpp"
+
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <stdexcept>
+
+namespace po = boost::program_options;
+
+// The contents of one output file of a sharded analysis.
+struct Shard {
+    std::string name;
+    std::vector<std::string> header, rows;
+};
+
+// Reads the three header lines and complete sample lines of the named file.
+void readShard(std::string const &name, Shard &shard) {
+    std::ifstream in(name.c_str());
+    if(!in.good()) throw std::runtime_error("Unable to open " + name);
+    shard.name = name;
+    std::string line;
+    while(std::getline(in,line)) {
+        // A final line without a newline was interrupted while being written.
+        if(in.eof()) break;
+        if(shard.header.size() < 3) shard.header.push_back(line);
+        else shard.rows.push_back(line);
+    }
+    if(shard.header.size() < 3) throw std::runtime_error("Missing header lines in " + name);
+}
+
+// Reads whitespace-separated values from a line into the vector provided.
+void readValues(std::string const &line, std::vector<double> &values) {
+    std::istringstream in(line);
+    values.resize(0);
+    double value;
+    while(in >> value) values.push_back(value);
+}
+
+int main(int argc, char **argv) {
+
+    // Configure option processing
+    po::options_description allOptions(
+        "Merges the output files of a sharded baofit sampling analysis or parameter scan");
+
+    std::string outputName;
+    std::vector<std::string> shardNames;
+
+    allOptions.add_options()
+        ("help,h", "Prints this info and exits.")
+        ("quiet,q", "Runs in quiet mode.")
+        ("output", po::value<std::string>(&outputName)->default_value(""),
+            "Name of the merged output file to write.")
+        ("scan", "Merges a parameter scan by concatenating shards (default interleaves samples).")
+        ("shards", po::value<std::vector<std::string> >(&shardNames)->multitoken(),
+            "Names of the shard output files, in shard order 0,1,...,N-1.")
+        ;
+    po::positional_options_description positional;
+    positional.add("shards",-1);
+
+    // Do the command line parsing now.
+    po::variables_map vm;
+    try {
+        po::store(po::command_line_parser(argc,argv).options(allOptions).positional(positional).run(), vm);
+        po::notify(vm);
+    }
+    catch(std::exception const &e) {
+        std::cerr << "Unable to parse command line options: " << e.what() << std::endl;
+        return -1;
+    }
+    if(vm.count("help")) {
+        std::cout << allOptions << std::endl;
+        return 1;
+    }
+    bool verbose(0 == vm.count("quiet")), scan(vm.count("scan"));
+
+    if(0 == outputName.length()) {
+        std::cerr << "Missing required parameter --output." << std::endl;
+        return -1;
+    }
+    if(0 == shardNames.size()) {
+        std::cerr << "No shard files to merge." << std::endl;
+        return -1;
+    }
+
+    try {
+        // Read each shard.
+        int nshards = shardNames.size();
+        std::vector<Shard> shards(nshards);
+        for(int k = 0; k < nshards; ++k) {
+            readShard(shardNames[k],shards[k]);
+            if(shards[k].header[0] != shards[0].header[0]) {
+                throw std::runtime_error("Header of " + shardNames[k] + " does not match " + shardNames[0]);
+            }
+        }
+        // Merge the samples. A sampling analysis shard i fits samples i, i+N, i+2N, ... so these
+        // are interleaved to recover the unsharded order. A parameter scan shard i fits the i-th
+        // block of grid points, so these are concatenated.
+        std::vector<std::string> rows;
+        if(scan) {
+            BOOST_FOREACH(Shard const &shard, shards) {
+                rows.insert(rows.end(),shard.rows.begin(),shard.rows.end());
+            }
+        }
+        else {
+            int nrows(0);
+            BOOST_FOREACH(Shard const &shard, shards) nrows += shard.rows.size();
+            for(int index = 0; index < nrows; ++index) {
+                Shard const &shard = shards[index % nshards];
+                if(index/nshards >= shard.rows.size()) {
+                    throw std::runtime_error("Shard " + shard.name + " is incomplete.");
+                }
+                rows.push_back(shard.rows[index/nshards]);
+            }
+        }
+        // Write the merged output file.
+        std::ofstream out(outputName.c_str());
+        BOOST_FOREACH(std::string const &line, shards[0].header) out << line << std::endl;
+        BOOST_FOREACH(std::string const &line, rows) out << line << std::endl;
+        out.close();
+        if(verbose) {
+            std::cout << "Merged " << rows.size() << " samples from " << nshards << " shards into "
+                << outputName << std::endl;
+        }
+        if(scan) return 0;
+
+        // Rebuild the fit parameters of the input fits using the names and floating states saved
+        // with the first shard, and the values and errors saved in its header.
+        std::string paramsName = shardNames[0] + ".params";
+        std::ifstream params(paramsName.c_str());
+        if(!params.good()) {
+            std::cerr << "Unable to open " << paramsName << " so no statistics will be printed." << std::endl;
+            return 0;
+        }
+        std::vector<double> header, errors, values;
+        readValues(shards[0].header[0],header);
+        int npar(header[0]), nfits(header[2]);
+        readValues(shards[0].header[1],errors);
+        readValues(shards[0].header[2],values);
+        if(errors.size() < nfits*npar || values.size() < nfits*(npar+1)) {
+            throw std::runtime_error("Badly formatted header in " + shardNames[0]);
+        }
+        std::vector<likely::FitParameters> fitParams(nfits);
+        std::vector<std::vector<bool> > floating(nfits);
+        std::string line;
+        for(int k = 0; k < npar; ++k) {
+            std::getline(params,line);
+            std::istringstream in(line);
+            bool floating1, floating2;
+            std::string name;
+            if(!(in >> floating1 >> floating2) || !std::getline(in >> std::ws,name)) {
+                throw std::runtime_error("Badly formatted " + paramsName);
+            }
+            for(int fit = 0; fit < nfits; ++fit) {
+                likely::FitParameter param(name,values[fit*(npar+1)+k],errors[fit*npar+k]);
+                bool isFloating = (0 == fit) ? floating1 : floating2;
+                if(!isFloating) param.fix(param.getValue());
+                fitParams[fit].push_back(param);
+                floating[fit].push_back(isFloating);
+            }
+        }
+        // Accumulate statistics for each fit, skipping samples where any fit failed, which
+        // are saved with a chi-square of zero.
+        std::vector<likely::FitParameterStatisticsPtr> stats(nfits);
+        for(int fit = 0; fit < nfits; ++fit) {
+            stats[fit].reset(new likely::FitParameterStatistics(fitParams[fit]));
+        }
+        int nInvalid(0);
+        likely::Parameters pfloating;
+        BOOST_FOREACH(std::string const &row, rows) {
+            readValues(row,values);
+            bool ok(true);
+            for(int fit = 0; fit < nfits; ++fit) {
+                if(values.size() < (fit+1)*(npar+1) || 0 == values[fit*(npar+1)+npar]) ok = false;
+            }
+            if(!ok) {
+                nInvalid++;
+                continue;
+            }
+            for(int fit = 0; fit < nfits; ++fit) {
+                pfloating.resize(0);
+                for(int k = 0; k < npar; ++k) {
+                    if(floating[fit][k]) pfloating.push_back(values[fit*(npar+1)+k]);
+                }
+                stats[fit]->update(pfloating,values[fit*(npar+1)+npar]/2);
+            }
+        }
+        // Print a summary of the merged analysis results.
+        std::cout << std::endl << "== Merged Fit Results (" << rows.size() << " samples, "
+            << nInvalid << " invalid):" << std::endl;
+        stats[0]->printToStream(std::cout);
+        if(nfits > 1) {
+            std::cout << std::endl << "== Merged Re-Fit Results:" << std::endl;
+            stats[1]->printToStream(std::cout);
+        }
+    }
+    catch(std::runtime_error const &e) {
+        std::cerr << "ERROR during merge:\n  " << e.what() << std::endl;
+        return -2;
+    }
+    // All done: normal exit.
+    return 0;
+}